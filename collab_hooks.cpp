@@ -535,7 +535,7 @@ func_t *func_from_frame(struc_t *frame) {
 void idp_undefine(ea_t ea) {
    //send address to server
    json_object *obj = json_object_new_object();
-   if (send_json(ea, COMMAND_UNDEFINE, obj) == 0) {
+   if (send_update(ea, COMMAND_UNDEFINE, obj) == 0) {
       qstring s;
       format_llx(ea, s);
       msg(PLUGIN_NAME": send error on undefine 0x%s\n", s.c_str());
@@ -546,7 +546,7 @@ void idp_make_code(ea_t ea, asize_t len) {
    //send address and length to server
    json_object *obj = json_object_new_object();
    append_json_uint64_val(obj, "length", (uint64_t)len);
-   if (send_json(ea, COMMAND_MAKE_CODE, obj) == 0) {
+   if (send_update(ea, COMMAND_MAKE_CODE, obj) == 0) {
       qstring s;
       format_llx(ea, s);
       msg(PLUGIN_NAME": send error on make_code 0x%s, %d\n", s.c_str(), (int)len);
@@ -570,7 +570,7 @@ void idp_make_data(ea_t ea, flags_t f, tid_t t, asize_t len) {
       append_json_string_val(obj, "struc", name);
    }
 
-   if (send_json(ea, COMMAND_MAKE_DATA, obj) == 0) {
+   if (send_update(ea, COMMAND_MAKE_DATA, obj) == 0) {
       qstring s;
       format_llx(ea, s);
       msg(PLUGIN_NAME": send error on make_data 0x%s, %x, %x, %d\n", s.c_str(), f, (uint32_t)t, (int)len);
@@ -581,7 +581,7 @@ void idp_move_segm(ea_t ea, segment_t *seg) {
    json_object *obj = json_object_new_object();
    append_json_ea_val(obj, "from", ea);
    append_json_ea_val(obj, "to", seg->start_ea);
-   if (send_json(COMMAND_MOVE_SEGM, obj) == 0) {
+   if (send_update(COMMAND_MOVE_SEGM, obj) == 0) {
       qstring a1, a2;
       format_llx(ea, a1);
       format_llx(seg->start_ea, a2);
@@ -594,7 +594,7 @@ void idp_renamed(ea_t ea, const char *new_name, bool is_local) {
    json_object *obj = json_object_new_object();
    append_json_bool_val(obj, "local", (json_bool)is_local);
    append_json_string_val(obj, "name", new_name);
-   if (send_json(ea, COMMAND_RENAMED, obj) == 0) {
+   if (send_update(ea, COMMAND_RENAMED, obj) == 0) {
       qstring a1;
       format_llx(ea, a1);
       msg(PLUGIN_NAME": send error on rename 0x%s, %s, %d\n", a1.c_str(), new_name, is_local);
@@ -606,7 +606,7 @@ void idp_add_func(func_t *pfn) {
    json_object *obj = json_object_new_object();
    append_json_ea_val(obj, "startea", pfn->start_ea);
    append_json_ea_val(obj, "endea", pfn->end_ea);
-   send_json(COMMAND_ADD_FUNC, obj);
+   send_update(COMMAND_ADD_FUNC, obj);
 /*
    if (send_data(b) == -1) {
       qstring a1;
@@ -619,7 +619,7 @@ void idp_add_func(func_t *pfn) {
 void idp_del_func(func_t *pfn) {
    //send start, end address, name, flags (bp etc), purged, locals, delta, args
    json_object *obj = json_object_new_object();
-   send_json(pfn->start_ea, COMMAND_DEL_FUNC, obj);
+   send_update(pfn->start_ea, COMMAND_DEL_FUNC, obj);
 /*
    if (send_data(b) == -1) {
       qstring a1;
@@ -634,7 +634,7 @@ void idp_set_func_start(func_t *pfn, ea_t ea) {
    json_object *obj = json_object_new_object();
    append_json_ea_val(obj, "old_start", pfn->start_ea);
    append_json_ea_val(obj, "new_start", ea);
-   send_json(COMMAND_SET_FUNC_START, obj);
+   send_update(COMMAND_SET_FUNC_START, obj);
 /*
    if (send_data(b) == -1) {
       qstring a1, a2;
@@ -650,7 +650,7 @@ void idp_set_func_end(func_t *pfn, ea_t ea) {
    json_object *obj = json_object_new_object();
    append_json_ea_val(obj, "startea", pfn->start_ea);
    append_json_ea_val(obj, "endea", ea);
-   send_json(COMMAND_SET_FUNC_END, obj);
+   send_update(COMMAND_SET_FUNC_END, obj);
 /*
    if (send_data(b) == -1) {
       qstring a1, a2;
@@ -672,7 +672,7 @@ void idp_validate_flirt(ea_t ea, const char *name) {
       append_json_ea_val(obj, "endea", f->end_ea);
    }
 
-   send_json(COMMAND_VALIDATE_FLIRT_FUNC, obj);
+   send_update(COMMAND_VALIDATE_FLIRT_FUNC, obj);
 /*
    if (send_data(b) == -1) {
       qstring a1;
@@ -687,7 +687,7 @@ void idp_add_cref(ea_t from, ea_t to, cref_t type) {
    append_json_ea_val(obj, "from", from);
    append_json_ea_val(obj, "to", to);
    append_json_uint64_val(obj, "reftype", (uint64_t)type);
-   send_json(COMMAND_ADD_CREF, obj);
+   send_update(COMMAND_ADD_CREF, obj);
 /*
    if (send_data(b) == -1) {
       qstring a1, a2;
@@ -703,7 +703,7 @@ void idp_add_dref(ea_t from, ea_t to, dref_t type) {
    append_json_ea_val(obj, "from", from);
    append_json_ea_val(obj, "to", to);
    append_json_uint64_val(obj, "reftype", (uint64_t)type);
-   send_json(COMMAND_ADD_DREF, obj);
+   send_update(COMMAND_ADD_DREF, obj);
 /*
    if (send_data(b) == -1) {
       qstring a1, a2;
@@ -719,7 +719,7 @@ void idp_del_cref(ea_t from, ea_t to, bool expand) {
    append_json_ea_val(obj, "from", from);
    append_json_ea_val(obj, "to", to);
    append_json_bool_val(obj, "expand", (json_bool)expand);
-   send_json(COMMAND_DEL_CREF, obj);
+   send_update(COMMAND_DEL_CREF, obj);
 /*
    if (send_data(b) == -1) {
       qstring a1, a2;
@@ -734,7 +734,7 @@ void idp_del_dref(ea_t from, ea_t to) {
    json_object *obj = json_object_new_object();
    append_json_ea_val(obj, "from", from);
    append_json_ea_val(obj, "to", to);
-   send_json(COMMAND_DEL_DREF, obj);
+   send_update(COMMAND_DEL_DREF, obj);
 /*
    if (send_data(b) == -1) {
       qstring a1, a2;
@@ -750,7 +750,7 @@ void byte_patched(ea_t ea) {
    uint32_t val = (uint32_t)get_byte(ea);
    //send value to server
    append_json_uint32_val(obj, "value", val);
-   send_json(ea, COMMAND_BYTE_PATCHED, obj);
+   send_update(ea, COMMAND_BYTE_PATCHED, obj);
 /*
    if (send_data(b) == -1) {
       qstring a1;
@@ -777,7 +777,7 @@ void comment_changed(ea_t ea, bool rep) {
          json_object *obj = json_object_new_object();
          append_json_string_val(obj, "text", cmt);
          append_json_bool_val(obj, "rep", (json_bool)rep);
-         send_json(ea, COMMAND_CMT_CHANGED, obj);
+         send_update(ea, COMMAND_CMT_CHANGED, obj);
 /*
          if (send_data(b) == -1) {
             qstring a1;
@@ -796,7 +796,7 @@ void comment_changed(ea_t ea, bool rep) {
       json_object *obj = json_object_new_object();
       append_json_string_val(obj, "text", cmt);
       append_json_bool_val(obj, "rep", (json_bool)rep);
-      send_json(ea, COMMAND_CMT_CHANGED, obj);
+      send_update(ea, COMMAND_CMT_CHANGED, obj);
    }
 #endif
 }
@@ -807,7 +807,7 @@ void change_ti(ea_t ea, const type_t *type, const p_list *fnames) {
    if (fnames) {
       append_json_hex_val(obj, "fnames", (const uint8_t*)fnames);
    }
-   send_json(ea, COMMAND_TI_CHANGED, obj);
+   send_update(ea, COMMAND_TI_CHANGED, obj);
 /*
    if (send_data(b) == -1) {
       qstring a1;
@@ -824,7 +824,7 @@ void change_op_ti(ea_t ea, int n, const type_t *type, const p_list *fnames) {
       append_json_hex_val(obj, "fnames", (const uint8_t*)fnames);
    }
    append_json_int32_val(obj, "opnum", n);
-   send_json(ea, COMMAND_OP_TI_CHANGED, obj);
+   send_update(ea, COMMAND_OP_TI_CHANGED, obj);
 /*
    if (send_data(b) == -1) {
       qstring a1;
@@ -966,7 +966,7 @@ void change_op_type(ea_t ea, int opnum) {
    append_json_uint32_val(obj, "opnum", opnum);
    append_json_uint32_val(obj, "flags", f);
 
-   send_json(ea, COMMAND_OP_TYPE_CHANGED, obj);
+   send_update(ea, COMMAND_OP_TYPE_CHANGED, obj);
 /*
    if (send_data(b) == -1) {
       qstring a1;
@@ -989,7 +989,7 @@ void create_enum(enum_t id) {
    if (sz > 0) {
       json_object *obj = json_object_new_object();
       append_json_string_val(obj, "enum_name", name);
-      send_json(COMMAND_ENUM_CREATED, obj);
+      send_update(COMMAND_ENUM_CREATED, obj);
 #if IDA_SDK_VERSION < 680
 /*
       if (send_data(b) == -1) {
@@ -1021,7 +1021,7 @@ void delete_enum(enum_t id) {
    if (sz > 0) {
       json_object *obj = json_object_new_object();
       append_json_string_val(obj, "enum_name", name);
-      send_json(COMMAND_ENUM_DELETED, obj);
+      send_update(COMMAND_ENUM_DELETED, obj);
 #if IDA_SDK_VERSION < 680
 /*
       if (send_data(b) == -1) {
@@ -1055,7 +1055,7 @@ void change_enum_bf(enum_t id) {
 
    if (sz > 0) {
       append_json_string_val(obj, "enum_name", name);
-      send_json(COMMAND_ENUM_BF_CHANGED, obj);
+      send_update(COMMAND_ENUM_BF_CHANGED, obj);
 /*
       if (send_data(b) == -1) {
          msg(PLUGIN_NAME": send error on change_enum %s\n", name);
@@ -1080,7 +1080,7 @@ void rename_enum(tid_t t) {
       json_object *obj = json_object_new_object();
       append_json_string_val(obj, "oldname", oldname);
       append_json_string_val(obj, "newname", newname);
-      send_json(COMMAND_ENUM_RENAMED, obj);
+      send_update(COMMAND_ENUM_RENAMED, obj);
 #if IDA_SDK_VERSION < 680
       cnn.supset(t, newname, 0, COLLABREATE_ENUMS_TAG);
 /*
@@ -1115,7 +1115,7 @@ void change_enum_cmt(tid_t t, bool rep) {
       append_json_string_val(obj, "enum_name", name);
       append_json_string_val(obj, "comment", cmt);
       append_json_bool_val(obj, "rep", (json_bool)rep);
-      send_json(COMMAND_ENUM_CMT_CHANGED, obj);
+      send_update(COMMAND_ENUM_CMT_CHANGED, obj);
    }
 #else
    char cmt[MAXNAMESIZE];
@@ -1125,7 +1125,7 @@ void change_enum_cmt(tid_t t, bool rep) {
       append_json_string_val(obj, "enum_name", name);
       append_json_string_val(obj, "comment", cmt);
       append_json_bool_val(obj, "rep", (json_bool)rep);
-      send_json(COMMAND_ENUM_CMT_CHANGED, obj);
+      send_update(COMMAND_ENUM_CMT_CHANGED, obj);
 /*
       if (send_data(b) == -1) {
 #if IDA_SDK_VERSION < 680
@@ -1171,7 +1171,7 @@ void create_enum_member(enum_t id, const_t cid) {
 
    append_json_string_val(obj, "mname", mname);
    append_json_uint64_val(obj, "value", (uint64_t)value);
-   send_json(COMMAND_ENUM_CONST_CREATED, obj);
+   send_update(COMMAND_ENUM_CONST_CREATED, obj);
 }
 
 void delete_enum_member(enum_t id, const_t cid) {
@@ -1200,7 +1200,7 @@ void delete_enum_member(enum_t id, const_t cid) {
 #endif
 
    append_json_string_val(obj, "ename", ename);
-   send_json(COMMAND_ENUM_CONST_DELETED, obj);
+   send_update(COMMAND_ENUM_CONST_DELETED, obj);
 }
 
 void create_struct(tid_t t) {
@@ -1219,7 +1219,7 @@ void create_struct(tid_t t) {
       append_json_string_val(obj, "struc_name", name);
       append_json_uint64_val(obj, "tid", (uint64_t)t);
       append_json_bool_val(obj, "union", (json_bool)s->is_union());
-      send_json(COMMAND_STRUC_CREATED, obj);
+      send_update(COMMAND_STRUC_CREATED, obj);
 
 #if IDA_SDK_VERSION < 680
 /*
@@ -1253,7 +1253,7 @@ void delete_struct(tid_t s) {
    if (sz > 0) {
       json_object *obj = json_object_new_object();
       append_json_string_val(obj, "struc_name", name);
-      send_json(COMMAND_STRUC_DELETED, obj);
+      send_update(COMMAND_STRUC_DELETED, obj);
 /*
 #if IDA_SDK_VERSION < 680
       if (send_data(b) == -1) {
@@ -1287,7 +1287,7 @@ void rename_struct(struc_t *s) {
       //tids are never guaranteed to map beween any two IDBs
       //need to try to map struct id to other instances ID
       append_json_uint64_val(obj, "tid", (uint64_t)s->id);
-      send_json(COMMAND_STRUC_RENAMED, obj);
+      send_update(COMMAND_STRUC_RENAMED, obj);
 
 #if IDA_SDK_VERSION < 680
       cnn.supset(s->id, newname, 0, COLLABREATE_STRUCTS_TAG);
@@ -1325,7 +1325,7 @@ void expand_struct(struc_t *s) {
       //tids are never guaranteed to map beween any two IDBs
       //need to try to map struct id to other instances ID
       append_json_uint64_val(obj, "tid", (uint64_t)s->id);
-      send_json(COMMAND_STRUC_EXPANDED, obj);
+      send_update(COMMAND_STRUC_EXPANDED, obj);
 /*
 #if IDA_SDK_VERSION < 680
       if (send_data(b) == -1) {
@@ -1357,7 +1357,7 @@ void change_struc_cmt(tid_t t, bool rep) {
    append_json_string_val(obj, "struc_name", name);
    append_json_string_val(obj, "comment", cmt);
    append_json_bool_val(obj, "rep", (json_bool)rep);
-   send_json(COMMAND_STRUC_CMT_CHANGED, obj);
+   send_update(COMMAND_STRUC_CMT_CHANGED, obj);
 #else
    char cmt[MAXNAMESIZE];
    /*ssize_t csz =*/ get_struc_cmt(t, rep, cmt, sizeof(cmt));
@@ -1366,7 +1366,7 @@ void change_struc_cmt(tid_t t, bool rep) {
    append_json_string_val(obj, "struc_name", name);
    append_json_string_val(obj, "comment", cmt);
    append_json_bool_val(obj, "rep", (json_bool)rep);
-   send_json(COMMAND_STRUC_CMT_CHANGED, obj);
+   send_update(COMMAND_STRUC_CMT_CHANGED, obj);
 
 /*
    if (send_data(b) == -1) {
@@ -1466,7 +1466,7 @@ void create_struct_member(struc_t *s, member_t *m) {
    append_json_string_val(obj, "struc_name", name);
    append_json_string_val(obj, "member", mbr);
 
-   send_json(obj);
+   send_update(obj);
 
 /*
 //   msg(PLUGIN_NAME": create_struct_member %s.%s off: %d, sz: %d\n", name, mbr, m->soff, m->eoff - m->soff);
@@ -1495,7 +1495,7 @@ void delete_struct_member(struc_t *s, tid_t /*m*/, ea_t offset) {
    append_json_string_val(obj, "struc_name", name);
    append_json_ea_val(obj, "offset", offset);
 
-   send_json(COMMAND_STRUC_MEMBER_DELETED, obj);
+   send_update(COMMAND_STRUC_MEMBER_DELETED, obj);
 
 /*
 //   msg(PLUGIN_NAME": delete_struct_member %s, tid %x, offset %x\n", name, m, offset);
@@ -1537,7 +1537,7 @@ void rename_struct_member(struc_t *s, member_t *m) {
 */
 #endif
       append_json_string_val(obj, "name", name);
-      send_json(COMMAND_SET_STACK_VAR_NAME, obj);
+      send_update(COMMAND_SET_STACK_VAR_NAME, obj);
    }
    else {
       //send struct name and member name and offset
@@ -1558,7 +1558,7 @@ void rename_struct_member(struc_t *s, member_t *m) {
 #endif
       append_json_string_val(obj, "struc_name", sname);
       append_json_string_val(obj, "mbr_name", mname);
-      send_json(COMMAND_SET_STRUCT_MEMBER_NAME, obj);
+      send_update(COMMAND_SET_STRUCT_MEMBER_NAME, obj);
 /*
       if (send_data(b) == -1) {
 #if IDA_SDK_VERSION < 680
@@ -1646,7 +1646,7 @@ void change_struct_member(struc_t *s, member_t *m) {
 #endif
    append_json_string_val(obj, "struc_name", name);
 
-   send_json(obj);
+   send_update(obj);
 
 /*
 //   msg(PLUGIN_NAME": create_struct_member %s.%s off: %d, sz: %d\n", name, mbr, m->soff, m->eoff - m->soff);
@@ -1662,7 +1662,7 @@ void change_struct_member(struc_t *s, member_t *m) {
 
 void create_thunk(func_t *pfn) {
    json_object *obj = json_object_new_object();
-   send_json(pfn->start_ea, COMMAND_THUNK_CREATED, obj);
+   send_update(pfn->start_ea, COMMAND_THUNK_CREATED, obj);
 /*
    if (send_data(b) == -1) {
       qstring a1;
@@ -1678,7 +1678,7 @@ void append_func_tail(func_t *pfn, func_t *tail) {
    append_json_ea_val(obj, "tail_start", tail->start_ea);
    append_json_ea_val(obj, "tail_end", tail->end_ea);
 
-   send_json(COMMAND_FUNC_TAIL_APPENDED, obj);
+   send_update(COMMAND_FUNC_TAIL_APPENDED, obj);
 /*
    if (send_data(b) == -1) {
       qstring a1, a2;
@@ -1694,7 +1694,7 @@ void remove_function_tail(func_t *pfn, ea_t ea) {
    append_json_ea_val(obj, "funcea", pfn->start_ea);
    append_json_ea_val(obj, "tailea", ea);
 
-   send_json(COMMAND_FUNC_TAIL_REMOVED, obj);
+   send_update(COMMAND_FUNC_TAIL_REMOVED, obj);
 /*
    if (send_data(b) == -1) {
       qstring a1, a2;
@@ -1710,7 +1710,7 @@ void change_tail_owner(func_t *tail, ea_t ea) {
    append_json_ea_val(obj, "ownerea", ea);
    append_json_ea_val(obj, "tailea", tail->start_ea);
 
-   send_json(COMMAND_TAIL_OWNER_CHANGED, obj);
+   send_update(COMMAND_TAIL_OWNER_CHANGED, obj);
 /*
    if (send_data(b) == -1) {
       qstring a1, a2;
@@ -1723,7 +1723,7 @@ void change_tail_owner(func_t *tail, ea_t ea) {
 
 void change_func_noret(func_t *pfn) {
    json_object *obj = json_object_new_object();
-   send_json(pfn->start_ea, COMMAND_FUNC_NORET_CHANGED, obj);
+   send_update(pfn->start_ea, COMMAND_FUNC_NORET_CHANGED, obj);
 /*
    if (send_data(b) == -1) {
       qstring a1;
@@ -1759,7 +1759,7 @@ void add_segment(segment_t *seg) {
    append_json_string_val(obj, "name", name);
    append_json_string_val(obj, "class", clazz);
 
-   send_json(COMMAND_SEGM_ADDED, obj);
+   send_update(COMMAND_SEGM_ADDED, obj);
 /*
    if (send_data(b) == -1) {
       qstring a1;
@@ -1771,7 +1771,7 @@ void add_segment(segment_t *seg) {
 
 void del_segment(ea_t ea) {
    json_object *obj = json_object_new_object();
-   send_json(ea, COMMAND_SEGM_DELETED, obj);
+   send_update(ea, COMMAND_SEGM_DELETED, obj);
 /*
    if (send_data(b) == -1) {
       qstring a1;
@@ -1785,7 +1785,7 @@ void change_seg_start(segment_t *seg) {
    json_object *obj = json_object_new_object();
    append_json_ea_val(obj, "startea", seg->start_ea);
    append_json_ea_val(obj, "endea", seg->end_ea);
-   send_json(COMMAND_SEGM_START_CHANGED, obj);
+   send_update(COMMAND_SEGM_START_CHANGED, obj);
 /*
    if (send_data(b) == -1) {
       qstring a1;
@@ -1799,7 +1799,7 @@ void change_seg_end(segment_t *seg) {
    json_object *obj = json_object_new_object();
    append_json_ea_val(obj, "startea", seg->start_ea);
    append_json_ea_val(obj, "endea", seg->end_ea);
-   send_json(COMMAND_SEGM_END_CHANGED, obj);
+   send_update(COMMAND_SEGM_END_CHANGED, obj);
 /*
    if (send_data(b) == -1) {
       qstring a1;
@@ -1814,7 +1814,7 @@ void move_segment(ea_t from, ea_t to, asize_t sz) {
    append_json_ea_val(obj, "from", from);
    append_json_ea_val(obj, "to", to);
    append_json_uint64_val(obj, "size", (uint64_t)sz);
-   send_json(COMMAND_SEGM_MOVED, obj);
+   send_update(COMMAND_SEGM_MOVED, obj);
 /*
    if (send_data(b) == -1) {
       qstring a1, a2;
@@ -1844,7 +1844,7 @@ void change_area_comment(areacb_t *cb, const area_t *a, const char *cmt, bool re
    append_json_bool_val(obj, "rep", rep);
    append_json_string_val(obj, "comment", cmt);
 
-   send_json(COMMAND_RANGE_CMT_CHANGED, obj);
+   send_update(COMMAND_RANGE_CMT_CHANGED, obj);
 /*
    if (send_data(b) == -1) {
       qstring a1;
@@ -1874,7 +1874,7 @@ void change_range_comment(range_kind_t rk, const range_t *r, const char *cmt, bo
    append_json_bool_val(obj, "rep", rep);
    append_json_string_val(obj, "comment", cmt);
 
-   send_json(COMMAND_RANGE_CMT_CHANGED, obj);
+   send_update(COMMAND_RANGE_CMT_CHANGED, obj);
 }
 #endif
 
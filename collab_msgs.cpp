@@ -226,6 +226,8 @@ void sendAuthData(unsigned char *challenge, int challenge_len) {
    append_json_hex_val(obj, "hmac", hmac, sizeof(hmac));
    //send plugin protocol version
    append_json_int32_val(obj, "protocol", PROTOCOL_VERSION);
+   //and the optional features we can use, servers that don't know them ignore them
+   append_json_uint32_val(obj, "features", FEATURE_UPDATE_BATCH);
 #ifdef DEBUG
    msg(PLUGIN_NAME": sending auth data\n");
 #endif   
@@ -1524,6 +1526,9 @@ int auth_reply(json_object *json) {
    }
    else {
       authenticated = true;
+      uint32_t features = 0;
+      uint32_from_json(json, "features", &features);
+      batchUpdates = (features & FEATURE_UPDATE_BATCH) != 0;
       msg(PLUGIN_NAME": Successfully authenticated.\n");
       postCollabMessage("Successfully authenticated.");
       unsigned char gpid[GPID_SIZE];
@@ -1732,6 +1737,18 @@ int ack_updateid(json_object *json) {
    return 0;
 }
 
+int ack_updateid_range(json_object *json) {
+   uint64_t last;
+   if (!uint64_from_json(json, "last", &last)) {
+      return -1;
+   }
+#ifdef DEBUG
+   msg(PLUGIN_NAME": got updateids through: %s\n", formatLongLong(last));
+#endif
+   setLastUpdate(last);
+   return 0;
+}
+
 int collab_error(json_object *json) {
    const char *error_msg = string_from_json(json, "error");
    if (error_msg != NULL) {
@@ -1748,6 +1765,8 @@ int collab_fatal(json_object *json) {
    }
    authenticated = false;
    cleanup();
+   //the server won't take them now, so batched updates go to the change cache
+   flush_updates();
    return 0;
 }
 
@@ -1858,6 +1877,7 @@ void build_handler_map() {
    ctrl_handlers[MSG_GET_PROJ_PERMS_REPLY] = get_proj_perms_reply;
    ctrl_handlers[MSG_SET_PROJ_PERMS_REPLY] = set_proj_perms_reply;
    ctrl_handlers[MSG_ACK_UPDATEID] = ack_updateid;
+   ctrl_handlers[MSG_ACK_UPDATEID_RANGE] = ack_updateid_range;
    ctrl_handlers[MSG_ERROR] = collab_error;
    ctrl_handlers[MSG_FATAL] = collab_fatal;
    ctrl_handlers[MSG_PING] = collab_ping;
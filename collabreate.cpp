@@ -222,6 +222,9 @@ size_t idaapi collab_init_common(void) {
 
 void idaapi collab_term_common(void) {
    msg(PLUGIN_NAME": collabREate is being unloaded\n");
+   //send anything still batched, or cache it if we aren't connected, and
+   //make sure the batch timer can't fire once we are gone
+   flush_updates();
    authenticated = false;
    if (is_connected()) {
       msg(PLUGIN_NAME": calling cleanup\n");
@@ -348,6 +351,7 @@ bool idaapi collab_run_common(size_t /*arg*/) {
          case USER_DISCONNECT: {
             authenticated = false;
             msg(PLUGIN_NAME": De-activating collabREate\n");
+            flush_updates();
             cleanup();
             unhookAll();
             msg(PLUGIN_NAME": command   rx   tx\n");
@@ -37,6 +37,10 @@
 
 #define PROTOCOL_VERSION             4
 
+//optional protocol features, offered in our auth_request and
+//confirmed by the server in its auth_reply
+#define FEATURE_UPDATE_BATCH         0x1
+
 #define JSON_NEW_CONST_KEY (JSON_C_OBJECT_ADD_KEY_IS_NEW | JSON_C_OBJECT_KEY_IS_CONSTANT)
 
 #define COMMAND_BYTE_PATCHED         "byte_patched"
@@ -150,6 +154,8 @@
 #define MSG_GET_PROJ_PERMS_REPLY     "get_proj_perms_reply"
 #define MSG_SET_PROJ_PERMS           "set_proj_perms"
 #define MSG_SET_PROJ_PERMS_REPLY     "set_proj_perms_reply"
+#define MSG_UPDATE_BATCH             "update_batch"
+#define MSG_ACK_UPDATEID_RANGE       "ack_updateid_range"
 
 #define MSG_ERROR                    "collab_error"
 #define MSG_FATAL                    "collab_fatal"
@@ -199,6 +205,7 @@ extern bool supress;
 
 extern bool authenticated;
 extern bool fork_pending;
+extern bool batchUpdates;
 
 extern char **optLabels;
 
@@ -279,6 +286,12 @@ int send_json(json_object *obj);
 int send_json(const char *type, json_object *obj);
 int send_json(ea_t ea, const char *type, json_object *obj);
 
+//updates go through send_update so that they may be batched
+int send_update(json_object *obj);
+int send_update(const char *type, json_object *obj);
+int send_update(ea_t ea, const char *type, json_object *obj);
+void flush_updates();
+
 const char *hex_encode(const void *bin, uint32_t len);
 uint8_t *hex_decode(const char *hex, uint32_t *len);
 void format_llx(uint64_t val, qstring &s);
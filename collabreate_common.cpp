@@ -40,6 +40,19 @@ bool publish  = true;
 bool userPublish  = true;
 bool subscribe = true;
 
+//set when the server agrees to accept update_batch messages
+bool batchUpdates = false;
+
+//updates waiting to be sent as a single update_batch
+static json_object *updateBatch = NULL;
+static qtimer_t batchTimer = NULL;
+
+//most updates sent in one update_batch
+#define UPDATE_BATCH_MAX 256
+
+//how long an update may wait for others to join its batch
+#define UPDATE_BATCH_DELAY_MS 20
+
 //global pointer to the incoming project list buffer.  Used to fill
 //the project list dialog
 //static Buffer *projectBuffer;
@@ -340,6 +353,8 @@ void append_json_ea_val(json_object *obj, const char *key, ea_t value) {
    this function does the json_object_put to release
    any associated resources */
 int send_json(json_object *obj) {
+   //nothing may overtake updates that are still waiting to be batched
+   flush_updates();
    json_object_object_add_ex(obj, "user", json_object_new_string(username), JSON_NEW_CONST_KEY);
    size_t jlen;
    qstring json = json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &jlen);
@@ -359,6 +374,71 @@ int send_json(ea_t ea, const char *type, json_object *obj) {
    return send_json(type, obj);
 }
 
+static int idaapi batch_timer(void *) {
+   //returning -1 unregisters the timer
+   batchTimer = NULL;
+   flush_updates();
+   return -1;
+}
+
+/* flush_updates sends any batched updates.  A batch that can no longer
+   be sent as an update_batch, because the connection was lost, is sent
+   one update at a time instead */
+void flush_updates() {
+   if (batchTimer != NULL) {
+      unregister_timer(batchTimer);
+      batchTimer = NULL;
+   }
+   json_object *updates = updateBatch;
+   if (updates == NULL) {
+      return;
+   }
+   updateBatch = NULL;
+   if (batchUpdates && is_connected()) {
+      json_object *obj = json_object_new_object();
+      json_object_object_add_ex(obj, "updates", updates, JSON_NEW_CONST_KEY);
+      send_json(MSG_UPDATE_BATCH, obj);
+      return;
+   }
+   size_t num_updates = json_object_array_length(updates);
+   for (size_t i = 0; i < num_updates; i++) {
+      json_object *update = json_object_get(json_object_array_get_idx(updates, i));
+      //send_json adds this back
+      json_object_object_del(update, "user");
+      send_json(update);
+   }
+   json_object_put(updates);
+}
+
+/* Like send_json, this is the final use of obj.  Updates are held for
+   up to UPDATE_BATCH_DELAY_MS so that a burst of them reaches the server
+   as a single update_batch */
+int send_update(json_object *obj) {
+   if (!batchUpdates || !is_connected()) {
+      return send_json(obj);
+   }
+   json_object_object_add_ex(obj, "user", json_object_new_string(username), JSON_NEW_CONST_KEY);
+   if (updateBatch == NULL) {
+      updateBatch = json_object_new_array();
+      batchTimer = register_timer(UPDATE_BATCH_DELAY_MS, batch_timer, NULL);
+   }
+   json_object_array_add(updateBatch, obj);
+   if (json_object_array_length(updateBatch) >= UPDATE_BATCH_MAX) {
+      flush_updates();
+   }
+   return 1;
+}
+
+int send_update(const char *type, json_object *obj) {
+   json_object_object_add_ex(obj, "type", json_object_new_string(type), JSON_NEW_CONST_KEY);
+   return send_update(obj);
+}
+
+int send_update(ea_t ea, const char *type, json_object *obj) {
+   json_object_object_add_ex(obj, "addr", json_object_new_int64(ea), JSON_NEW_CONST_KEY);
+   return send_update(type, obj);
+}
+
 uint8_t *hex_from_json(json_object *json, const char *key, uint32_t *len) {
    const char *hexstr = string_from_json(json, key);
    uint8_t *res = NULL;
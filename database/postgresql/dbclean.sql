@@ -2,6 +2,8 @@
 -- psql -U collab collabDB
 -- psql> \i dbclean.sql
 DROP TABLE tracker;
+DROP TABLE superseded;
+DROP TABLE checkpoints;
 DROP TABLE forklist;
 DROP TABLE snapshots;
 DROP SEQUENCE snapshots_sid_seq;
@@ -67,6 +67,11 @@ CREATE INDEX projects_hash_index ON projects(hash);
 
 CREATE SEQUENCE updates_updateid_seq START 1;
 
+--updates is partitioned by project.  Each project gets its own partition
+--when it is created (see add_update_partition below) so that catch-up only
+--ever reads the partitions of the projects involved and deleting a project
+--drops its partition.  updates_default catches anything else.
+--databases created before partitioning can be converted with collab_mgr migrate
 CREATE TABLE updates (
    updateid BIGINT DEFAULT nextval('updates_updateid_seq') NOT NULL,
    username text REFERENCES users(username),
@@ -74,8 +79,13 @@ CREATE TABLE updates (
    cmd TEXT NOT NULL,
    json TEXT NOT NULL,
    created TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+   mask BIGINT,     --permission bit of cmd, so catch-up can filter on subscriptions
    PRIMARY KEY (updateid,pid)
-);
+) PARTITION BY LIST (pid);
+
+CREATE TABLE updates_default PARTITION OF updates DEFAULT;
+
+CREATE INDEX updates_pid_index ON updates(pid, updateid);
 
 CREATE SEQUENCE snapshots_sid_seq;
 
@@ -83,8 +93,30 @@ CREATE TABLE forklist (
    fid SERIAL UNIQUE NOT NULL,
    child INTEGER REFERENCES projects(pid),
    parent INTEGER REFERENCES projects(pid), 
+   --last parent update the child sees.  The child's history is its own updates
+   --plus the parent's up to cutoff, so nothing is copied at fork time.  NULL
+   --for forks made by copying updates, whose history is entirely their own
+   cutoff BIGINT,
    PRIMARY KEY(fid)
 );
+
+CREATE INDEX forklist_child_index ON forklist(child);
+
+--compaction folds each project's update log so that catch-up only replays
+--updates that still matter.  superseded lists the updates a project no longer
+--needs to send, each overwritten by a later update in the same project
+CREATE TABLE checkpoints (
+   pid INTEGER REFERENCES projects(pid) ON DELETE CASCADE,
+   updateid BIGINT NOT NULL,   --project has been compacted through this update
+   compacted TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+   PRIMARY KEY (pid)
+);
+
+CREATE TABLE superseded (
+   pid INTEGER REFERENCES projects(pid) ON DELETE CASCADE,
+   updateid BIGINT NOT NULL,
+   PRIMARY KEY (pid, updateid)
+);
 --tracker is no longer required, since the last update is stored in the idb
 --CREATE TABLE tracker (
 --   username TEXT references users(username),
@@ -115,6 +147,41 @@ BEGIN
 END;
 $$ LANGUAGE plpgsql;
 
+--creates the updates partition for a newly added project.  The partitioned
+--table is named by the trigger's argument.  The partition is created on its
+--own and then attached, which only takes SHARE UPDATE EXCLUSIVE on the
+--partitioned table, where CREATE TABLE ... PARTITION OF would take ACCESS
+--EXCLUSIVE and stall every server inserting or reading updates meanwhile
+CREATE OR REPLACE FUNCTION add_update_partition() RETURNS trigger AS $$
+DECLARE
+   part text := 'updates_' || NEW.pid;
+BEGIN
+   IF to_regclass(part) IS NULL THEN
+      EXECUTE format('CREATE TABLE %I (LIKE %I INCLUDING DEFAULTS)', part, TG_ARGV[0]);
+      EXECUTE format('ALTER TABLE %I ATTACH PARTITION %I FOR VALUES IN (%s)',
+                     TG_ARGV[0], part, NEW.pid);
+   END IF;
+   RETURN NEW;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE TRIGGER projects_add_partition AFTER INSERT ON projects
+   FOR EACH ROW EXECUTE PROCEDURE add_update_partition('updates');
+
+--removes all of a project's updates by dropping its partition.  Returns false,
+--removing nothing, while forks still share the project's updates
+CREATE OR REPLACE FUNCTION drop_project_updates(ppid integer) RETURNS boolean AS $$
+BEGIN
+   IF EXISTS (SELECT 1 FROM forklist WHERE parent = ppid AND cutoff IS NOT NULL) THEN
+      RETURN false;
+   END IF;
+   EXECUTE format('DROP TABLE IF EXISTS %I', 'updates_' || ppid);
+   --anything that landed outside the project's partition
+   DELETE FROM updates WHERE pid = ppid;
+   RETURN true;
+END;
+$$ LANGUAGE plpgsql;
+
 CREATE OR REPLACE FUNCTION copy_updates(ppid integer, maxid integer, lpid integer) RETURNS VOID AS $$
 DECLARE
 BEGIN
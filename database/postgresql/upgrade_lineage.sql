@@ -0,0 +1,41 @@
+--  IDA Pro Collabreation/Synchronization Plugin
+--  Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+--  Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+--
+--
+--  This program is free software; you can redistribute it and/or modify it
+--  under the terms of the GNU General Public License as published by the Free
+--  Software Foundation; either version 2 of the License, or (at your option)
+--  any later version.
+--
+--  This program is distributed in the hope that it will be useful, but WITHOUT
+--  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+--  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+--  more details.
+--
+--  You should have received a copy of the GNU General Public License along with
+--  this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+--  Place, Suite 330, Boston, MA 02111-1307 USA
+
+-- brings a database created by an older dbschema.sql up to date for forks
+-- that share their parent's history rather than copying it, something like:
+-- psql -U collab collabDB
+-- psql> \i upgrade_lineage.sql
+--
+-- existing forks keep the copies they already have, only forks made from now
+-- on are stored as lineage
+
+BEGIN;
+
+ALTER TABLE forklist ADD COLUMN IF NOT EXISTS cutoff BIGINT;
+
+CREATE INDEX IF NOT EXISTS forklist_child_index ON forklist(child);
+CREATE INDEX IF NOT EXISTS updates_pid_index ON updates(pid, updateid);
+
+-- snapshots have no updates of their own, so linking them to their parent
+-- lets new forks of old snapshots see the parent's history
+UPDATE forklist f SET cutoff = p.snapupdateid
+   FROM projects p
+   WHERE p.pid = f.child AND p.snapupdateid > 0 AND f.cutoff IS NULL;
+
+COMMIT;
@@ -0,0 +1,27 @@
+--  IDA Pro Collabreation/Synchronization Plugin
+--  Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+--  Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+--
+--
+--  This program is free software; you can redistribute it and/or modify it
+--  under the terms of the GNU General Public License as published by the Free
+--  Software Foundation; either version 2 of the License, or (at your option)
+--  any later version.
+--
+--  This program is distributed in the hope that it will be useful, but WITHOUT
+--  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+--  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+--  more details.
+--
+--  You should have received a copy of the GNU General Public License along with
+--  this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+--  Place, Suite 330, Boston, MA 02111-1307 USA
+
+
+-- adds the permission mask column used to filter catch-up on subscriptions
+-- to a database created by an older dbschema.sql, something like:
+-- psql -U collab collabDB
+-- psql> \i upgrade_masks.sql
+-- existing updates keep a NULL mask and are filtered by the server instead
+
+ALTER TABLE updates ADD COLUMN IF NOT EXISTS mask BIGINT;
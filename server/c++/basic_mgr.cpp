@@ -18,7 +18,15 @@
    Place, Suite 330, Boston, MA 02111-1307 USA
  */
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <string>
 #include <map>
 #include <vector>
@@ -47,9 +55,37 @@ BasicConnectionManager::BasicConnectionManager(json_object *conf) : ConnectionMa
    sem_init(&pidLock, 0, 1);
    sem_init(&uidLock, 0, 1);
    sem_init(&mapLock, 0, 1);
+
+   log_dir = getStringOption(conf, "BASIC_LOG_DIR", "");
+   segment_size = getIntOption(conf, "BASIC_SEGMENT_SIZE", 16 * 1024 * 1024);
+   sync_policy = UpdateLog::parsePolicy(getStringOption(conf, "BASIC_FSYNC", "periodic"));
+   sync_ms = getIntOption(conf, "BASIC_FSYNC_MS", 1000);
+   if (sync_ms == 0) {
+      sync_ms = 1;
+   }
+   sem_init(&flush_wake, 0, 0);
+   if (log_dir.length()) {
+      if (mkdir(log_dir.c_str(), 0700) == -1 && errno != EEXIST) {
+         log(LERROR, "Unable to create %s, basic mode updates will not be saved: %s\n", log_dir.c_str(), strerror(errno));
+         log_dir = "";
+      }
+      else {
+         loadProjects();
+         if (sync_policy == UpdateLog::SYNC_PERIODIC) {
+            pthread_create(&flusher, NULL, flushThread, this);
+         }
+      }
+   }
 }
 
 BasicConnectionManager::~BasicConnectionManager() {
+   if (log_dir.length() && sync_policy == UpdateLog::SYNC_PERIODIC) {
+      done = true;
+      sem_post(&flush_wake);
+      pthread_join(flusher, NULL);
+   }
+   sem_destroy(&flush_wake);
+   //deleting each project closes, and if need be syncs, its log
    for (map<string,vector<BasicProject*>*>::iterator mi = basicProjects.begin(); mi != basicProjects.end(); mi++) {
       vector<BasicProject*>* v = mi->second;
       for (vector<BasicProject*>::iterator vi = v->begin(); vi != v->end(); vi++) {
@@ -59,6 +95,249 @@ BasicConnectionManager::~BasicConnectionManager() {
    }
 }
 
+static string project_dir(const string &base, uint32_t lpid) {
+   char name[16];
+   snprintf(name, sizeof(name), "/%u", lpid);
+   return base + name;
+}
+
+/**
+ * loadProjects restores every project found under log_dir.  Each project has
+ * its own directory, named for its lpid, holding a project.json that describes
+ * it and the segments of its update log.
+ */
+void BasicConnectionManager::loadProjects() {
+   DIR *d = opendir(log_dir.c_str());
+   if (d == NULL) {
+      log(LERROR, "Unable to read %s: %s\n", log_dir.c_str(), strerror(errno));
+      return;
+   }
+   dirent *de;
+   while ((de = readdir(d)) != NULL) {
+      char *end;
+      uint32_t lpid = strtoul(de->d_name, &end, 10);
+      if (end == de->d_name || *end != 0) {
+         continue;
+      }
+      string pdir = project_dir(log_dir, lpid);
+      json_object *meta = json_object_from_file((pdir + "/project.json").c_str());
+      if (meta == NULL) {
+         log(LERROR, "Skipping %s, it has no readable project.json\n", pdir.c_str());
+         continue;
+      }
+      const char *desc = string_from_json(meta, "description");
+      const char *gpid = string_from_json(meta, "gpid");
+      const char *hash = string_from_json(meta, "hash");
+      if (desc == NULL || gpid == NULL || hash == NULL) {
+         log(LERROR, "Skipping %s, its project.json is incomplete\n", pdir.c_str());
+         json_object_put(meta);
+         continue;
+      }
+      BasicProject *p = new BasicProject(lpid, desc);
+      p->gpid = gpid;
+      p->hash = hash;
+      uint64_from_json(meta, "pub", &p->pub);
+      uint64_from_json(meta, "sub", &p->sub);
+      json_object_put(meta);
+
+      UpdateLog *ul = new UpdateLog(pdir, segment_size, sync_policy);
+      if (!ul->open()) {
+         log(LERROR, "Skipping %s, its update log could not be opened\n", pdir.c_str());
+         delete ul;
+         delete p;
+         continue;
+      }
+      p->attach(ul);
+      registerProject(p);
+      if ((int)lpid >= basicmodepid) {
+         basicmodepid = lpid + 1;
+      }
+      log(LINFO, "Loaded basic mode project %u, last update %llu\n", lpid, (unsigned long long)ul->lastId());
+   }
+   closedir(d);
+}
+
+/**
+ * saveProject records a project's details alongside its update log.  The
+ * file is replaced atomically so a crash leaves either the old or new copy.
+ */
+bool BasicConnectionManager::saveProject(BasicProject *p) {
+   string pdir = project_dir(log_dir, p->lpid);
+   string path = pdir + "/project.json";
+   string tmp = path + ".tmp";
+   json_object *meta = json_object_new_object();
+   append_json_uint32_val(meta, "lpid", p->lpid);
+   append_json_string_val(meta, "gpid", p->gpid);
+   append_json_string_val(meta, "hash", p->hash);
+   append_json_string_val(meta, "description", p->desc);
+   append_json_uint64_val(meta, "pub", p->pub);
+   append_json_uint64_val(meta, "sub", p->sub);
+   bool ok = json_object_to_file_ext(tmp.c_str(), meta, JSON_C_TO_STRING_PRETTY) == 0;
+   json_object_put(meta);
+   if (ok) {
+      int fd = open(tmp.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd != -1) {
+         fsync(fd);
+         close(fd);
+      }
+      ok = rename(tmp.c_str(), path.c_str()) == 0;
+   }
+   if (!ok) {
+      log(LERROR, "Unable to save %s: %s\n", path.c_str(), strerror(errno));
+   }
+   return ok;
+}
+
+/**
+ * newProject creates a project with the next available lpid, along with its
+ * update log when updates are being saved
+ */
+BasicProject *BasicConnectionManager::newProject(const string &gpid, const string &hash, const string &desc, uint64_t pub, uint64_t sub) {
+   sem_wait(&pidLock);
+   int lpid = basicmodepid++;
+   sem_post(&pidLock);
+
+   BasicProject *p = new BasicProject(lpid, desc);
+   p->pub = pub;
+   p->sub = sub;
+   p->hash = hash;
+   p->gpid = gpid;
+
+   if (log_dir.length()) {
+      UpdateLog *ul = new UpdateLog(project_dir(log_dir, lpid), segment_size, sync_policy);
+      if (ul->open()) {
+         p->attach(ul);
+         saveProject(p);
+      }
+      else {
+         log(LERROR, "Updates to project %d will not be saved\n", lpid);
+         delete ul;
+      }
+   }
+   registerProject(p);
+   return p;
+}
+
+/**
+ * registerProject makes a project visible to lookups by hash, gpid and lpid
+ */
+void BasicConnectionManager::registerProject(BasicProject *p) {
+   sem_wait(&pidLock);
+   map<string,vector<BasicProject*>*>::iterator bi = basicProjects.find(p->hash);
+   vector<BasicProject*> *vpi;
+   if (bi != basicProjects.end()) {
+      vpi = (*bi).second;
+   }
+   else {
+      vpi = new vector<BasicProject*>;
+      basicProjects[p->hash] = vpi;
+   }
+   vpi->push_back(p);
+   sem_wait(&mapLock);
+   gpid_lpid_map[p->gpid] = p->lpid;
+   pid_project_map[p->lpid] = p;
+   sem_post(&mapLock);
+   sem_post(&pidLock);
+}
+
+/**
+ * flushThread syncs the update logs every sync_ms milliseconds when
+ * BASIC_FSYNC is periodic
+ */
+void *BasicConnectionManager::flushThread(void *arg) {
+   BasicConnectionManager *bm = (BasicConnectionManager*)arg;
+   while (!bm->done) {
+      timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += bm->sync_ms / 1000;
+      deadline.tv_nsec += (bm->sync_ms % 1000) * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+         deadline.tv_sec++;
+         deadline.tv_nsec -= 1000000000L;
+      }
+      if (sem_timedwait(&bm->flush_wake, &deadline) == 0 || errno != ETIMEDOUT) {
+         //only ever woken to shut down
+         continue;
+      }
+      vector<Project*> *plist = bm->getAllProjects();
+      for (vector<Project*>::iterator i = plist->begin(); i != plist->end(); i++) {
+         UpdateLog *ul = ((BasicProject*)*i)->getLog();
+         if (ul) {
+            ul->sync();
+         }
+      }
+      delete plist;
+   }
+   return NULL;
+}
+
+string BasicConnectionManager::dumpStats() {
+   string sb = ConnectionManager::dumpStats();
+   if (log_dir.length()) {
+      static const char *policies[] = {"always", "periodic", "never"};
+      uint64_t appends = 0;
+      uint64_t syncs = 0;
+      uint32_t logs = 0;
+      vector<Project*> *plist = getAllProjects();
+      for (vector<Project*>::iterator i = plist->begin(); i != plist->end(); i++) {
+         UpdateLog *ul = ((BasicProject*)*i)->getLog();
+         if (ul) {
+            logs++;
+            appends += ul->getAppends();
+            syncs += ul->getSyncs();
+         }
+      }
+      delete plist;
+      char buf[256];
+      snprintf(buf, sizeof(buf), "Update logs: %u in %s, appends %llu, syncs %llu, fsync %s\n", logs,
+               log_dir.c_str(), (unsigned long long)appends, (unsigned long long)syncs, policies[sync_policy]);
+      sb += buf;
+   }
+   return sb;
+}
+
+//parse an archived update, which is not necessarily NUL terminated
+static json_object *parse_update(const char *data, size_t len) {
+   json_tokener *tok = json_tokener_new();
+   json_object *obj = json_tokener_parse_ex(tok, data, len);
+   json_tokener_free(tok);
+   return obj;
+}
+
+/*
+ * CatchUp collects a page of the updates a client has missed into chunks.
+ * Archived updates already carry their updateid, so their bytes are sent as is.
+ */
+struct CatchUp {
+   Client *c;
+   deque<string> *chunks;
+   string chunk;
+   uint64_t last;    //the last updateid visited
+   uint32_t count;   //updates visited so far
+};
+
+bool BasicConnectionManager::readUpdate(uint64_t updateid, uint32_t cmd, const char *data, size_t len, void *user) {
+   CatchUp *cu = (CatchUp*)user;
+   cu->last = updateid;
+   if (cu->c->admit((CommandId)cmd)) {
+      cu->chunk.append(data, len);
+      if (cu->chunk.length() >= CATCHUP_CHUNK) {
+         cu->chunks->push_back(cu->chunk);
+         cu->chunk.clear();
+      }
+   }
+   //stop at the end of the page, the next one starts from last
+   return ++cu->count < CATCHUP_PAGE;
+}
+
+static bool export_update(uint64_t updateid, uint32_t cmd, const char *data, size_t len, void *user) {
+   json_object *obj = parse_update(data, len);
+   if (obj) {
+      json_object_array_add((json_object*)user, obj);
+   }
+   return true;
+}
+
 uint32_t BasicConnectionManager::uid_for_user(const char *user) {
    sem_wait(&uidLock);
    if (basic_mode_users.find(user) == basic_mode_users.end()) {
@@ -69,7 +348,7 @@ uint32_t BasicConnectionManager::uid_for_user(const char *user) {
    return uid;
 }
 
-uint32_t BasicConnectionManager::doAuth(NetworkIO *nio) {
+uint32_t BasicConnectionManager::doAuth(NetworkIO *nio, uint32_t *features) {
    uint64_t challenge[4] = {0xdeadbeefdeadbeefll, 0xdeadbeefdeadbeefll, 0xdeadbeefdeadbeefll, 0xdeadbeefdeadbeefll};
    json_object *obj = json_object_new_object();
    append_json_hex_val(obj, "challenge", (uint8_t*)challenge, CHALLENGE_SIZE);
@@ -99,8 +378,10 @@ uint32_t BasicConnectionManager::doAuth(NetworkIO *nio) {
    const char *type = string_from_json(obj, "type");
    uint8_t *response = hex_from_json(obj, "hmac", &rlen);
    const char *user = string_from_json(obj, "user");
-   json_object_put(obj);
-   if (strcmp(type, MSG_AUTH_REQUEST) || response == NULL || user == NULL || rlen != MD5_SIZE) {
+   //type and user point into obj, so release it only once we are done with them
+   if (type == NULL || strcmp(type, MSG_AUTH_REQUEST) || response == NULL || user == NULL || rlen != MD5_SIZE) {
+      delete [] response;
+      json_object_put(obj);
       return AUTH_INVALID_PROTO;
    }
    uint32_t result = AUTH_FAIL;
@@ -108,12 +389,14 @@ uint32_t BasicConnectionManager::doAuth(NetworkIO *nio) {
    if (response != NULL) {  //no memcmp here in basic mode
       result = uid;
       user_map[uid] = UserInfo(user, uid, FULL_PERMISSIONS, FULL_PERMISSIONS);
+      *features = negotiate(obj);
       delete [] response;
    }
    else {
       //reply should have included a "hmac" field
       result = AUTH_INVALID_PROTO;
    }
+   json_object_put(obj);
    return result;
 }
 
@@ -128,54 +411,93 @@ uint32_t BasicConnectionManager::doAuth(NetworkIO *nio) {
 void BasicConnectionManager::importUpdate(const char *newowner, int pid, const char *cmd, json_object *obj) {
    BasicProject *p = findProject(pid);
    if (p != NULL) {
-      const char *json = json_object_to_json_string(obj);
-      p->append_update(json);
+      p->lock();
+      //keep the original updateid where it still fits in this project's sequence
+      uint64_t uid;
+      if (uint64_from_json(obj, "updateid", &uid) && uid > p->curr_uid()) {
+         p->advance_uid(uid);
+      }
+      else {
+         uid = p->next_uid();
+         append_json_uint64_val(obj, "updateid", uid);
+      }
+      size_t len;
+      const char *json = json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &len);
+      p->append_update(uid, command_id(cmd), json, len);
+      p->unlock();
    }
 }
 
 /**
- * post both queues a newly received update to be sent to other clients and (if in DB mode)
- * archives the udpate in the database so that future clients can receive it
+ * relay both queues a newly received update to be sent to other clients and
+ * archives the udpate so that future clients can receive it
  * @param src the client that made the update
  * @param cmd the 'command' that was performed (comment, rename, etc)
- * @param data the 'data' portion of the command (the comment text, etc)
+ * @param json the update as received from the client
+ * @param len the length of json
  */
-void BasicConnectionManager::post(Client *src, const char * cmd, json_object *obj) {
+void BasicConnectionManager::relay(Client *src, CommandId cmd, const char *json, size_t len) {
    BasicProject *p = findProject(src->getPid());
    if (p) {
-      Packet *pkt = new Packet(src, cmd, obj, p->next_uid());
-      const char *json = json_object_to_json_string(pkt->obj);
-      sem_wait(&queueMutex);  //prevent simultaneous update to these storage structures
-      p->append_update(json);
-      queue.push_back(pkt);   //add a new packet with the binary data to the queue
-      sem_post(&queueMutex);
-      sem_post(&queueSem);  //notify is the compliment to wait
+      //updateids must reach the log in order, so allocate and archive together
+      p->lock();
+      Packet *pkt = new Packet(src, cmd, json, len, p->next_uid());
+      //archive the same bytes we broadcast
+      if (!p->append_update(pkt->uid, cmd, pkt->buf->data(), pkt->buf->length())) {
+         log(LERROR, "Failed to archive update %llu for project %u\n", (unsigned long long)pkt->uid, p->lpid);
+      }
+      enqueue(pkt);   //add a new packet with the binary data to the queue
+      p->unlock();
    }
 }
 
 /**
- * sendLatestUpdates sends updates from LastUpdate to current
- * it is expected that the client has already joined a project before calling this function
- * it is expected that the client has already received updates from 0 - lastUpdate
- * this function is typically called when a user is re-joining a project that they had previously worked on
- * @param c the client requesting updates
- * @param lastUpdate the last update the client received
+ * relayBatch archives the updates from an update_batch one after another
+ * and queues them as a single packet
+ * @param src the client that made the updates
+ * @param updates the updates in the order they were sent
  */
-void BasicConnectionManager::sendLatestUpdates(Client *c, uint64_t lastUpdate) {
-   BasicProject *p = findProject(c->getPid());
+void BasicConnectionManager::relayBatch(Client *src, vector<RawUpdate> &updates) {
+   BasicProject *p = findProject(src->getPid());
    if (p) {
-      const vector<char*> &updates = p->get_updates();
-      for (vector<char*>::const_iterator i = updates.cbegin(); i != updates.cend(); i++) {
-         json_object *obj = json_tokener_parse(*i);
-         uint64_t uid;
-         if (uint64_from_json(obj, "updateid", &uid) && uid > lastUpdate) {
-            const char *cmd = string_from_json(obj, "type");
-            if (cmd) {
-               c->post(cmd, obj);
-            }
+      p->lock();
+      Packet *pkt = new Packet(src, p->lpid);
+      for (size_t i = 0; i < updates.size(); i++) {
+         RawUpdate &u = updates[i];
+         size_t len = u.json.length();
+         const char *json = pkt->add(u.cmd, u.json.data(), &len, p->next_uid());
+         if (!p->append_update(pkt->uid, u.cmd, json, len, i == updates.size() - 1)) {
+            log(LERROR, "Failed to archive update %llu for project %u\n", (unsigned long long)pkt->uid, p->lpid);
          }
       }
+      pkt->seal();
+      enqueue(pkt);
+      p->unlock();
+   }
+}
+
+/**
+ * readUpdates reads one page of a client's catch-up.  The next page is only
+ * read once the client has taken this one, and each scan picks up from the
+ * last update visited.
+ */
+bool BasicConnectionManager::readUpdates(Client *c, uint64_t *after, deque<string> &chunks) {
+   BasicProject *p = findProject(c->getPid());
+   if (p == NULL) {
+      return false;
+   }
+   CatchUp cu;
+   cu.c = c;
+   cu.chunks = &chunks;
+   cu.last = *after;
+   cu.count = 0;
+   cu.chunk.reserve(CATCHUP_CHUNK + 1024);
+   p->scan(*after, readUpdate, &cu);
+   if (cu.chunk.length() > 0) {
+      chunks.push_back(cu.chunk);
    }
+   *after = cu.last;
+   return cu.count == CATCHUP_PAGE;
 }
 
 /**
@@ -185,8 +507,8 @@ void BasicConnectionManager::sendLatestUpdates(Client *c, uint64_t lastUpdate) {
  *            caller must delete the returned pointer
  */
 const Project *BasicConnectionManager::getProject(uint32_t pid) {
-   //just use findProject and return as a const *
-   return findProject(pid);
+   BasicProject *p = findProject(pid);
+   return p ? new Project(*p) : NULL;
 }
 
 /**
@@ -224,7 +546,7 @@ vector<const Project*> *BasicConnectionManager::getProjectList(const string &pha
          //get the current Client count for this project
          ClientSet *cs = projects.get((*it)->lpid);
          (*it)->connected = cs ? cs->size() : 0;
-         plist->push_back(*it);
+         plist->push_back(new Project(**it));
       }
    }
    sem_post(&pidLock);
@@ -347,29 +669,7 @@ int BasicConnectionManager::snapforkProject(Client *c, int spid, const string &d
  */
 
 int BasicConnectionManager::importProject(const char *owner, const string &gpid, const string &hash, const string &desc, uint64_t pub, uint64_t sub) {
-   sem_wait(&pidLock);
-   int lpid = basicmodepid++;
-   map<string,vector<BasicProject*>*>::iterator bi = basicProjects.find(hash);
-   vector<BasicProject*> *vpi;
-   if (bi != basicProjects.end()) {
-      vpi = (*bi).second;
-   }
-   else {
-      vpi = new vector<BasicProject*>;
-      basicProjects[hash] = vpi;
-   }
-   BasicProject *p = new BasicProject(lpid, desc);
-   vpi->push_back(p);
-   gpid_lpid_map[gpid] = lpid;
-   pid_project_map[lpid] = p;
-   sem_post(&pidLock);
-
-   p->pub = pub;
-   p->sub = sub;
-   p->hash = hash;
-   p->gpid = gpid;
-
-   return lpid;
+   return newProject(gpid, hash, desc, pub, sub)->lpid;
 }
 
 /**
@@ -383,11 +683,7 @@ json_object *BasicConnectionManager::exportProject(uint32_t pid) {
       return NULL;
    }
    json_object *updates = json_object_new_array();
-   const vector<char*> &vu = p->get_updates();
-   for (vector<char*>::const_iterator vi = vu.cbegin(); vi != vu.cend(); vi++) {
-      json_object *obj = json_tokener_parse(*vi);
-      json_object_array_add(updates, obj);
-   }
+   p->scan(0, export_update, updates);
    return updates;
 }
 
@@ -421,27 +717,7 @@ int BasicConnectionManager::addProject(Client *c, const string &hash, const stri
    fill_random(gpid_bytes, sizeof(gpid_bytes));
    gpid = toHexString(gpid_bytes, sizeof(gpid_bytes));
 
-   sem_wait(&pidLock);
-   lpid = basicmodepid++;
-   map<string,vector<BasicProject*>*>::iterator bi = basicProjects.find(hash);
-   vector<BasicProject*> *vpi;
-   if (bi != basicProjects.end()) {
-      vpi = (*bi).second;
-   }
-   else {
-      vpi = new vector<BasicProject*>;
-      basicProjects[hash] = vpi;
-   }
-   BasicProject *p = new BasicProject(lpid, desc);
-   vpi->push_back(p);
-   gpid_lpid_map[gpid] = lpid;
-   pid_project_map[lpid] = p;
-   sem_post(&pidLock);
-
-   p->pub = pub;
-   p->sub = sub;
-   p->hash = hash;
-   p->gpid = gpid;
+   lpid = newProject(gpid, hash, desc, pub, sub)->lpid;
 
    log(LINFO, "BASIC mode has no notion of users, setting permissions based on REQ\n");
    c->setGpid(gpid);
@@ -24,9 +24,12 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <pthread.h>
+#include <semaphore.h>
 #include "client.h"
 #include "cli_mgr.h"
 #include "mgr_helper.h"
+#include "update_log.h"
 
 using namespace std;
 
@@ -56,6 +59,21 @@ private:
    map<string,uint32_t> basic_mode_users;
    uint32_t uid_for_user(const char *user);
 
+   //durable storage, disabled when log_dir is empty
+   string log_dir;
+   size_t segment_size;
+   UpdateLog::SyncPolicy sync_policy;
+   uint32_t sync_ms;
+   pthread_t flusher;
+   sem_t flush_wake;
+
+   void loadProjects();
+   bool saveProject(BasicProject *p);
+   BasicProject *newProject(const string &gpid, const string &hash, const string &desc, uint64_t pub, uint64_t sub);
+   void registerProject(BasicProject *p);
+   static void *flushThread(void *arg);
+   static bool readUpdate(uint64_t updateid, uint32_t cmd, const char *data, size_t len, void *user);
+
 public:
    BasicConnectionManager(json_object *conf);
    virtual ~BasicConnectionManager();
@@ -64,9 +82,15 @@ public:
     * doAuth authenticates a user
     * This is mostly a NOP in basic mode
     * @param nio The network connection to authenticate
+    * @param features receives the protocol features agreed with the client
     * @return the user id of an authenticated user, or failure code
     */
-   uint32_t doAuth(NetworkIO *nio);
+   uint32_t doAuth(NetworkIO *nio, uint32_t *features);
+
+   /**
+    * dumpStats adds update log activity to the usual client stats
+    */
+   string dumpStats();
 
    /**
     * importUpdate is very similar to 'post', importUpdate only
@@ -79,23 +103,31 @@ public:
    void importUpdate(const char *newowner, int pid, const char *cmd, json_object *obj);
 
    /**
-    * post both queues a newly received update to be sent to other clients and (if in DB mode)
-    * archives the udpate in the database so that future clients can receive it
+    * relay both queues a newly received update to be sent to other clients and
+    * archives the udpate so that future clients can receive it
     * @param src the client that made the update
     * @param cmd the 'command' that was performed (comment, rename, etc)
-    * @param data the 'data' portion of the command (the comment text, etc)
+    * @param json the update as received from the client
+    * @param len the length of json
+    */
+   void relay(Client *src, CommandId cmd, const char *json, size_t len);
+
+   /**
+    * relayBatch archives the updates from an update_batch and queues them
+    * to be sent to other clients as one packet
+    * @param src the client that made the updates
+    * @param updates the updates in the order they were sent
     */
-   void post(Client *src, const char *cmd, json_object *obj);
+   void relayBatch(Client *src, vector<RawUpdate> &updates);
 
    /**
-    * sendLatestUpdates sends updates from LastUpdate to current
-    * it is expected that the client has already joined a project before calling this function
-    * it is expected that the client has already received updates from 0 - lastUpdate
-    * this function is typically called when a user is re-joining a project that they had previously worked on
-    * @param c the client requesting updates
-    * @param lastUpdate the last update the client received
+    * readUpdates reads the next page of a catch-up from the project's archive
+    * @param c the client being caught up
+    * @param after the last updateid already read, advanced past every update read
+    * @param chunks receives the updates c subscribes to
+    * @return true if there may be more updates to read
     */
-   void sendLatestUpdates(Client *c, uint64_t lastUpdate);
+   bool readUpdates(Client *c, uint64_t *after, deque<string> &chunks);
 
    /**
     * getProject gets information related to a local project
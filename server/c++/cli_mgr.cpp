@@ -20,6 +20,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <arpa/inet.h>
 
 #include "utils.h"
@@ -42,12 +43,149 @@ UserInfo::UserInfo() : username("invalid") {
    sub = 0;
 }
 
-Packet::Packet(Client *src, const char *cmd, json_object *obj, uint64_t updateid) {
+Packet::Packet(Client *src, CommandId cmd, const char *json, size_t len, uint64_t updateid)
+   : Packet(src, src->getPid(), cmd, json, len, updateid) {
+}
+
+Packet::Packet(Client *src, uint32_t pid, CommandId cmd, const char *json, size_t len, uint64_t updateid) {
    c = src;
    this->cmd = cmd;
-   this->obj = obj;
+   uid = first_uid = updateid;
+   this->pid = pid;
+   queued_us = 0;
+   next = NULL;
+   string out;
+   build(out, json, len, updateid);
+   buf = SharedBuffer::create(out.c_str(), out.length());
+}
+
+Packet::Packet(Client *src, uint32_t pid) {
+   c = src;
+   cmd = CMD_UPDATE_BATCH;
+   uid = first_uid = 0;
+   this->pid = pid;
+   queued_us = 0;
+   next = NULL;
+   buf = NULL;
+}
+
+Packet::~Packet() {
+   if (buf != NULL) {
+      buf->unref();
+   }
+}
+
+/**
+ * build appends json to out with updateid added
+ */
+void Packet::build(string &out, const char *json, size_t len, uint64_t updateid) {
+   if (!splice_updateid(out, json, len, updateid)) {
+      //only a stale updateid sent by the client gets us here, replace it the slow way
+      json_tokener *tok = json_tokener_new();
+      json_object *obj = json_tokener_parse_ex(tok, json, len);
+      json_tokener_free(tok);
+      if (obj == NULL) {
+         obj = json_object_new_object();
+      }
+      append_json_uint64_val(obj, "updateid", updateid);
+      size_t jlen;
+      const char *js = json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &jlen);
+      out.append(js, jlen);
+      json_object_put(obj);
+   }
+}
+
+const char *Packet::add(CommandId cmd, const char *json, size_t *len, uint64_t updateid) {
+   Part part;
+   part.cmd = cmd;
+   part.offset = (uint32_t)batch.length();
+   build(batch, json, *len, updateid);
+   part.len = (uint32_t)(batch.length() - part.offset);
+   if (parts.empty()) {
+      first_uid = updateid;
+   }
+   parts.push_back(part);
    uid = updateid;
-   append_json_uint64_val(obj, "updateid", updateid);   //is this really necessary?
+   *len = part.len;
+   return batch.data() + part.offset;
+}
+
+void Packet::seal() {
+   buf = SharedBuffer::create(batch.data(), batch.length());
+   string().swap(batch);
+}
+
+PacketQueue::PacketQueue() {
+   head = NULL;
+   depth = 0;
+   high_water = 0;
+   sem_init(&avail, 0, 0);
+}
+
+PacketQueue::~PacketQueue() {
+   while (head != NULL) {
+      Packet *p = head;
+      head = p->next;
+      delete p;
+   }
+   sem_destroy(&avail);
+}
+
+void PacketQueue::push(Packet *p) {
+   Packet *old = head;
+   do {
+      p->next = old;
+   } while (!__atomic_compare_exchange_n(&head, &old, p, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+   uint32_t d = __sync_add_and_fetch(&depth, 1);
+   uint32_t hw = high_water;
+   while (d > hw && !__atomic_compare_exchange_n(&high_water, &hw, d, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+   }
+   sem_post(&avail);
+}
+
+void PacketQueue::wake() {
+   sem_post(&avail);
+}
+
+/*
+ * Producers build a stack, so the consumer reverses what it takes to
+ * restore arrival order.  There is no ABA hazard since the consumer never
+ * removes individual nodes.
+ */
+Packet *PacketQueue::popAll(uint64_t timeout_us) {
+   if (timeout_us == 0) {
+      sem_wait(&avail);
+   }
+   else {
+      timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      uint64_t nsec = deadline.tv_nsec + (timeout_us % 1000000) * 1000;
+      deadline.tv_sec += timeout_us / 1000000 + nsec / 1000000000;
+      deadline.tv_nsec = nsec % 1000000000;
+      if (sem_timedwait(&avail, &deadline) != 0) {
+         return NULL;
+      }
+   }
+   Packet *list = __atomic_exchange_n(&head, (Packet*)NULL, __ATOMIC_ACQUIRE);
+   if (list == NULL) {
+      //a previous batch already took the packet behind this post, or this is a wake
+      return NULL;
+   }
+   Packet *fifo = NULL;
+   uint32_t count = 0;
+   while (list != NULL) {
+      Packet *n = list->next;
+      list->next = fifo;
+      fifo = list;
+      list = n;
+      count++;
+   }
+   __sync_sub_and_fetch(&depth, count);
+   //absorb the posts that belong to the rest of this batch
+   for (uint32_t i = 1; i < count && sem_trywait(&avail) == 0; i++) {
+   }
+   return fifo;
 }
 
 /**
@@ -59,8 +197,32 @@ ConnectionManager::ConnectionManager(json_object *conf) {
    this->conf = conf;
    done = false;
    sem_init(&pidLock, 0, 1);
-   sem_init(&queueSem, 0, 0);
-   sem_init(&queueMutex, 0, 1);
+   sem_init(&limitsLock, 0, 1);
+   relay_fast_path = getIntOption(conf, "RELAY_FAST_PATH", 1) != 0;
+   features = getIntOption(conf, "UPDATE_BATCH", 1) ? FEATURE_UPDATE_BATCH : 0;
+   int ack_delay = getIntOption(conf, "ACK_DELAY_MS", 10);
+   ack_delay_us = ack_delay > 0 ? ack_delay * 1000ULL : 0;
+   limits.client_msgs = getIntOption(conf, "CLIENT_MSG_RATE", 0);
+   limits.client_bytes = getIntOption(conf, "CLIENT_BYTE_RATE", 0);
+   limits.project_msgs = getIntOption(conf, "PROJECT_MSG_RATE", 0);
+   limits.project_bytes = getIntOption(conf, "PROJECT_BYTE_RATE", 0);
+   limits.burst_ms = getIntOption(conf, "RATE_BURST_MS", 1000);
+   limits.reject = getStringOption(conf, "RATE_LIMIT_ACTION", "delay") == "reject";
+   int nthreads = getIntOption(conf, "DISPATCH_THREADS", 1);
+   if (nthreads < 1) {
+      nthreads = 1;
+   }
+   for (int i = 0; i < nthreads; i++) {
+      Dispatcher *d = new Dispatcher;
+      d->mgr = this;
+      d->id = i;
+      d->dispatched = 0;
+      d->total_latency_us = 0;
+      d->max_latency_us = 0;
+      d->acks_sent = 0;
+      d->acks_saved = 0;
+      dispatchers.push_back(d);
+   }
 }
 
 const UserInfo &ConnectionManager::getUserInfo(uint32_t uid) {
@@ -75,13 +237,43 @@ void ConnectionManager::start() {
    pthread_attr_t attr;
    pthread_attr_init(&attr);
    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-   pthread_t tid;
-   pthread_create(&tid, &attr, run, (void*)this);
+   for (vector<Dispatcher*>::iterator i = dispatchers.begin(); i != dispatchers.end(); i++) {
+      pthread_t tid;
+      pthread_create(&tid, &attr, run, (void*)*i);
+   }
+   pthread_attr_destroy(&attr);
+   log(LINFO, "Started %u dispatch threads\n", (uint32_t)dispatchers.size());
 }
 
-static bool termClients(Client *c, void *user) {
-   c->terminate();
-   return true;
+void ConnectionManager::enqueue(Packet *p) {
+   p->queued_us = monotonic_us();
+   dispatchers[p->pid % dispatchers.size()]->queue.push(p);
+}
+
+uint32_t ConnectionManager::negotiate(json_object *req) {
+   uint32_t offered = 0;
+   uint32_from_json(req, "features", &offered);
+   return offered & features;
+}
+
+/**
+ * post is relay for updates that had to be parsed on the way in.  Any
+ * updateid the client sent is dropped, the server assigns its own.
+ */
+void ConnectionManager::post(Client *src, CommandId cmd, json_object *obj) {
+   json_object_object_del(obj, "updateid");
+   size_t len;
+   const char *json = json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &len);
+   relay(src, cmd, json, len);
+   json_object_put(obj);
+}
+
+/**
+ * sendLatestUpdates hands the catch-up to the client, which reads it through
+ * readUpdates as its connection drains
+ */
+void ConnectionManager::sendLatestUpdates(Client *c, uint64_t lastUpdate) {
+   c->catchUp(lastUpdate);
 }
 
 /**
@@ -91,13 +283,42 @@ static bool termClients(Client *c, void *user) {
 void ConnectionManager::terminate() {
    log(LINFO, "ConnectionManager terminating\n");
    done = true;
-   projects.loopClients(termClients, NULL);
+   for (vector<Dispatcher*>::iterator i = dispatchers.begin(); i != dispatchers.end(); i++) {
+      (*i)->queue.wake();
+   }
+   //terminate removes each client from its project, which can't happen inside a loop
+   vector<Client*> all;
+   projects.allClients(all);
+   for (vector<Client*>::iterator i = all.begin(); i != all.end(); i++) {
+      (*i)->terminate();
+   }
    if (conf != NULL) {
       json_object_put(conf);
       conf = NULL;
    }
 }
 
+/**
+ * setRateLimits is called from the management thread to change the limits
+ * that Client::throttle applies to every publishing client
+ * @param l the new limits
+ */
+void ConnectionManager::setRateLimits(const RateLimits &l) {
+   sem_wait(&limitsLock);
+   limits = l;
+   sem_post(&limitsLock);
+   log(LINFO, "Rate limits now client %u msgs/s %u bytes/s, project %u msgs/s %u bytes/s, "
+       "burst %ums, excess %s\n", l.client_msgs, l.client_bytes, l.project_msgs, l.project_bytes,
+       l.burst_ms, l.reject ? "rejected" : "delayed");
+}
+
+RateLimits ConnectionManager::getRateLimits() {
+   sem_wait(&limitsLock);
+   RateLimits l = limits;
+   sem_post(&limitsLock);
+   return l;
+}
+
 /**
  * remove removes a client from a currently reflecting project
  * @param c the client to remove (from whatever project it is already connected to)
@@ -105,6 +326,9 @@ void ConnectionManager::terminate() {
 void ConnectionManager::remove(Client *c) {
 //  logln("Removing client from " + c->getGpid() + " chain", LINFO1);
    projects.removeClient(c);
+   //removeClient waits out any dispatcher still looping over the project, so
+   //no more acks can arrive and the dispatcher can no longer flush these
+   c->flushAcks();
 }
 
 static bool clientStats(Client *c, void *user) {
@@ -125,47 +349,133 @@ string ConnectionManager::dumpStats() {
    else {
       sb = "Stats:\n" + sb;
    }
+   char buf[256];
+   for (vector<Dispatcher*>::iterator i = dispatchers.begin(); i != dispatchers.end(); i++) {
+      Dispatcher *d = *i;
+      uint64_t count = d->dispatched;
+      uint64_t avg = count ? d->total_latency_us / count : 0;
+      snprintf(buf, sizeof(buf), "Dispatcher %u: depth %u, high water %u, dispatched %llu, "
+               "latency avg %lluus max %lluus, acks sent %llu saved %llu\n", d->id, d->queue.getDepth(),
+               d->queue.getHighWater(), (unsigned long long)count, (unsigned long long)avg,
+               (unsigned long long)d->max_latency_us, (unsigned long long)d->acks_sent,
+               (unsigned long long)d->acks_saved);
+      sb += buf;
+   }
+   RateLimits l = getRateLimits();
+   snprintf(buf, sizeof(buf), "Rate limits: client %u msgs/s %u bytes/s, project %u msgs/s %u bytes/s, "
+            "burst %ums, excess %s\n", l.client_msgs, l.client_bytes, l.project_msgs,
+            l.project_bytes, l.burst_ms, l.reject ? "rejected" : "delayed");
+   sb += buf;
    return sb;
 }
 
+/**
+ * dispatchBatch sends a client the updates from a batch that it subscribes
+ * to with a single write.  When it subscribes to all of them, which is the
+ * usual case, it shares the packet's buffer like any other update.
+ */
+static void dispatchBatch(Client *c, Packet *p) {
+   bool all = true;
+   string some;
+   for (vector<Packet::Part>::iterator i = p->parts.begin(); i != p->parts.end(); i++) {
+      if (c->admit((*i).cmd)) {
+         if (!all) {
+            some.append(p->buf->data() + (*i).offset, (*i).len);
+         }
+      }
+      else if (all) {
+         //parts are laid out in order, so everything before this one was admitted
+         all = false;
+         some.assign(p->buf->data(), (*i).offset);
+      }
+   }
+   if (all) {
+      c->getConnection()->sendBuffer(p->buf);
+   }
+   else if (some.length() > 0) {
+      SharedBuffer *buf = SharedBuffer::create(some.data(), some.length());
+      c->getConnection()->sendBuffer(buf);
+      buf->unref();
+   }
+}
+
 static bool dispatch(Client *c, void *user) {
    Packet *p = (Packet*)user;
 
    if (c != p->c) {  //only send to other than originator
-      //increment ref count on json object before sending
-      //because writeJson will decrement it and we can't have the object
-      //garbage collected until all clients have received it
-      json_object_get(p->obj);
-      c->post(p->cmd, p->obj);
+      if (p->parts.empty()) {
+         //every recipient shares the packet's pre-serialized buffer
+         c->post(p->cmd, p->buf);
+      }
+      else {
+         dispatchBatch(c, p);
+      }
    }
    else {
-      //send updateid back to the originator
-      json_object *obj = json_object_new_object();
-      append_json_uint64_val(obj, "updateid", p->uid);
-      c->send_data(MSG_ACK_UPDATEID, obj);
+      //the updateids go back to the originator once its acks are flushed
+      c->noteAck(p->first_uid, p->uid);
    }
 
    return true;
 }
 
+static bool flushAcks(Client *c, void *user) {
+   Dispatcher *d = (Dispatcher*)user;
+   uint32_t count = c->flushAcks();
+   if (count > 0) {
+      d->acks_sent++;
+      d->acks_saved += count - 1;
+   }
+   return true;
+}
+
 /**
  * run perpetually waits to be notified that a new packet has been queued, then
  * sends this packet to other clients according to permissions and project subscription
  * this also sends the server created unique updateID back to the originator of the packet
+ * Each dispatcher thread runs this loop over its own shard of the projects
+ * Acks are held for up to ACK_DELAY_MS after the first one in a project,
+ * then every client in that project has its acks sent as one message.
  */
 void *ConnectionManager::run(void *arg) {
-   ConnectionManager *mgr = (ConnectionManager*)arg;
+   Dispatcher *d = (Dispatcher*)arg;
+   ConnectionManager *mgr = d->mgr;
+   uint64_t wait_us = 0;
    while (!mgr->done) {
-      sem_wait(&mgr->queueSem);
-      sem_wait(&mgr->queueMutex);
-      Packet *p = mgr->queue[0];
-      //*** does add/remove need to be synchronized on vectors?
-      mgr->queue.erase(mgr->queue.begin());
-      sem_post(&mgr->queueMutex);
-      //get the project associated with this notification
-      mgr->projects.loopProject(p->c->getPid(), dispatch, p);
-      json_object_put(p->obj);
-      delete p;
+      Packet *p = d->queue.popAll(wait_us);
+      while (p != NULL) {
+         Packet *next = p->next;
+         //get the project associated with this notification
+         mgr->projects.loopProject(p->pid, dispatch, p);
+         uint64_t now = monotonic_us();
+         uint64_t latency = now - p->queued_us;
+         d->dispatched++;
+         d->total_latency_us += latency;
+         if (latency > d->max_latency_us) {
+            d->max_latency_us = latency;
+         }
+         //does nothing if the project already has acks waiting
+         d->ack_due.insert(make_pair(p->pid, now + mgr->ack_delay_us));
+         delete p;
+         p = next;
+      }
+      //flush whatever is due and sleep no longer than the next deadline
+      uint64_t now = monotonic_us();
+      wait_us = 0;
+      map<uint32_t,uint64_t>::iterator i = d->ack_due.begin();
+      while (i != d->ack_due.end()) {
+         if ((*i).second <= now) {
+            mgr->projects.loopProject((*i).first, flushAcks, d);
+            d->ack_due.erase(i++);
+         }
+         else {
+            uint64_t left = (*i).second - now;
+            if (wait_us == 0 || left < wait_us) {
+               wait_us = left;
+            }
+            i++;
+         }
+      }
    }
    return NULL;
 }
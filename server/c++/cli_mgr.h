@@ -23,6 +23,7 @@
 
 #include <map>
 #include <vector>
+#include <deque>
 #include <set>
 #include <string>
 #include <stdint.h>
@@ -31,6 +32,9 @@
 #include <json-c/json.h>
 
 #include "projectmap.h"
+#include "io.h"
+#include "commands.h"
+#include "ratelimit.h"
 
 using namespace std;
 
@@ -43,6 +47,12 @@ class NetworkIO;
 #define AUTH_INVALID_REPLY ((uint32_t)-4)
 #define FIRST_BAD_UID 0x80000000
 
+//size of the pieces a catch-up is written to the client in
+#define CATCHUP_CHUNK (64 * 1024)
+
+//updates read at a time while catching up a client
+#define CATCHUP_PAGE 1000
+
 struct UserInfo {
    UserInfo(const char *uname, uint32_t _uid, uint64_t _pub, uint64_t _sub);
    UserInfo();
@@ -52,17 +62,141 @@ struct UserInfo {
    uint64_t sub;
 };
 
+/**
+ * RawUpdate is a single serialized update taken from an update_batch
+ */
+struct RawUpdate {
+   CommandId cmd;
+   string json;
+};
+
 /**
  * Packet is a helper class to represent a tuple pairing a client
- * with a command posted by that client
+ * with a command posted by that client.  The update is built exactly
+ * once, into buf, from the bytes the client sent, and that buffer is
+ * shared by every subscriber it is sent to.
+ * A Packet may also carry every update from one update_batch, in which
+ * case parts locates each update within buf.
  */
 class Packet {
 public:
+   struct Part {
+      CommandId cmd;
+      uint32_t offset;
+      uint32_t len;
+   };
+
    Client *c;
-   const char *cmd;
-   json_object *obj;
-   uint64_t uid;
-   Packet(Client *src, const char *cmd, json_object *obj, uint64_t updateid);
+   CommandId cmd;
+   SharedBuffer *buf;
+   uint64_t uid;        //the updateid, or the last one in a batch
+   uint64_t first_uid;  //the first updateid in a batch, same as uid otherwise
+   vector<Part> parts;  //empty unless this is a batch
+   uint32_t pid;        //project the update belongs to
+   uint64_t queued_us;  //time the packet was queued for dispatch
+   Packet *next;        //link for PacketQueue
+   /**
+    * @param json the serialized update as received, without an updateid
+    * @param len the length of json
+    * @param updateid the id to add to the update
+    */
+   Packet(Client *src, CommandId cmd, const char *json, size_t len, uint64_t updateid);
+   /**
+    * this form takes the project id explicitly for updates that are released
+    * after their originator may already have disconnected.  src is only ever
+    * compared against, never dereferenced.
+    */
+   Packet(Client *src, uint32_t pid, CommandId cmd, const char *json, size_t len, uint64_t updateid);
+
+   /**
+    * this form starts an empty batch, which is filled with add and then
+    * finished with seal before it is queued
+    */
+   Packet(Client *src, uint32_t pid);
+   ~Packet();
+
+   /**
+    * add appends an update to a batch
+    * @param json the serialized update as received, without an updateid
+    * @param len the length of json
+    * @param updateid the id to add to the update, ids must increase
+    * @return the update as it will be sent, valid until the next add
+    */
+   const char *add(CommandId cmd, const char *json, size_t *len, uint64_t updateid);
+
+   /**
+    * seal moves the updates added to a batch into buf
+    */
+   void seal();
+
+private:
+   static void build(string &out, const char *json, size_t len, uint64_t updateid);
+
+   string batch;        //updates added so far, until seal
+};
+
+/**
+ * PacketQueue is an unbounded multi-producer, single-consumer queue of
+ * Packets.  Producers push with a single compare and swap and never take a
+ * lock.  The consumer takes everything queued so far in one atomic exchange
+ * and hands it back in FIFO order, so the cost of a pop does not grow with
+ * the depth of the queue.
+ */
+class PacketQueue {
+public:
+   PacketQueue();
+   ~PacketQueue();
+
+   /**
+    * push adds a packet to the tail of the queue, safe to call from any thread
+    */
+   void push(Packet *p);
+
+   /**
+    * popAll blocks until woken, then removes every queued packet
+    * @param timeout_us the longest to wait in microseconds, 0 to wait indefinitely
+    * @return a list of packets linked through Packet::next in arrival order,
+    * which may be NULL
+    */
+   Packet *popAll(uint64_t timeout_us = 0);
+
+   /**
+    * wake releases a consumer blocked in popAll, which will return NULL
+    */
+   void wake();
+
+   uint32_t getDepth() {return depth;};
+   uint32_t getHighWater() {return high_water;};
+
+private:
+   Packet *head;     //most recently pushed packet, list runs newest to oldest
+   sem_t avail;      //posted once per push
+   uint32_t depth;
+   uint32_t high_water;
+};
+
+class ConnectionManager;
+
+/**
+ * Dispatcher is one shard of the packet dispatch work.  Every project is
+ * served by exactly one Dispatcher, chosen by project id, so updates within
+ * a project are delivered in order while unrelated projects proceed in
+ * parallel.
+ */
+struct Dispatcher {
+   ConnectionManager *mgr;
+   uint32_t id;
+   PacketQueue queue;
+
+   //latency is measured from queueing to completion of delivery
+   uint64_t dispatched;
+   uint64_t total_latency_us;
+   uint64_t max_latency_us;
+
+   //projects whose clients are holding acks, and when those acks are due
+   map<uint32_t,uint64_t> ack_due;
+   uint64_t acks_sent;
+   uint64_t acks_saved;   //acks folded into another one rather than sent
 };
 
 class ConnectionManager {
@@ -75,12 +209,14 @@ public:
 protected:
    map<uint32_t,UserInfo> user_map;
 
-   vector<Packet*> queue;
+   //incoming packets are queued to the shard serving their project
+   vector<Dispatcher*> dispatchers;
    sem_t pidLock;
 
-   //counting semephore for incoming packets from the server
-   sem_t queueSem;
-   sem_t queueMutex;
+   /**
+    * enqueue hands a packet to the dispatcher responsible for its project
+    */
+   void enqueue(Packet *p);
 
 public:
    ConnectionManager(json_object *conf);
@@ -114,9 +250,10 @@ public:
     * doAuth authenticates a user
     * Authentication requirements may differ in different ConnectionManager subclasses
     * @param nio The network connection to authenticate
+    * @param features receives the protocol features agreed with the client
     * @return the user id of an authenticated user, or failure code
     */
-   virtual uint32_t doAuth(NetworkIO *nio) = 0;
+   virtual uint32_t doAuth(NetworkIO *nio, uint32_t *features) = 0;
 
    /**
     * importUpdate is very similar to 'post', importUpdate only
@@ -133,24 +270,88 @@ public:
     * archives the udpate in the database so that future clients can receive it
     * @param src the client that made the update
     * @param cmd the 'command' that was performed (comment, rename, etc)
-    * @param data the 'data' portion of the command (the comment text, etc)
+    * @param obj the update, post takes ownership
+    */
+   virtual void post(Client *src, CommandId cmd, json_object *obj);
+
+   /**
+    * relay is post for an update that is still in the form it was received.
+    * The bytes are archived and forwarded without ever being parsed.
+    * @param src the client that made the update
+    * @param cmd the 'command' that was performed (comment, rename, etc)
+    * @param json the serialized update, which must not contain an updateid
+    * @param len the length of json
+    */
+   virtual void relay(Client *src, CommandId cmd, const char *json, size_t len) = 0;
+
+   /**
+    * relayBatch is relay for the updates from an update_batch.  They are
+    * archived together and dispatched as a single Packet.
+    * @param src the client that made the updates
+    * @param updates the updates in the order they were sent, none may contain an updateid
     */
-   virtual void post(Client *src, const char *cmd, json_object *obj) = 0;
+   virtual void relayBatch(Client *src, vector<RawUpdate> &updates) = 0;
+
+   /**
+    * negotiate decides which of the optional protocol features offered in an
+    * auth_request this server will use with that client
+    * @param req the auth_request
+    * @return the FEATURE_ bits to confirm in the auth_reply
+    */
+   uint32_t negotiate(json_object *req);
+
+   /**
+    * relayEnabled reports whether clients may hand updates to relay unparsed
+    */
+   bool relayEnabled() {
+      return relay_fast_path;
+   }
+
+   /**
+    * getRateLimits returns a copy of the publishing limits currently in force
+    */
+   RateLimits getRateLimits();
+
+   /**
+    * setRateLimits replaces the publishing limits, existing clients
+    * are held to the new limits from their next update
+    */
+   void setRateLimits(const RateLimits &l);
 
    /**
     * dumpStats dumps send / receive stats for each connected client
     */
-   string dumpStats();
+   virtual string dumpStats();
+
+   /**
+    * compact folds the update logs of projects so that catching up on them
+    * replays only the updates that still matter
+    * @param pid the project to compact, or 0 for every project with enough
+    * new updates to be worth it
+    * @return the number of updates found to be superseded, or -1 if compaction
+    * failed or is not supported by this manager
+    */
+   virtual int64_t compact(uint32_t pid) {return -1;};
 
    /**
     * sendLatestUpdates sends updates from LastUpdate to current
     * it is expected that the client has already joined a project before calling this function
     * it is expected that the client has already received updates from 0 - lastUpdate
     * this function is typically called when a user is re-joining a project that they had previously worked on
+    * The client pulls the updates through readUpdates as it takes them (see Client::catchUp)
     * @param c the client requesting updates
     * @param lastUpdate the last update the client received
     */
-   virtual void sendLatestUpdates(Client *c, uint64_t lastUpdate) = 0;
+   void sendLatestUpdates(Client *c, uint64_t lastUpdate);
+
+   /**
+    * readUpdates reads the next page of a catch-up
+    * @param c the client being caught up
+    * @param after the last updateid already read, advanced past every update read
+    * @param chunks receives the updates c subscribes to, in pieces of about CATCHUP_CHUNK bytes
+    * @return true if there may be more updates to read
+    */
+   virtual bool readUpdates(Client *c, uint64_t *after, deque<string> &chunks) = 0;
 
    /**
     * getProject gets information related to a local project
@@ -171,7 +372,8 @@ public:
     * actually a pinfo (project info) object, the list does NOT contain all projects, but
     * only contains projects relevant to the binary that is currently loaded in IDA
     * @param phash the IDA generated hash that is unique among the analysis files
-    * @return a vector of project info objects for the provided phash
+    * @return a vector of project info objects for the provided phash, the
+    * caller needs to delete the vector and each of its items
     */
    virtual vector<const Project*> *getProjectList(const string &phash) = 0;
 
@@ -302,6 +504,19 @@ protected:
 private:
    json_object *conf;
 
+   //updates may skip the json parser entirely (RELAY_FAST_PATH)
+   bool relay_fast_path;
+
+   //FEATURE_ bits this server is willing to negotiate
+   uint32_t features;
+
+   //how long acks are held so that several can go out as one (ACK_DELAY_MS)
+   uint64_t ack_delay_us;
+
+   //publishing limits, adjustable through the management port, guarded by limitsLock
+   RateLimits limits;
+   sem_t limitsLock;
+
 };
 
 
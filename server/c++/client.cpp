@@ -24,6 +24,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <pthread.h>
+#include <unistd.h>
 #include <map>
 #include <json-c/json.h>
 
@@ -31,9 +32,9 @@
 #include "utils.h"
 #include "proj_info.h"
 #include "cli_mgr.h"
+#include "clientset.h"
 
-map<string,ClientMsgHandler> *Client::handlers;
-map<string,uint32_t> perms_map;
+ClientMsgHandler *Client::handlers;
 
 /**
  * Client
@@ -66,12 +67,34 @@ Client::Client(ConnectionManager *mgr, NetworkIO *s, uint32_t uid) {
    this->uid = ui.uid;  //user id associated with this connection
    username = ui.username;
    pid = INVALID_PID;  //not associated with a project yet
+   features = 0;
+   sem_init(&ackLock, 0, 1);
+   ack_first = ack_last = 0;
+   ack_count = 0;
+   resume_us = 0;
+   rejecting = false;
+   closing = false;
+   throttle_delays = 0;
+   throttle_delay_us = 0;
+   throttle_rejects = 0;
+   catching_up = false;
+   catchup_more = false;
+   catchup_after = 0;
+   catchup_progress = 0;
 
    cm = mgr;
    conn = s;
 
    //the dummy gpid need to consist entirely of hex values.
    gpid = "deadbeefdeadbeefdeadbeefdeadbeefdeadbeefdeadbeefdeadbeefdeadbeef";
+
+   memset(tx_stats, 0, sizeof(tx_stats));
+   memset(rx_stats, 0, sizeof(rx_stats));
+}
+
+Client::~Client() {
+   delete conn;
+   sem_destroy(&ackLock);
 }
 
 void Client::setChallenge(const uint8_t *data, uint32_t len) {
@@ -108,15 +131,15 @@ void Client::clog(int verbosity, const char *format, ...) {
  * post is the function that actually posts updates to clients (if subscribing)
  * @param data the bytearray containing the update to send
  */
-void Client::post(const char *msg, json_object *obj) {
-   if (checkPermissions(msg, subscribe)) {
+void Client::post(CommandId cmd, json_object *obj) {
+   if (checkPermissions(cmd, subscribe)) {
       //only post if client is subscribing and is allowed to recieve that particular command
-      log(LDEBUG, "post- %s\n", json_object_to_json_string(obj));
-      const char *cmd = string_from_json(obj, "type");
+      LOG(LDEBUG, "post- %s\n", json_object_to_json_string(obj));
       rx_stats[cmd]++;
       conn->writeJson(obj);
    }
    else {
+      json_object_put(obj);
 /*
       log(LINFO3, "Client %s:%s:%d failed to post data. (probably subscribe permission: "
                          + parseCommand(data) + ")", hash.c_str(), conn->getInetAddress().getHostAddress(), conn->getPeerPort());
@@ -124,6 +147,50 @@ void Client::post(const char *msg, json_object *obj) {
    }
 }
 
+void Client::post(CommandId cmd, SharedBuffer *buf) {
+   if (admit(cmd)) {
+      log(LDEBUG, "post- %s\n", buf->data());
+      conn->sendBuffer(buf);
+   }
+}
+
+void Client::noteAck(uint64_t first, uint64_t last) {
+   sem_wait(&ackLock);
+   if (ack_count++ == 0) {
+      ack_first = first;
+   }
+   ack_last = last;
+   sem_post(&ackLock);
+}
+
+/**
+ * flushAcks acknowledges a single update exactly as it always has.  Several
+ * become one ack_updateid_range for plugins that negotiated update_batch,
+ * and an ack_updateid of the latest updateid for those that didn't, which
+ * is all the plugin ever records.
+ */
+uint32_t Client::flushAcks() {
+   sem_wait(&ackLock);
+   uint32_t count = ack_count;
+   uint64_t first = ack_first;
+   uint64_t last = ack_last;
+   ack_count = 0;
+   sem_post(&ackLock);
+   if (count == 0) {
+      return 0;
+   }
+   json_object *obj = json_object_new_object();
+   if (first == last || (features & FEATURE_UPDATE_BATCH) == 0) {
+      append_json_uint64_val(obj, "updateid", last);
+      send_data(MSG_ACK_UPDATEID, obj);
+   }
+   else {
+      append_json_uint64_val(obj, "first", first);
+      append_json_uint64_val(obj, "last", last);
+      send_data(MSG_ACK_UPDATEID_RANGE, obj);
+   }
+   return count;
+}
 
 /**
  * similar to post, but does not check subscription status, and takes command as a arg
@@ -144,7 +211,7 @@ void Client::send_data(const char *command, json_object *obj) {
       log(LDEBUG, "Client::send_data calling conn->writeJson\n");
       conn->writeJson(obj);  //calls json_object_put
       //fprintf(stderr, "send_data- cmd: %s\n");
-      rx_stats[command]++;
+      rx_stats[command_id(command)]++;
 /*
    }
    else {
@@ -194,45 +261,22 @@ void Client::terminate() {
 string Client::dumpStats() {
    string sb = "Stats for " + hash + ":" + conn->getPeerAddr() + "\n";
    sb += "rx     tx     command\n";
-   for (map<string,int>::iterator mi = tx_stats.begin(); mi != tx_stats.end(); mi++) {
-      if (rx_stats[mi->first] == 0) {
+   for (int i = 0; i < CMD_COUNT; i++) {
+      if (rx_stats[i] != 0 || tx_stats[i] != 0) {
          char buf[128];
-         snprintf(buf, sizeof(buf), "%-7d%-7d%s\n", 0, mi->second, mi->first.c_str());
+         snprintf(buf, sizeof(buf), "%-7u%-7u%s\n", rx_stats[i], tx_stats[i], command_names[i]);
          sb += buf;
       }
    }
-   for (map<string,int>::iterator mi = rx_stats.begin(); mi != rx_stats.end(); mi++) {
+   if (throttle_delays != 0 || throttle_rejects != 0) {
       char buf[128];
-      snprintf(buf, sizeof(buf), "%-7d%-7d%s\n", mi->second, tx_stats[mi->first], mi->first.c_str());
+      snprintf(buf, sizeof(buf), "throttled: %u delays totalling %llums, %u updates rejected\n",
+               throttle_delays, (unsigned long long)(throttle_delay_us / 1000), throttle_rejects);
       sb += buf;
    }
    return sb;
 }
 
-/**
- * checkPermissions checks to see if the current client has permissions to perform an operation
- * @param command the command to check permissions on
- * @param permType the permission types to check (publish/subscribe)
- */
-/* These are grouped into 'collabREate' permissions, just so there are fewer permissions to manage
- * for example all the segment operations (add, del, start/end change, etc) are grouped into
- * 'segment' permissions.
- */
-bool Client::checkPermissions(const char *command, uint64_t permType) {
-   bool isallowed = false;
-//   log(LDEBUG, "checking for permission %n", command);
-   map<string,uint32_t>::iterator mi = perms_map.find(command);
-
-   if (mi != perms_map.end()) {
-      uint32_t mask = mi->second;
-      isallowed = ((permType & mask) > 0) ?  true : false;
-   }  //end command switch
-   else {
-      log(LERROR, "unmatched command %s found in publish switch\n", command);
-   }
-   return isallowed;
-}
-
 uint32_t Client::getPeerPort() {
    return conn->getPeerPort();
 }
@@ -257,44 +301,26 @@ void Client::run() {
    try {
       bool done = false;
       while (!done) {
-         json_object *obj = conn->readJson();
-         if (obj == NULL) {
+         const char *frame;
+         size_t len;
+         if (!conn->readFrame(&frame, &len)) {
             log(LINFO, "json_object parsing failed in client loop\n");
             //received something that can't be parsed, bail
             break;
          }
-         const char *cmd = string_from_json(obj, "type");
-         log(LINFO, "processing %s\n", cmd);
-         map<string,ClientMsgHandler>::iterator i = handlers->find(cmd);
-         if (i != handlers->end()) {
-            ClientMsgHandler h = i->second;
-            done = (*h)(obj, this);
-            json_object_put(obj);
+         done = handleFrame(frame, len);
+         //this thread belongs to the client, so it can wait for a catch-up to drain
+         while (!done && catching_up) {
+            done = !conn->throttle() || !continueCatchUp();
          }
-         else if (pid == INVALID_PID) {
-            send_error("Not allowed to send project updates before joining a project\n");
-         }
-         else {
-            //no handler found so this is not a control message, post it
-            //only accept commands if the client is
-            if (publish > 0) {
-               //only post if this client chose to publish,
-               //(though they really shouldn't have sent any data if they are not publishing)
-               if (checkPermissions(cmd, publish)) {
-                  cm->post(this, cmd, obj);
-               }
-               else {
-                  log(LINFO, "Skipping update no permissions\n");
-                  json_object_put(obj);
-               }
-            }
-            else {
-               log(LINFO, "Skipping update. publish: 0x%X\n", (uint32_t)publish);
-               json_object_put(obj);
+         if (!done && resume_us != 0) {
+            //over the rate limit, stop reading until back within it
+            uint64_t now = monotonic_us();
+            if (resume_us > now) {
+               usleep(resume_us - now);
             }
+            resume_us = 0;
          }
-         log(LDEBUG, "received cmd: %s\n", cmd);
-         tx_stats[cmd]++;
       }
    } catch (IOException ex) {
       log(LERROR, "An IOException occurred: %s\n", ex.getMessage().c_str());
@@ -303,94 +329,268 @@ void Client::run() {
    terminate();
 }
 
+/**
+ * onReadable is the reactor mode counterpart to run. Rather than blocking
+ * in readJson, it consumes whatever has arrived and returns to the Reactor
+ */
+bool Client::onReadable() {
+   if (!conn->fill()) {
+      closing = true;
+   }
+   return drain();
+}
+
+bool Client::resume() {
+   resume_us = 0;
+   return drain();
+}
+
+bool Client::onWritable() {
+   //make room ourselves rather than waiting for the Writer to get to it
+   conn->flush();
+   if (!continueCatchUp()) {
+      return false;
+   }
+   if (catching_up) {
+      return true;
+   }
+   //carry on with anything that arrived behind the catch-up request
+   return drain();
+}
+
+bool Client::checkIdle(time_t now) {
+   if (catching_up) {
+      //nothing is read during a catch-up, so it is alive as long as it takes updates
+      return ping_timeout == 0 || (now - catchup_progress) < ping_timeout;
+   }
+   return conn->checkIdle(now);
+}
+
+void Client::catchUp(uint64_t lastUpdate) {
+   catchup.clear();
+   catchup_after = lastUpdate;
+   catchup_more = true;
+   catching_up = true;
+   catchup_progress = time(NULL);
+   //a failed connection is shut down, the reader notices that in the usual way
+   continueCatchUp();
+}
+
+bool Client::continueCatchUp() {
+   while (catching_up && !conn->backlogged()) {
+      if (catchup.empty()) {
+         if (!catchup_more) {
+            catching_up = false;
+            break;
+         }
+         catchup_more = cm->readUpdates(this, &catchup_after, catchup);
+         continue;
+      }
+      SharedBuffer *buf = SharedBuffer::create(catchup.front().data(), catchup.front().length());
+      bool ok = conn->sendBuffer(buf);
+      buf->unref();
+      catchup.pop_front();
+      if (!ok) {
+         //anything more would leave a gap
+         catchup.clear();
+         catching_up = false;
+         return false;
+      }
+      catchup_progress = time(NULL);
+   }
+   return true;
+}
+
+bool Client::drain() {
+   try {
+      const char *frame;
+      size_t len;
+      while (conn->nextFrame(&frame, &len)) {
+         if (frame == NULL) {
+            //no more complete messages buffered
+            return !closing;
+         }
+         if (handleFrame(frame, len)) {
+            return false;
+         }
+         if (resume_us != 0) {
+            //over the rate limit, the Reactor resumes us later
+            return true;
+         }
+         if (catching_up) {
+            //the Reactor calls onWritable until the catch-up is done
+            return true;
+         }
+      }
+   } catch (IOException ex) {
+      log(LERROR, "An IOException occurred: %s\n", ex.getMessage().c_str());
+      return false;
+   }
+   log(LINFO, "json_object parsing failed in client loop\n");
+   return false;
+}
+
+/**
+ * handleFrame relays ordinary updates straight from the receive buffer.
+ * Control messages, and anything the scanner can't vouch for, go through
+ * the json parser and handleMessage as before.
+ */
+bool Client::handleFrame(const char *frame, size_t len) {
+   if (cm->relayEnabled()) {
+      const char *type;
+      size_t type_len;
+      bool has_updateid;
+      if (scan_update(frame, len, &type, &type_len, &has_updateid) && type != NULL && !has_updateid && type_len < 64) {
+         char cmd[64];
+         memcpy(cmd, type, type_len);
+         cmd[type_len] = 0;
+         CommandId id = command_id(cmd);
+         if (id != CMD_UNKNOWN && handlers[id] == NULL) {
+            log(LINFO, "processing %s\n", cmd);
+            log(LDEBUG, "received cmd: %s\n", cmd);
+            tx_stats[id]++;
+            if (acceptUpdate(id, cmd) && throttle(1, len)) {
+               cm->relay(this, id, frame, len);
+            }
+            return false;
+         }
+      }
+   }
+   json_object *obj = conn->parseFrame(frame, len);
+   if (obj == NULL) {
+      return true;
+   }
+   return handleMessage(obj, len);
+}
+
+/**
+ * acceptUpdate checks that this client may publish an update
+ * @return true if the update should be posted
+ */
+bool Client::acceptUpdate(CommandId id, const char *cmd) {
+   if (pid == INVALID_PID) {
+      send_error("Not allowed to send project updates before joining a project\n");
+   }
+   //only accept commands if the client is
+   else if (publish > 0) {
+      //only post if this client chose to publish,
+      //(though they really shouldn't have sent any data if they are not publishing)
+      if (checkPermissions(id, publish)) {
+         return true;
+      }
+      else if (id == CMD_UNKNOWN) {
+         log(LERROR, "unmatched command %s found in publish switch\n", cmd);
+      }
+      else {
+         log(LINFO, "Skipping update no permissions\n");
+      }
+   }
+   else {
+      log(LINFO, "Skipping update. publish: 0x%X\n", (uint32_t)publish);
+   }
+   return false;
+}
+
+/**
+ * throttle applies the client and project token buckets.  When excess
+ * updates are delayed they are still posted, but the buckets go into debt
+ * and the client isn't read again until they have refilled, which pushes
+ * back on the sender through TCP flow control.
+ */
+bool Client::throttle(uint32_t n, size_t len) {
+   RateLimits l = cm->getRateLimits();
+   bool client_limited = l.client_msgs != 0 || l.client_bytes != 0;
+   bool project_limited = l.project_msgs != 0 || l.project_bytes != 0;
+   if (!client_limited && !project_limited) {
+      return true;
+   }
+   ClientSet *cs = project_limited ? cm->projects.get(pid) : NULL;
+   if (l.reject) {
+      bool admitted = !client_limited || limiter.take(l.client_msgs, l.client_bytes, l.burst_ms, n, len, false) == 0;
+      if (admitted && cs != NULL && cs->limiter.take(l.project_msgs, l.project_bytes, l.burst_ms, n, len, false) != 0) {
+         //the project is full, don't charge the client for updates it never sent
+         if (client_limited) {
+            limiter.refund(l.client_msgs, l.client_bytes, n, len);
+         }
+         admitted = false;
+      }
+      if (!admitted) {
+         throttle_rejects += n;
+         if (!rejecting) {
+            //one error per run of rejected updates is enough
+            clog(LINFO, "rate limit exceeded, rejecting updates\n");
+            send_error("Rate limit exceeded, updates are being discarded");
+            rejecting = true;
+         }
+         return false;
+      }
+      rejecting = false;
+      return true;
+   }
+   uint64_t wait = 0;
+   if (client_limited) {
+      wait = limiter.take(l.client_msgs, l.client_bytes, l.burst_ms, n, len, true);
+   }
+   if (cs != NULL) {
+      uint64_t pwait = cs->limiter.take(l.project_msgs, l.project_bytes, l.burst_ms, n, len, true);
+      if (pwait > wait) {
+         wait = pwait;
+      }
+   }
+   if (wait != 0) {
+      resume_us = monotonic_us() + wait;
+      throttle_delays++;
+      throttle_delay_us += wait;
+   }
+   return true;
+}
+
+bool Client::handleMessage(json_object *obj, size_t len) {
+   bool done = false;
+   const char *cmd = string_from_json(obj, "type");
+   if (cmd == NULL) {
+      log(LINFO, "Skipping message with no type\n");
+      json_object_put(obj);
+      return false;
+   }
+   log(LINFO, "processing %s\n", cmd);
+   //count and log before the message is handed off, obj (and cmd) may be released below
+   log(LDEBUG, "received cmd: %s\n", cmd);
+   CommandId id = command_id(cmd);
+   tx_stats[id]++;
+   ClientMsgHandler h = handlers[id];
+   if (h != NULL) {
+      done = (*h)(obj, this);
+      json_object_put(obj);
+   }
+   //no handler found so this is not a control message, post it
+   else if (acceptUpdate(id, cmd) && throttle(1, len)) {
+      cm->post(this, id, obj);
+   }
+   else {
+      json_object_put(obj);
+   }
+   return done;
+}
+
 void Client::init_handlers() {
-   handlers = new map<string,ClientMsgHandler>;
-   (*handlers)[MSG_PROJECT_NEW_REQUEST] = msg_project_new_request;
-   (*handlers)[MSG_PROJECT_JOIN_REQUEST] = msg_project_join_request;
-   (*handlers)[MSG_PROJECT_REJOIN_REQUEST] = msg_project_rejoin_request;
-   (*handlers)[MSG_PROJECT_SNAPSHOT_REQUEST] = msg_project_snapshot_request;
-   (*handlers)[MSG_PROJECT_FORK_REQUEST] = msg_project_fork_request;
-   (*handlers)[MSG_PROJECT_SNAPFORK_REQUEST] = msg_project_snapfork_request;
-   (*handlers)[MSG_PROJECT_LEAVE] = msg_project_leave;
-   (*handlers)[MSG_PROJECT_JOIN_REPLY] = msg_project_join_reply;
-   (*handlers)[MSG_AUTH_REQUEST] = msg_auth_request;
-   (*handlers)[MSG_PROJECT_LIST] = msg_project_list;
-   (*handlers)[MSG_SEND_UPDATES] = msg_send_updates;
-   (*handlers)[MSG_SET_REQ_PERMS] = msg_set_req_perms;
-   (*handlers)[MSG_GET_REQ_PERMS] = msg_get_req_perms;
-   (*handlers)[MSG_GET_PROJ_PERMS] = msg_get_proj_perms;
-   (*handlers)[MSG_SET_PROJ_PERMS] = msg_set_proj_perms;
-
-   perms_map[COMMAND_UNDEFINE] = MASK_UNDEFINE;
-   perms_map[COMMAND_MAKE_CODE] = MASK_MAKE_CODE;
-   perms_map[COMMAND_MAKE_DATA] = MASK_MAKE_DATA;
-
-   perms_map[COMMAND_SEGM_ADDED] = MASK_SEGMENTS;
-   perms_map[COMMAND_SEGM_DELETED] = MASK_SEGMENTS;
-   perms_map[COMMAND_SEGM_START_CHANGED] = MASK_SEGMENTS;
-   perms_map[COMMAND_SEGM_END_CHANGED] = MASK_SEGMENTS;
-   perms_map[COMMAND_SEGM_MOVED] = MASK_SEGMENTS;
-   perms_map[COMMAND_MOVE_SEGM] = MASK_SEGMENTS;
-
-   perms_map[COMMAND_SET_STACK_VAR_NAME] = MASK_RENAME;
-   perms_map[COMMAND_RENAMED] = MASK_RENAME;
-
-   perms_map[COMMAND_FUNC_TAIL_APPENDED] = MASK_FUNCTIONS;
-   perms_map[COMMAND_FUNC_TAIL_REMOVED] = MASK_FUNCTIONS;
-   perms_map[COMMAND_TAIL_OWNER_CHANGED] = MASK_FUNCTIONS;
-   perms_map[COMMAND_FUNC_NORET_CHANGED] = MASK_FUNCTIONS;
-   perms_map[COMMAND_ADD_FUNC] = MASK_FUNCTIONS;
-   perms_map[COMMAND_DEL_FUNC] = MASK_FUNCTIONS;
-   perms_map[COMMAND_SET_FUNC_START] = MASK_FUNCTIONS;
-   perms_map[COMMAND_SET_FUNC_END] = MASK_FUNCTIONS;
-
-   perms_map[COMMAND_BYTE_PATCHED] = MASK_BYTE_PATCH;
-
-   perms_map[COMMAND_AREA_CMT_CHANGED] = MASK_COMMENTS;
-   perms_map[COMMAND_CMT_CHANGED] = MASK_COMMENTS;
-
-   perms_map[COMMAND_TI_CHANGED] = MASK_OPTYPES;
-   perms_map[COMMAND_OP_TI_CHANGED] = MASK_OPTYPES;
-   perms_map[COMMAND_OP_TYPE_CHANGED] = MASK_OPTYPES;
-
-   perms_map[COMMAND_ENUM_CREATED] = MASK_ENUMS;
-   perms_map[COMMAND_ENUM_DELETED] = MASK_ENUMS;
-   perms_map[COMMAND_ENUM_BF_CHANGED] = MASK_ENUMS;
-   perms_map[COMMAND_ENUM_RENAMED] = MASK_ENUMS;
-   perms_map[COMMAND_ENUM_CMT_CHANGED] = MASK_ENUMS;
-   perms_map[COMMAND_ENUM_CONST_CREATED] = MASK_ENUMS;
-   perms_map[COMMAND_ENUM_CONST_DELETED] = MASK_ENUMS;
-
-   perms_map[COMMAND_STRUC_CREATED] = MASK_STRUCTS;
-   perms_map[COMMAND_STRUC_DELETED] = MASK_STRUCTS;
-   perms_map[COMMAND_STRUC_RENAMED] = MASK_STRUCTS;
-   perms_map[COMMAND_STRUC_EXPANDED] = MASK_STRUCTS;
-   perms_map[COMMAND_STRUC_CMT_CHANGED] = MASK_STRUCTS;
-   perms_map[COMMAND_CREATE_STRUC_MEMBER_DATA] = MASK_STRUCTS;
-   perms_map[COMMAND_CREATE_STRUC_MEMBER_STRUCT] = MASK_STRUCTS;
-   perms_map[COMMAND_CREATE_STRUC_MEMBER_REF] = MASK_STRUCTS;
-   perms_map[COMMAND_CREATE_STRUC_MEMBER_STROFF] = MASK_STRUCTS;
-   perms_map[COMMAND_CREATE_STRUC_MEMBER_STR] = MASK_STRUCTS;
-   perms_map[COMMAND_CREATE_STRUC_MEMBER_ENUM] = MASK_STRUCTS;
-   perms_map[COMMAND_STRUC_MEMBER_DELETED] = MASK_STRUCTS;
-   perms_map[COMMAND_SET_STRUCT_MEMBER_NAME] = MASK_STRUCTS;
-   perms_map[COMMAND_STRUC_MEMBER_CHANGED_DATA] = MASK_STRUCTS;
-   perms_map[COMMAND_STRUC_MEMBER_CHANGED_STRUCT] = MASK_STRUCTS;
-   perms_map[COMMAND_STRUC_MEMBER_CHANGED_STR] = MASK_STRUCTS;
-   perms_map[COMMAND_STRUC_MEMBER_CHANGED_OFFSET] = MASK_STRUCTS;
-   perms_map[COMMAND_STRUC_MEMBER_CHANGED_ENUM] = MASK_STRUCTS;
-   perms_map[COMMAND_CREATE_STRUC_MEMBER_OFFSET] = MASK_STRUCTS;
-
-   perms_map[COMMAND_VALIDATE_FLIRT_FUNC] = MASK_FLIRT;
-
-   perms_map[COMMAND_THUNK_CREATED] = MASK_THUNK;
-
-   perms_map[COMMAND_ADD_CREF] = MASK_XREF;
-   perms_map[COMMAND_ADD_DREF] = MASK_XREF;
-   perms_map[COMMAND_DEL_CREF] = MASK_XREF;
-   perms_map[COMMAND_DEL_DREF] = MASK_XREF;
-
-   perms_map[COMMAND_USER_MESSAGE] = MASK_MESSAGE;
+   handlers = new ClientMsgHandler[CMD_COUNT]();
+   handlers[CMD_PROJECT_NEW_REQUEST] = msg_project_new_request;
+   handlers[CMD_PROJECT_JOIN_REQUEST] = msg_project_join_request;
+   handlers[CMD_PROJECT_REJOIN_REQUEST] = msg_project_rejoin_request;
+   handlers[CMD_PROJECT_SNAPSHOT_REQUEST] = msg_project_snapshot_request;
+   handlers[CMD_PROJECT_FORK_REQUEST] = msg_project_fork_request;
+   handlers[CMD_PROJECT_SNAPFORK_REQUEST] = msg_project_snapfork_request;
+   handlers[CMD_PROJECT_LEAVE] = msg_project_leave;
+   handlers[CMD_PROJECT_JOIN_REPLY] = msg_project_join_reply;
+   handlers[CMD_AUTH_REQUEST] = msg_auth_request;
+   handlers[CMD_PROJECT_LIST] = msg_project_list;
+   handlers[CMD_SEND_UPDATES] = msg_send_updates;
+   handlers[CMD_SET_REQ_PERMS] = msg_set_req_perms;
+   handlers[CMD_GET_REQ_PERMS] = msg_get_req_perms;
+   handlers[CMD_GET_PROJ_PERMS] = msg_get_proj_perms;
+   handlers[CMD_SET_PROJ_PERMS] = msg_set_proj_perms;
+   handlers[CMD_UPDATE_BATCH] = msg_update_batch;
 }
 
 bool Client::msg_project_new_request(json_object *obj, Client *c) {
@@ -599,6 +799,7 @@ bool Client::msg_project_list(json_object *obj, Client *c) {
    //                    logln("", LDEBUG);
    //                    logln("pP " + (*pi)->pub + " pS " + (*pi)->sub, LINFO4);
    //                    logln("uP " + c->upublish + " uS " + c->usubscribe, LINFO4);
+         delete *pi;
       }
       delete plist;
    }
@@ -654,6 +855,7 @@ bool Client::msg_set_req_perms(json_object *obj, Client *c) {
          c->clog(LINFO, "not honoring SET_REQ_PERMS for owner\n");
          c->send_error("You are the owner.  FULL permissions granted.");
       }
+      delete pi;
    }
    else {
       //something is really wrong
@@ -684,6 +886,7 @@ bool Client::msg_get_req_perms(json_object *obj, Client *c) {
       json_object_object_add_ex(resp, "perms", perms, JSON_NEW_CONST_KEY);
 
       c->send_data(MSG_GET_REQ_PERMS_REPLY, resp);
+      delete pi;
    }
    else {
       //something is really wrong
@@ -717,6 +920,7 @@ bool Client::msg_get_proj_perms(json_object *obj, Client *c) {
       else {
          c->send_error("You are not the owner!");
       }
+      delete pi;
    }
    else {
       //something is relly wrong
@@ -739,9 +943,66 @@ bool Client::msg_set_proj_perms(json_object *obj, Client *c) {
       else {
          c->send_error("You are not the owner!");
       }
+      delete pi;
    }
    else {
       //something is really wrong
    }
    return false;
 }
+
+/**
+ * msg_update_batch accepts several updates in one message.  Each update is
+ * checked exactly as if it had arrived on its own, and whatever passes is
+ * archived and sent on together.
+ */
+bool Client::msg_update_batch(json_object *obj, Client *c) {
+   if ((c->features & FEATURE_UPDATE_BATCH) == 0) {
+      c->send_error("update_batch was not negotiated");
+      return false;
+   }
+   if (c->pid == INVALID_PID) {
+      c->send_error("Not allowed to send project updates before joining a project\n");
+      return false;
+   }
+   json_object *updates;
+   if (!json_object_object_get_ex(obj, "updates", &updates) || !json_object_is_type(updates, json_type_array)) {
+      c->clog(LERROR, "update_batch without updates\n");
+      return false;
+   }
+   size_t num_updates = json_object_array_length(updates);
+   vector<RawUpdate> batch;
+   batch.reserve(num_updates);
+   for (size_t i = 0; i < num_updates; i++) {
+      json_object *update = json_object_array_get_idx(updates, i);
+      const char *cmd = string_from_json(update, "type");
+      if (cmd == NULL) {
+         c->clog(LINFO, "Skipping batched update with no type\n");
+         continue;
+      }
+      CommandId id = command_id(cmd);
+      c->tx_stats[id]++;
+      if (handlers[id] != NULL) {
+         c->clog(LERROR, "control message %s not allowed in update_batch\n", cmd);
+         continue;
+      }
+      if (!c->acceptUpdate(id, cmd)) {
+         continue;
+      }
+      //the server assigns its own updateids
+      json_object_object_del(update, "updateid");
+      size_t len;
+      const char *json = json_object_to_json_string_length(update, JSON_C_TO_STRING_PLAIN, &len);
+      batch.push_back(RawUpdate());
+      batch.back().cmd = id;
+      batch.back().json.assign(json, len);
+   }
+   size_t bytes = 0;
+   for (vector<RawUpdate>::iterator i = batch.begin(); i != batch.end(); i++) {
+      bytes += (*i).json.length();
+   }
+   if (batch.size() > 0 && c->throttle(batch.size(), bytes)) {
+      c->cm->relayBatch(c, batch);
+   }
+   return false;
+}
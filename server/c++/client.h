@@ -22,11 +22,15 @@
 #define __CLIENT_H
 
 #include <map>
+#include <deque>
 #include <string>
 #include <stdint.h>
+#include <semaphore.h>
 #include <json-c/json.h>
 #include "io.h"
 #include "utils.h"
+#include "commands.h"
+#include "ratelimit.h"
 
 using namespace std;
 
@@ -50,9 +54,88 @@ class Client {
 public:
 
    Client(ConnectionManager *mgr, NetworkIO *s, uint32_t uid);
+   ~Client();
 
    void run();
 
+   /**
+    * handleMessage processes a single message received from the plugin
+    * @param obj the received message, handleMessage takes ownership
+    * @param len the size of the message as received, charged against rate limits
+    * @return true if the client connection should be closed
+    */
+   bool handleMessage(json_object *obj, size_t len);
+
+   /**
+    * handleFrame processes a single message as received from the plugin,
+    * updates are relayed without being parsed whenever possible
+    * @param frame the received message
+    * @param len the length of frame
+    * @return true if the client connection should be closed
+    */
+   bool handleFrame(const char *frame, size_t len);
+
+   /**
+    * onReadable is invoked by the Reactor when the client socket becomes readable
+    * it processes every complete message that has arrived so far, stopping
+    * early if the client exceeds its rate limit
+    * @return false if the client connection should be closed
+    */
+   bool onReadable();
+
+   /**
+    * resume is invoked by the Reactor once a throttled client may continue.
+    * It processes the messages already buffered without reading the socket
+    * @return false if the client connection should be closed
+    */
+   bool resume();
+
+   /**
+    * onWritable is invoked by the Reactor instead of onReadable while the
+    * client is catching up, once its socket will take more data
+    * @return false if the client connection should be closed
+    */
+   bool onWritable();
+
+   /**
+    * catchUp starts sending the client every update after lastUpdate.  The
+    * updates are read a page at a time and sent only as fast as the client
+    * takes them.  Nothing more is read from the client until it is done
+    * @param lastUpdate the last update the client received
+    */
+   void catchUp(uint64_t lastUpdate);
+
+   /**
+    * catchingUp reports whether a catch-up is still being sent
+    */
+   bool catchingUp() {
+      return catching_up;
+   }
+
+   /**
+    * throttledUntil reports when a client that exceeded its rate limit may
+    * be read from again
+    * @return a time from monotonic_us, or 0 if the client is not throttled
+    */
+   uint64_t throttledUntil() {
+      return resume_us;
+   }
+
+   /**
+    * checkIdle is invoked periodically by the Reactor to ping idle clients
+    * @param now the current time
+    * @return false if the client failed to answer a ping
+    */
+   bool checkIdle(time_t now);
+
+   /**
+    * getConnection inspector to get the network connection for this client
+    * @return the client's connection
+    */
+   NetworkIO *getConnection() {
+      return conn;
+   }
+
    /**
     * logs a message to the configured log file (in the ConnectionManager)
     * @param verbosity apply a verbosity level to the msg
@@ -135,10 +218,47 @@ public:
 
    /**
     * post is the function that actually posts updates to clients (if subscribing)
-    * @param msg message being sent
+    * @param cmd message being sent
     * @param obj message with associated parameters expressed as a json object
     */
-   void post(const char *msg, json_object *obj);
+   void post(CommandId cmd, json_object *obj);
+
+   /**
+    * post a pre-serialized update that is shared with other subscribers
+    * @param cmd the command contained in buf
+    * @param buf the serialized update, referenced rather than copied
+    */
+   void post(CommandId cmd, SharedBuffer *buf);
+
+   /**
+    * noteAck records that updates posted by this client have been assigned
+    * updateids.  The acknowledgement is held until flushAcks so that a
+    * burst of updates is acknowledged with a single message.
+    * @param first the first updateid assigned
+    * @param last the last updateid assigned, the same as first for a single update
+    */
+   void noteAck(uint64_t first, uint64_t last);
+
+   /**
+    * flushAcks sends one acknowledgement covering every ack held by noteAck
+    * @return the number of acks that were covered
+    */
+   uint32_t flushAcks();
+
+   /**
+    * admit is for callers that write several updates to the connection at
+    * once.  It checks that this client subscribes to cmd and, if so, counts
+    * the update as received.
+    * @param cmd the command about to be sent
+    * @return true if the update should be sent
+    */
+   bool admit(CommandId cmd) {
+      if (checkPermissions(cmd, subscribe)) {
+         rx_stats[cmd]++;
+         return true;
+      }
+      return false;
+   }
 
    /**
     * similar to post, but does not check subscription status, and takes command as a arg
@@ -277,6 +397,14 @@ public:
    void setSub(uint64_t s) {
       subscribe = s;
    }
+
+   /**
+    * setFeatures records the optional protocol features agreed during authentication
+    * @param f the FEATURE_ bits confirmed in the auth_reply
+    */
+   void setFeatures(uint32_t f) {
+      features = f;
+   }
    /**
     * getPub inspector to get the effective publish status of the client
     * @return the publish status
@@ -307,14 +435,48 @@ public:
 private:
    /**
     * checkPermissions checks to see if the current client has permissions to perform an operation
-    * @param command the command to check permissions on
+    * @param cmd the command to check permissions on
     * @param permType the permission types to check (publish/subscribe)
     */
    /* These are grouped into 'collabREate' permissions, just so there are less permissions to manage
     * for example all the segment operations (add, del, start/end change, etc) are grouped into
     * 'segment' permissions.
     */
-   bool checkPermissions(const char *command, uint64_t permType);
+   bool checkPermissions(CommandId cmd, uint64_t permType) {
+      return (permType & command_mask(cmd)) != 0;
+   }
+
+   /**
+    * acceptUpdate checks that this client has joined a project and may publish cmd
+    * @param id the command being published
+    * @param cmd the name of the command, for logging
+    * @return true if the update should be posted
+    */
+   bool acceptUpdate(CommandId id, const char *cmd);
+
+   /**
+    * throttle charges updates against the client and project rate limits.
+    * Excess updates are either rejected or accepted with the client put on
+    * hold until it is back within its limits (see throttledUntil)
+    * @param n the number of updates
+    * @param len the size of the updates in bytes
+    * @return true if the updates should be posted
+    */
+   bool throttle(uint32_t n, size_t len);
+
+   /**
+    * drain handles every complete message in the receive buffer
+    * @return false if the client connection should be closed
+    */
+   bool drain();
+
+   /**
+    * continueCatchUp sends the catch-up until it is finished or the
+    * client's outbound queue is backlogged
+    * @return false if the client can no longer be written to
+    */
+   bool continueCatchUp();
+
    static void init_handlers();
 
    NetworkIO *conn;
@@ -337,12 +499,38 @@ private:
    string gpid;  //project id associated with this connection
    uint8_t challenge[CHALLENGE_SIZE];
 
-   ConnectionManager *cm;
+   uint32_t features;  //FEATURE_ bits agreed with the plugin
 
-   map<string,int> tx_stats;
-   map<string,int> rx_stats;
+   //acks held by noteAck, guarded by ackLock
+   sem_t ackLock;
+   uint64_t ack_first;
+   uint64_t ack_last;
+   uint32_t ack_count;
+
+   ConnectionManager *cm;
 
-   static map<string,ClientMsgHandler> *handlers;
+   //rate limiting state, only touched by the thread reading this client
+   RateLimiter limiter;
+   uint64_t resume_us;       //when a delayed client may be read again, 0 if not delayed
+   bool rejecting;           //an error has been sent for the current run of rejected updates
+   bool closing;             //the peer has closed, finish what is buffered then drop it
+   uint32_t throttle_delays;
+   uint64_t throttle_delay_us;
+   uint32_t throttle_rejects;
+
+   //catch-up state, only touched by the thread reading this client
+   bool catching_up;
+   bool catchup_more;         //readUpdates may have more after catchup_after
+   uint64_t catchup_after;    //the last updateid read so far
+   deque<string> catchup;     //pieces read but not yet sent
+   time_t catchup_progress;   //when the catch-up last sent anything
+
+   //per command counters, indexed by CommandId
+   uint32_t tx_stats[CMD_COUNT];
+   uint32_t rx_stats[CMD_COUNT];
+
+   //indexed by CommandId, NULL for commands that are posted rather than handled
+   static ClientMsgHandler *handlers;
 
    static bool msg_project_new_request(json_object *obj, Client *c);
    static bool msg_project_join_request(json_object *obj, Client *c);
@@ -359,6 +547,7 @@ private:
    static bool msg_get_req_perms(json_object *obj, Client *c);
    static bool msg_get_proj_perms(json_object *obj, Client *c);
    static bool msg_set_proj_perms(json_object *obj, Client *c);
+   static bool msg_update_batch(json_object *obj, Client *c);
 
 };
 
@@ -18,52 +18,77 @@
    Place, Suite 330, Boston, MA 02111-1307 USA
  */
 
+#include <algorithm>
+
 #include "client.h"
 #include "clientset.h"
 
 ClientSet::ClientSet() {
-   pthread_mutexattr_t attr;
-   pthread_mutexattr_init(&attr);
-   pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-   pthread_mutex_init(&mutex, &attr);
-   pthread_mutexattr_destroy(&attr);
+   clients = new vector<Client*>;
+   pthread_mutex_init(&mutex, NULL);
 }
 
 ClientSet::~ClientSet() {
+   delete clients;
    pthread_mutex_destroy(&mutex);
 }
 
+//swap in a new snapshot, then release the old one once no reader can see it
+//call this only while holding mutex
+void ClientSet::publish(vector<Client*> *next) {
+   vector<Client*> *old = clients;
+   __atomic_store_n(&clients, next, __ATOMIC_RELEASE);
+   epoch.synchronize();
+   delete old;
+}
+
 //add a new client
 void ClientSet::add(Client *c) {
    pthread_mutex_lock(&mutex);
-   clients.insert(c);
+   if (find(clients->begin(), clients->end(), c) == clients->end()) {
+      vector<Client*> *next = new vector<Client*>(*clients);
+      next->push_back(c);
+      publish(next);
+   }
    pthread_mutex_unlock(&mutex);
 }
 
 //remove a client
 void ClientSet::remove(Client *c) {
    pthread_mutex_lock(&mutex);
-   clients.erase(c);
+   vector<Client*>::iterator i = find(clients->begin(), clients->end(), c);
+   if (i != clients->end()) {
+      vector<Client*> *next = new vector<Client*>(clients->begin(), i);
+      next->insert(next->end(), i + 1, clients->end());
+      publish(next);
+   }
    pthread_mutex_unlock(&mutex);
 }
 
 //iterate over all clients in the set
 void ClientSet::loop(cb func, void *user) {
-   pthread_mutex_lock(&mutex);
-   for (set<Client*>::iterator i = clients.begin(); i != clients.end(); i++) {
+   uint32_t token = epoch.enter();
+   vector<Client*> *snap = __atomic_load_n(&clients, __ATOMIC_ACQUIRE);
+   for (vector<Client*>::iterator i = snap->begin(); i != snap->end(); i++) {
       Client *c = *i;
       if (!(*func)(c, user)) {
          break;
       }
    }
-   pthread_mutex_unlock(&mutex);
+   epoch.leave(token);
 }
 
 //return the size of the client set
 int ClientSet::size() {
-   pthread_mutex_lock(&mutex);
-   int res = clients.size();
-   pthread_mutex_unlock(&mutex);
+   uint32_t token = epoch.enter();
+   int res = __atomic_load_n(&clients, __ATOMIC_ACQUIRE)->size();
+   epoch.leave(token);
    return res;
 }
 
+void ClientSet::members(vector<Client*> &out) {
+   uint32_t token = epoch.enter();
+   vector<Client*> *snap = __atomic_load_n(&clients, __ATOMIC_ACQUIRE);
+   out.insert(out.end(), snap->begin(), snap->end());
+   epoch.leave(token);
+}
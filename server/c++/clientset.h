@@ -30,16 +30,30 @@
 #include <sys/types.h>
 #include <pthread.h>
 
+#include "epoch.h"
+#include "ratelimit.h"
+
 class Client;
 
 using namespace std;
 
 typedef bool (*cb)(Client *c, void *user);
 
+/**
+ * ClientSet holds the clients subscribed to a single project.  The members
+ * are published as an immutable snapshot that add and remove replace
+ * copy-on-write, so loop never takes a lock.  remove does not return until
+ * no loop can still be looking at the removed client, after which the
+ * caller is free to delete it.  A loop callback must therefore never add
+ * or remove clients in the set it is iterating.
+ */
 class ClientSet {
 private:
-   set<Client*> clients;
-   pthread_mutex_t mutex;
+   vector<Client*> *clients;
+   pthread_mutex_t mutex;   //serializes writers only
+   Epoch epoch;
+
+   void publish(vector<Client*> *next);
 
 public:
    ClientSet();
@@ -50,6 +64,12 @@ public:
    void loop(cb func, void *user);
    int size();
 
+   //copy the current members for use outside of a loop
+   void members(vector<Client*> &out);
+
+   //charged by every client publishing to the project
+   RateLimiter limiter;
+
 };
 
 
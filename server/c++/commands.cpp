@@ -0,0 +1,112 @@
+/*
+   collabREate commands.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <string.h>
+
+#include "commands.h"
+
+#define COMMAND_NAME(id, name, mask) name,
+#define COMMAND_MASK(id, name, mask) mask,
+
+const char * const command_names[CMD_COUNT] = {
+   "unknown",
+   COMMAND_TABLE(COMMAND_NAME)
+};
+
+const uint32_t command_masks[CMD_COUNT] = {
+   0,
+   COMMAND_TABLE(COMMAND_MASK)
+};
+
+/*
+ * The perfect hash is built entirely at compile time.  find_seed searches
+ * for an FNV-1a seed under which every known name lands in its own slot of
+ * a CMD_HASH_SLOTS entry table, and the table is then filled in with the
+ * id for each slot.  A lookup costs one hash and one strcmp to reject names
+ * that merely collide with a known one.
+ */
+#define CMD_HASH_BITS 10
+#define CMD_HASH_SLOTS (1 << CMD_HASH_BITS)
+#define CMD_NO_SEED 0xffffffff
+
+static_assert(CMD_COUNT < 256, "command ids must fit in the uint8_t slot table");
+
+static constexpr const char *hash_names[CMD_COUNT] = {
+   "",
+   COMMAND_TABLE(COMMAND_NAME)
+};
+
+static constexpr uint32_t cmd_slot(const char *s, uint32_t seed) {
+   uint32_t h = 2166136261u ^ seed;
+   while (*s) {
+      h ^= (uint8_t)*s++;
+      h *= 16777619u;
+   }
+   return (h ^ (h >> 16)) & (CMD_HASH_SLOTS - 1);
+}
+
+static constexpr bool seed_is_perfect(uint32_t seed) {
+   bool used[CMD_HASH_SLOTS] = {};
+   for (int i = 1; i < CMD_COUNT; i++) {
+      uint32_t s = cmd_slot(hash_names[i], seed);
+      if (used[s]) {
+         return false;
+      }
+      used[s] = true;
+   }
+   return true;
+}
+
+static constexpr uint32_t find_seed() {
+   for (uint32_t seed = 0; seed < 10000; seed++) {
+      if (seed_is_perfect(seed)) {
+         return seed;
+      }
+   }
+   return CMD_NO_SEED;
+}
+
+static constexpr uint32_t cmd_seed = find_seed();
+static_assert(cmd_seed != CMD_NO_SEED, "no perfect hash seed found, increase CMD_HASH_BITS");
+
+struct SlotTable {
+   uint8_t ids[CMD_HASH_SLOTS];
+};
+
+static constexpr SlotTable build_slots() {
+   SlotTable t = {};
+   for (int i = 1; i < CMD_COUNT; i++) {
+      t.ids[cmd_slot(hash_names[i], cmd_seed)] = (uint8_t)i;
+   }
+   return t;
+}
+
+static constexpr SlotTable cmd_slots = build_slots();
+
+CommandId command_id(const char *name) {
+   if (name == NULL) {
+      return CMD_UNKNOWN;
+   }
+   uint8_t id = cmd_slots.ids[cmd_slot(name, cmd_seed)];
+   if (id != CMD_UNKNOWN && strcmp(command_names[id], name) == 0) {
+      return (CommandId)id;
+   }
+   return CMD_UNKNOWN;
+}
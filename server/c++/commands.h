@@ -0,0 +1,159 @@
+/*
+   collabREate commands.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __COMMANDS_H
+#define __COMMANDS_H
+
+#include <stdint.h>
+#include "utils.h"
+
+/*
+ * Every command and control message name the server knows about, along
+ * with the permission mask that governs it.  Control messages have a zero
+ * mask since they are never published or subscribed.  Basic mode update
+ * logs record commands by their position in this table, so new commands
+ * belong at the end.
+ */
+#define COMMAND_TABLE(X) \
+   X(CMD_BYTE_PATCHED,                  COMMAND_BYTE_PATCHED,                MASK_BYTE_PATCH) \
+   X(CMD_CMT_CHANGED,                   COMMAND_CMT_CHANGED,                 MASK_COMMENTS) \
+   X(CMD_TI_CHANGED,                    COMMAND_TI_CHANGED,                  MASK_OPTYPES) \
+   X(CMD_OP_TI_CHANGED,                 COMMAND_OP_TI_CHANGED,               MASK_OPTYPES) \
+   X(CMD_OP_TYPE_CHANGED,               COMMAND_OP_TYPE_CHANGED,             MASK_OPTYPES) \
+   X(CMD_ENUM_CREATED,                  COMMAND_ENUM_CREATED,                MASK_ENUMS) \
+   X(CMD_ENUM_DELETED,                  COMMAND_ENUM_DELETED,                MASK_ENUMS) \
+   X(CMD_ENUM_BF_CHANGED,               COMMAND_ENUM_BF_CHANGED,             MASK_ENUMS) \
+   X(CMD_ENUM_RENAMED,                  COMMAND_ENUM_RENAMED,                MASK_ENUMS) \
+   X(CMD_ENUM_CMT_CHANGED,              COMMAND_ENUM_CMT_CHANGED,            MASK_ENUMS) \
+   X(CMD_ENUM_CONST_CREATED,            COMMAND_ENUM_CONST_CREATED,          MASK_ENUMS) \
+   X(CMD_ENUM_CONST_DELETED,            COMMAND_ENUM_CONST_DELETED,          MASK_ENUMS) \
+   X(CMD_STRUC_CREATED,                 COMMAND_STRUC_CREATED,               MASK_STRUCTS) \
+   X(CMD_STRUC_DELETED,                 COMMAND_STRUC_DELETED,               MASK_STRUCTS) \
+   X(CMD_STRUC_RENAMED,                 COMMAND_STRUC_RENAMED,               MASK_STRUCTS) \
+   X(CMD_STRUC_EXPANDED,                COMMAND_STRUC_EXPANDED,              MASK_STRUCTS) \
+   X(CMD_STRUC_CMT_CHANGED,             COMMAND_STRUC_CMT_CHANGED,           MASK_STRUCTS) \
+   X(CMD_CREATE_STRUC_MEMBER_DATA,      COMMAND_CREATE_STRUC_MEMBER_DATA,    MASK_STRUCTS) \
+   X(CMD_CREATE_STRUC_MEMBER_STRUCT,    COMMAND_CREATE_STRUC_MEMBER_STRUCT,  MASK_STRUCTS) \
+   X(CMD_CREATE_STRUC_MEMBER_REF,       COMMAND_CREATE_STRUC_MEMBER_REF,     MASK_STRUCTS) \
+   X(CMD_CREATE_STRUC_MEMBER_STROFF,    COMMAND_CREATE_STRUC_MEMBER_STROFF,  MASK_STRUCTS) \
+   X(CMD_CREATE_STRUC_MEMBER_STR,       COMMAND_CREATE_STRUC_MEMBER_STR,     MASK_STRUCTS) \
+   X(CMD_CREATE_STRUC_MEMBER_ENUM,      COMMAND_CREATE_STRUC_MEMBER_ENUM,    MASK_STRUCTS) \
+   X(CMD_CREATE_STRUC_MEMBER_OFFSET,    COMMAND_CREATE_STRUC_MEMBER_OFFSET,  MASK_STRUCTS) \
+   X(CMD_STRUC_MEMBER_DELETED,          COMMAND_STRUC_MEMBER_DELETED,        MASK_STRUCTS) \
+   X(CMD_SET_STRUCT_MEMBER_NAME,        COMMAND_SET_STRUCT_MEMBER_NAME,      MASK_STRUCTS) \
+   X(CMD_STRUC_MEMBER_CHANGED_DATA,     COMMAND_STRUC_MEMBER_CHANGED_DATA,   MASK_STRUCTS) \
+   X(CMD_STRUC_MEMBER_CHANGED_STRUCT,   COMMAND_STRUC_MEMBER_CHANGED_STRUCT, MASK_STRUCTS) \
+   X(CMD_STRUC_MEMBER_CHANGED_STR,      COMMAND_STRUC_MEMBER_CHANGED_STR,    MASK_STRUCTS) \
+   X(CMD_STRUC_MEMBER_CHANGED_OFFSET,   COMMAND_STRUC_MEMBER_CHANGED_OFFSET, MASK_STRUCTS) \
+   X(CMD_STRUC_MEMBER_CHANGED_ENUM,     COMMAND_STRUC_MEMBER_CHANGED_ENUM,   MASK_STRUCTS) \
+   X(CMD_SET_STACK_VAR_NAME,            COMMAND_SET_STACK_VAR_NAME,          MASK_RENAME) \
+   X(CMD_RENAMED,                       COMMAND_RENAMED,                     MASK_RENAME) \
+   X(CMD_THUNK_CREATED,                 COMMAND_THUNK_CREATED,               MASK_THUNK) \
+   X(CMD_FUNC_TAIL_APPENDED,            COMMAND_FUNC_TAIL_APPENDED,          MASK_FUNCTIONS) \
+   X(CMD_FUNC_TAIL_REMOVED,             COMMAND_FUNC_TAIL_REMOVED,           MASK_FUNCTIONS) \
+   X(CMD_TAIL_OWNER_CHANGED,            COMMAND_TAIL_OWNER_CHANGED,          MASK_FUNCTIONS) \
+   X(CMD_FUNC_NORET_CHANGED,            COMMAND_FUNC_NORET_CHANGED,          MASK_FUNCTIONS) \
+   X(CMD_ADD_FUNC,                      COMMAND_ADD_FUNC,                    MASK_FUNCTIONS) \
+   X(CMD_DEL_FUNC,                      COMMAND_DEL_FUNC,                    MASK_FUNCTIONS) \
+   X(CMD_SET_FUNC_START,                COMMAND_SET_FUNC_START,              MASK_FUNCTIONS) \
+   X(CMD_SET_FUNC_END,                  COMMAND_SET_FUNC_END,                MASK_FUNCTIONS) \
+   X(CMD_SEGM_ADDED,                    COMMAND_SEGM_ADDED,                  MASK_SEGMENTS) \
+   X(CMD_SEGM_DELETED,                  COMMAND_SEGM_DELETED,                MASK_SEGMENTS) \
+   X(CMD_SEGM_START_CHANGED,            COMMAND_SEGM_START_CHANGED,          MASK_SEGMENTS) \
+   X(CMD_SEGM_END_CHANGED,              COMMAND_SEGM_END_CHANGED,            MASK_SEGMENTS) \
+   X(CMD_SEGM_MOVED,                    COMMAND_SEGM_MOVED,                  MASK_SEGMENTS) \
+   X(CMD_MOVE_SEGM,                     COMMAND_MOVE_SEGM,                   MASK_SEGMENTS) \
+   X(CMD_AREA_CMT_CHANGED,              COMMAND_AREA_CMT_CHANGED,            MASK_COMMENTS) \
+   X(CMD_UNDEFINE,                      COMMAND_UNDEFINE,                    MASK_UNDEFINE) \
+   X(CMD_MAKE_CODE,                     COMMAND_MAKE_CODE,                   MASK_MAKE_CODE) \
+   X(CMD_MAKE_DATA,                     COMMAND_MAKE_DATA,                   MASK_MAKE_DATA) \
+   X(CMD_VALIDATE_FLIRT_FUNC,           COMMAND_VALIDATE_FLIRT_FUNC,         MASK_FLIRT) \
+   X(CMD_ADD_CREF,                      COMMAND_ADD_CREF,                    MASK_XREF) \
+   X(CMD_ADD_DREF,                      COMMAND_ADD_DREF,                    MASK_XREF) \
+   X(CMD_DEL_CREF,                      COMMAND_DEL_CREF,                    MASK_XREF) \
+   X(CMD_DEL_DREF,                      COMMAND_DEL_DREF,                    MASK_XREF) \
+   X(CMD_USER_MESSAGE,                  COMMAND_USER_MESSAGE,                MASK_MESSAGE) \
+   X(CMD_INITIAL_CHALLENGE,             MSG_INITIAL_CHALLENGE,               0) \
+   X(CMD_AUTH_REQUEST,                  MSG_AUTH_REQUEST,                    0) \
+   X(CMD_AUTH_REPLY,                    MSG_AUTH_REPLY,                      0) \
+   X(CMD_PROJECT_LIST,                  MSG_PROJECT_LIST,                    0) \
+   X(CMD_PROJECT_JOIN_REQUEST,          MSG_PROJECT_JOIN_REQUEST,            0) \
+   X(CMD_PROJECT_JOIN_REPLY,            MSG_PROJECT_JOIN_REPLY,              0) \
+   X(CMD_PROJECT_NEW_REQUEST,           MSG_PROJECT_NEW_REQUEST,             0) \
+   X(CMD_SEND_UPDATES,                  MSG_SEND_UPDATES,                    0) \
+   X(CMD_PROJECT_REJOIN_REQUEST,        MSG_PROJECT_REJOIN_REQUEST,          0) \
+   X(CMD_ACK_UPDATEID,                  MSG_ACK_UPDATEID,                    0) \
+   X(CMD_PROJECT_SNAPSHOT_REQUEST,      MSG_PROJECT_SNAPSHOT_REQUEST,        0) \
+   X(CMD_PROJECT_SNAPSHOT_REPLY,        MSG_PROJECT_SNAPSHOT_REPLY,          0) \
+   X(CMD_PROJECT_FORK_REQUEST,          MSG_PROJECT_FORK_REQUEST,            0) \
+   X(CMD_PROJECT_SNAPFORK_REQUEST,      MSG_PROJECT_SNAPFORK_REQUEST,        0) \
+   X(CMD_PROJECT_FORK_FOLLOW,           MSG_PROJECT_FORK_FOLLOW,             0) \
+   X(CMD_PROJECT_LEAVE,                 MSG_PROJECT_LEAVE,                   0) \
+   X(CMD_GET_REQ_PERMS,                 MSG_GET_REQ_PERMS,                   0) \
+   X(CMD_GET_REQ_PERMS_REPLY,           MSG_GET_REQ_PERMS_REPLY,             0) \
+   X(CMD_SET_REQ_PERMS,                 MSG_SET_REQ_PERMS,                   0) \
+   X(CMD_SET_REQ_PERMS_REPLY,           MSG_SET_REQ_PERMS_REPLY,             0) \
+   X(CMD_GET_PROJ_PERMS,                MSG_GET_PROJ_PERMS,                  0) \
+   X(CMD_GET_PROJ_PERMS_REPLY,          MSG_GET_PROJ_PERMS_REPLY,            0) \
+   X(CMD_SET_PROJ_PERMS,                MSG_SET_PROJ_PERMS,                  0) \
+   X(CMD_SET_PROJ_PERMS_REPLY,          MSG_SET_PROJ_PERMS_REPLY,            0) \
+   X(CMD_ERROR,                         MSG_ERROR,                           0) \
+   X(CMD_FATAL,                         MSG_FATAL,                           0) \
+   X(CMD_UPDATE_BATCH,                  MSG_UPDATE_BATCH,                    0) \
+   X(CMD_ACK_UPDATEID_RANGE,            MSG_ACK_UPDATEID_RANGE,              0)
+
+#define COMMAND_ENUM(id, name, mask) id,
+
+/**
+ * CommandId is the dense integer form of a command name.  Names are
+ * resolved once, when a message is parsed, and everything downstream
+ * (handler dispatch, permission checks, stats) indexes by id.
+ * CMD_UNKNOWN covers any name not in COMMAND_TABLE.
+ */
+enum CommandId {
+   CMD_UNKNOWN = 0,
+   COMMAND_TABLE(COMMAND_ENUM)
+   CMD_COUNT
+};
+
+#undef COMMAND_ENUM
+
+extern const char * const command_names[CMD_COUNT];
+extern const uint32_t command_masks[CMD_COUNT];
+
+/**
+ * command_id maps a command name to its id using a perfect hash
+ * @param name the value of a message's "type" field
+ * @return the id of the command, or CMD_UNKNOWN
+ */
+CommandId command_id(const char *name);
+
+inline const char *command_name(CommandId id) {
+   return command_names[id];
+}
+
+/**
+ * command_mask returns the permission bit(s) that control a command
+ */
+inline uint32_t command_mask(CommandId id) {
+   return command_masks[id];
+}
+
+#endif
@@ -0,0 +1,110 @@
+/*
+   collabREate compact.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <string.h>
+
+#include "compact.h"
+
+struct KeySpec {
+   CommandId cmd;
+   Compactor::Namespace ns;
+   const char *fields[3];   //members that identify what is overwritten
+};
+
+/*
+ * The updates that are pure overwrites.  func_noret_changed is absent on
+ * purpose, it toggles rather than sets.  Struct member names are absent
+ * because struct comments refer to members by name.
+ */
+static const KeySpec key_specs[] = {
+   {CMD_CMT_CHANGED,        Compactor::NS_ADDR,  {"addr", "rep", NULL}},
+   {CMD_RENAMED,            Compactor::NS_ADDR,  {"addr", NULL, NULL}},
+   {CMD_TI_CHANGED,         Compactor::NS_ADDR,  {"addr", NULL, NULL}},
+   {CMD_OP_TI_CHANGED,      Compactor::NS_ADDR,  {"addr", "opnum", NULL}},
+   {CMD_OP_TYPE_CHANGED,    Compactor::NS_ADDR,  {"addr", "opnum", NULL}},
+   {CMD_AREA_CMT_CHANGED,   Compactor::NS_ADDR,  {"area", "startea", "rep"}},
+   {CMD_SET_STACK_VAR_NAME, Compactor::NS_ADDR,  {"func_addr", "offset", NULL}},
+   {CMD_STRUC_CMT_CHANGED,  Compactor::NS_STRUC, {"struc_name", "rep", NULL}},
+   {CMD_ENUM_CMT_CHANGED,   Compactor::NS_ENUM,  {"enum_name", "rep", NULL}},
+};
+
+static const KeySpec *spec_for(CommandId cmd) {
+   for (size_t i = 0; i < sizeof(key_specs) / sizeof(key_specs[0]); i++) {
+      if (key_specs[i].cmd == cmd) {
+         return &key_specs[i];
+      }
+   }
+   return NULL;
+}
+
+Compactor::Compactor() {
+   memset(gen, 0, sizeof(gen));
+}
+
+/*
+ * The key is the command, the generation of its namespace, and the value of
+ * each identifying member, NUL separated.
+ */
+bool Compactor::makeKey(CommandId cmd, json_object *obj, string &key) {
+   const KeySpec *spec = spec_for(cmd);
+   if (spec == NULL) {
+      //anything else that touches a namespace invalidates its keys
+      uint32_t mask = command_mask(cmd);
+      if (mask & (MASK_SEGMENTS | MASK_FUNCTIONS)) {
+         gen[NS_ADDR]++;
+      }
+      if (mask & MASK_STRUCTS) {
+         gen[NS_STRUC]++;
+      }
+      if (mask & MASK_ENUMS) {
+         gen[NS_ENUM]++;
+      }
+      return false;
+   }
+   char buf[32];
+   snprintf(buf, sizeof(buf), "%u:%u", (uint32_t)cmd, gen[spec->ns]);
+   key = buf;
+   for (int i = 0; i < 3 && spec->fields[i] != NULL; i++) {
+      json_object *val;
+      const char *str;
+      if (!json_object_object_get_ex(obj, spec->fields[i], &val) || (str = json_object_get_string(val)) == NULL) {
+         //malformed, keep it
+         return false;
+      }
+      key += '\0';
+      key += str;
+   }
+   return true;
+}
+
+uint64_t Compactor::add(uint64_t updateid, CommandId cmd, json_object *obj) {
+   string key;
+   if (!makeKey(cmd, obj, key)) {
+      return 0;
+   }
+   map<string,uint64_t>::iterator i = latest.find(key);
+   if (i == latest.end()) {
+      latest[key] = updateid;
+      return 0;
+   }
+   uint64_t old = i->second;
+   i->second = updateid;
+   return old;
+}
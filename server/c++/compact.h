@@ -0,0 +1,69 @@
+/*
+   collabREate compact.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __COMPACT_H
+#define __COMPACT_H
+
+#include <map>
+#include <string>
+#include <stdint.h>
+#include <json-c/json.h>
+
+#include "commands.h"
+
+using namespace std;
+
+/**
+ * Compactor
+ * Folds a project's update log into a smaller, equivalent one.  Many updates
+ * simply overwrite one piece of database state (the name at an address, the
+ * comment on a struct) and a client replaying the log only needs the last of
+ * those.  Updates are fed in log order and any update that a later one
+ * completely overwrites is reported as superseded.
+ *
+ * Overwrites are only tracked within a namespace (addresses, structs, enums).
+ * Anything else that touches a namespace, such as moving a segment or
+ * renaming a struct, could change what an earlier key refers to, so it
+ * starts a new generation of that namespace and updates from before it are
+ * never superseded by updates after it.
+ */
+class Compactor {
+public:
+   Compactor();
+
+   /**
+    * add feeds the next update in the log
+    * @param updateid the update's id
+    * @param cmd the update's command
+    * @param obj the update itself
+    * @return the updateid of the earlier update this one supersedes, or 0
+    */
+   uint64_t add(uint64_t updateid, CommandId cmd, json_object *obj);
+
+   enum Namespace {NS_ADDR, NS_STRUC, NS_ENUM, NS_COUNT};
+
+private:
+   bool makeKey(CommandId cmd, json_object *obj, string &key);
+
+   map<string,uint64_t> latest;
+   uint32_t gen[NS_COUNT];
+};
+
+#endif
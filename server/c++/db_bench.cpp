@@ -0,0 +1,232 @@
+/*
+   collabREate db_bench.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/*
+ * db_bench measures how quickly updates can be archived in the database
+ * using each of the statement strategies available to the server:
+ *
+ *    single   - one synchronous postUpdate per update, one round trip each
+ *    pipeline - postUpdate executions pipelined in batches (DB_PIPELINE 1)
+ *    multirow - one multi-row insert per batch (DB_PIPELINE 0)
+ *
+ * Rows go to a temporary table shaped like updates, so the benchmark may be
+ * pointed at a live server database without touching its contents.
+ *
+ * usage: db_bench [-c conf] [-n updates] [-b batch]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <json-c/json.h>
+
+#include "utils.h"
+#include "db_pool.h"
+
+using namespace std;
+
+static const char *BENCH_JSON = "{\"type\":\"cmt_changed\",\"addr\":4198400,\"cmt\":\"benchmark comment\",\"rep\":false}";
+
+static void prepare(PGconn *conn) {
+   PGresult *res = PQexec(conn, "create temporary table bench_updates (updateid BIGSERIAL, "
+                          "username TEXT, pid INTEGER, cmd TEXT NOT NULL, json TEXT NOT NULL, "
+                          "created TIMESTAMP DEFAULT CURRENT_TIMESTAMP);");
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      log(LERROR, "bench_updates: %s\n", PQerrorMessage(conn));
+   }
+   PQclear(res);
+   res = PQprepare(conn, "benchUpdate",
+                   "insert into bench_updates (username,pid,cmd,json) values ($1,$2,$3,$4) returning updateid;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      log(LERROR, "benchUpdate: %s\n", PQerrorMessage(conn));
+   }
+   PQclear(res);
+}
+
+static double now_ms() {
+   timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void report(const char *name, size_t done, size_t total, double ms) {
+   if (done != total) {
+      printf("%-9s failed after %u of %u updates\n", name, (uint32_t)done, (uint32_t)total);
+      return;
+   }
+   printf("%-9s %8u updates %10.1f ms %10.0f updates/s\n", name, (uint32_t)total, ms,
+          ms > 0 ? total * 1000.0 / ms : 0.0);
+}
+
+static void truncate(PGconn *conn) {
+   PGresult *res = PQexec(conn, "truncate bench_updates;");
+   PQclear(res);
+}
+
+int main(int argc, char **argv) {
+   json_object *conf = NULL;
+   size_t count = 10000;
+   size_t batch = 256;
+   int opt;
+   while ((opt = getopt(argc, argv, "c:n:b:")) != -1) {
+      switch (opt) {
+         case 'c':
+            conf = parseConf(optarg);
+            if (conf == NULL) {
+               fprintf(stderr, "Failed to parse json config file: %s\n", optarg);
+            }
+            break;
+         case 'n':
+            count = strtoul(optarg, NULL, 0);
+            break;
+         case 'b':
+            batch = strtoul(optarg, NULL, 0);
+            break;
+         default:
+            fprintf(stderr, "usage: %s [-c conf] [-n updates] [-b batch]\n", argv[0]);
+            exit(1);
+      }
+   }
+   if (count < 1 || batch < 1 || batch > 16383) {
+      fprintf(stderr, "updates must be positive and batch between 1 and 16383\n");
+      exit(1);
+   }
+
+   map<string,string> dbkeys;
+   string dbHost = getStringOption(conf, "DB_HOST", "");
+   if (dbHost.length() > 0) {
+      dbkeys["hostaddr"] = dbHost;
+   }
+   string dbName = getStringOption(conf, "DB_NAME", "");
+   if (dbName.length() > 0) {
+      dbkeys["dbname"] = dbName;
+   }
+   string dbUser = getStringOption(conf, "DB_USER", "");
+   if (dbUser.length() > 0) {
+      dbkeys["user"] = dbUser;
+   }
+   string dbPass = getStringOption(conf, "DB_PASS", "");
+   if (dbPass.length() > 0) {
+      dbkeys["password"] = dbPass;
+   }
+   vector<const char*> keywords;
+   vector<const char*> values;
+   for (map<string,string>::iterator i = dbkeys.begin(); i != dbkeys.end(); i++) {
+      keywords.push_back((*i).first.c_str());
+      values.push_back((*i).second.c_str());
+   }
+   keywords.push_back(NULL);
+   values.push_back(NULL);
+
+   DbPool pool(&keywords[0], &values[0], 1, prepare, 0);
+   PGconn *conn = pool.checkout();
+   if (PQstatus(conn) != CONNECTION_OK) {
+      fprintf(stderr, "Unable to connect to the database\n");
+      exit(1);
+   }
+
+   //every execution uses the same parameters, laid out once per batch slot
+   uint32_t pid = htonl(1);
+   vector<const char*> parms;
+   vector<int> plens;
+   vector<int> pformats;
+   for (size_t i = 0; i < batch; i++) {
+      parms.push_back("bench");
+      parms.push_back((char*)&pid);
+      parms.push_back("cmt_changed");
+      parms.push_back(BENCH_JSON);
+      plens.push_back(0);
+      plens.push_back(4);
+      plens.push_back(0);
+      plens.push_back(0);
+      pformats.push_back(0);
+      pformats.push_back(1);
+      pformats.push_back(0);
+      pformats.push_back(0);
+   }
+
+   //one statement per update, as each update was archived before group commit
+   size_t done = 0;
+   double start = now_ms();
+   while (done < count) {
+      PGresult *res = PQexecPrepared(conn, "benchUpdate", 4, &parms[0], &plens[0], &pformats[0], 1);
+      bool ok = PQresultStatus(res) == PGRES_TUPLES_OK;
+      PQclear(res);
+      if (!ok) {
+         break;
+      }
+      done++;
+   }
+   report("single", done, count, now_ms() - start);
+   truncate(conn);
+
+   done = 0;
+   start = now_ms();
+   while (done < count) {
+      size_t n = count - done < batch ? count - done : batch;
+      vector<PGresult*> results;
+      if (!pool.execPipelined(conn, "benchUpdate", n, 4, &parms[0], &plens[0], &pformats[0], 1, results)) {
+         break;
+      }
+      bool ok = true;
+      for (vector<PGresult*>::iterator i = results.begin(); i != results.end(); i++) {
+         ok = ok && PQresultStatus(*i) == PGRES_TUPLES_OK;
+         PQclear(*i);
+      }
+      if (!ok) {
+         break;
+      }
+      done += n;
+   }
+   report("pipeline", done, count, now_ms() - start);
+   truncate(conn);
+
+   done = 0;
+   start = now_ms();
+   while (done < count) {
+      size_t n = count - done < batch ? count - done : batch;
+      string sql = "insert into bench_updates (username,pid,cmd,json) values ";
+      char row[64];
+      for (size_t i = 0; i < n; i++) {
+         snprintf(row, sizeof(row), "%s($%u,$%u,$%u,$%u)", i ? "," : "",
+                  (uint32_t)(i * 4 + 1), (uint32_t)(i * 4 + 2), (uint32_t)(i * 4 + 3), (uint32_t)(i * 4 + 4));
+         sql += row;
+      }
+      sql += " returning updateid;";
+      PGresult *res = PQexecParams(conn, sql.c_str(), (int)(n * 4), NULL, &parms[0], &plens[0], &pformats[0], 1);
+      bool ok = PQresultStatus(res) == PGRES_TUPLES_OK;
+      PQclear(res);
+      if (!ok) {
+         break;
+      }
+      done += n;
+   }
+   report("multirow", done, count, now_ms() - start);
+
+   pool.checkin(conn);
+   return 0;
+}
@@ -26,6 +26,8 @@
 #include <arpa/inet.h>
 #include <sys/time.h>
 #include <time.h>
+#include <errno.h>
+#include <algorithm>
 #include <openssl/md5.h>
 #include <json-c/json.h>
 
@@ -33,9 +35,34 @@
 #include "db_mgr.h"
 #include "proj_info.h"
 #include "clientset.h"
+#include "db_pool.h"
+#include "compact.h"
 
 using namespace std;
 
+//most superseded updateids recorded by a single statement
+#define SUPERSEDED_CHUNK 10000
+
+//postgres allows at most 65535 parameters per statement and each row takes 5
+#define MAX_COMMIT_BATCH 13107
+
+//every update in a project after $1 that a client subscribing to $3 should see
+#define LATEST_UPDATES \
+   /* a fork's history is its own updates plus each ancestor's up to the */ \
+   /* point the lineage branched off */ \
+   "with recursive lineage(pid,cutoff) as (" \
+      "select $2::integer, null::bigint " \
+      "union all " \
+      "select f.parent, least(f.cutoff, l.cutoff) from lineage l join forklist f on f.child = l.pid where f.cutoff is not null) " \
+   "select u.updateid,u.cmd,u.json from lineage l join updates u on u.pid = l.pid " \
+   "where u.updateid > $1 and (l.cutoff is null or u.updateid <= l.cutoff) " \
+   /* only what the client subscribes to, rows archived before masks */ \
+   /* were recorded are left for the client to filter */ \
+   "and (u.mask is null or (u.mask & $3) <> 0) " \
+   /* leaving out anything compaction found to be overwritten */ \
+   "and not exists (select 1 from superseded s where s.pid = $2 and s.updateid = u.updateid) " \
+   "order by u.updateid asc"
+
 uint8_t *HmacMD5(const uint8_t *msg, int mlen, const uint8_t *key, int klen) {
    uint8_t ipad[64];
    uint8_t opad[64];
@@ -66,16 +93,18 @@ uint8_t *HmacMD5(const uint8_t *msg, int mlen, const uint8_t *key, int klen) {
    return res;
 }
 
-void DatabaseConnectionManager::init_queries() {
-   sem_init(&pu_sem, 0, 1);
+/*
+ * init_queries prepares every statement the server uses on a single connection.
+ * The pool calls this for each connection it opens, and again after a reset.
+ */
+void DatabaseConnectionManager::init_queries(PGconn *dbConn) {
    PGresult *res = PQprepare(dbConn, "postUpdate",
-                       "insert into updates (username,pid,cmd,json) values ($1,$2,$3,$4) returning updateid;",
+                       "insert into updates (username,pid,cmd,json,mask) values ($1,$2,$3,$4,$5) returning updateid;",
                        0, NULL);
    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
       log(LSQL, "postUpdate: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
-   sem_init(&ap_sem, 0, 1);
    res = PQprepare(dbConn, "addProject",
                    "insert into projects (hash,gpid,description,owner,pub,sub,protocol) values ($1,$2,$3,$4,$5,$6,$7) returning pid;",
                    0, NULL);
@@ -83,7 +112,6 @@ void DatabaseConnectionManager::init_queries() {
       log(LSQL, "addProject: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
-   sem_init(&aps_sem, 0, 1);
    res = PQprepare(dbConn, "addProjectSnap",
                    "insert into projects (hash,gpid,description,owner,snapupdateid,protocol) values ($1,$2,$3,$4,$5,$6) returning pid;",
                    0, NULL);
@@ -91,15 +119,13 @@ void DatabaseConnectionManager::init_queries() {
       log(LSQL, "addProjectSnap: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
-   sem_init(&apf_sem, 0, 1);
    res = PQprepare(dbConn, "addProjectFork",
-                   "insert into forklist (child,parent) values ($1,$2) returning fid;",
+                   "insert into forklist (child,parent,cutoff) values ($1,$2,$3) returning fid;",
                    0, NULL);
    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
       log(LSQL, "addProjectFork: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
-   sem_init(&fpbh_sem, 0, 1);
    res = PQprepare(dbConn, "findProjectsByHash",
                    "select p.pid,p.hash,p.gpid,p.description,f.parent,p.snapupdateid,q.description,p.pub,p.sub,p.owner,p.protocol from projects p left join (forklist f left join projects q on f.parent=q.pid) on p.pid = f.child where p.hash = $1 order by p.pid asc;",
                    0, NULL);
@@ -107,7 +133,6 @@ void DatabaseConnectionManager::init_queries() {
       log(LSQL, "findProjectsByHash: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
-   sem_init(&fp_sem, 0, 1);
    res = PQprepare(dbConn, "findProjects",
                    "select p.pid,p.hash,p.gpid,p.description,f.parent,p.snapupdateid,q.description,p.pub,p.sub,p.owner,p.protocol from projects p left join (forklist f left join projects q on f.parent=q.pid) on p.pid = f.child order by p.pid asc;",
                    0, NULL);
@@ -115,7 +140,6 @@ void DatabaseConnectionManager::init_queries() {
       log(LSQL, "findProjects: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
-   sem_init(&fpbp_sem, 0, 1);
    res = PQprepare(dbConn, "findProjectByPid",
                    "select p.pid,p.hash,p.gpid,p.snapupdateid,p.description,f.parent,q.description,p.pub,p.sub,p.owner,p.protocol from projects p left join (forklist f left join projects q on f.parent=q.pid) on p.pid=f.child where p.pid = $1 order by p.pid asc;",
                    0, NULL);
@@ -123,7 +147,6 @@ void DatabaseConnectionManager::init_queries() {
       log(LSQL, "findProjectByPid: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
-   sem_init(&fpbg_sem, 0, 1);
    res = PQprepare(dbConn, "findProjectByGpid",
                    "select pid,hash,gpid,protocol from projects where gpid = $1 order by pid asc;",
                    0, NULL);
@@ -131,7 +154,6 @@ void DatabaseConnectionManager::init_queries() {
       log(LSQL, "findProjectByGpid: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
-   sem_init(&gui_sem, 0, 1);
    res = PQprepare(dbConn, "getUserInfo",
                    "select userid,pwhash,pub,sub from users where username = $1 order by userid asc;",
                    0, NULL);
@@ -139,24 +161,40 @@ void DatabaseConnectionManager::init_queries() {
       log(LSQL, "getUserInfo: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
-   sem_init(&glu_sem, 0, 1);
-   res = PQprepare(dbConn, "getLatestUpdates",
-                   "select updateid,cmd,json from updates where updateid > $1 and pid = $2 order by updateid asc;",
-                   0, NULL);
+   res = PQprepare(dbConn, "getLatestUpdates", LATEST_UPDATES ";", 0, NULL);
    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
       log(LSQL, "getLatestUpdates: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
-   sem_init(&cu_sem, 0, 1);
-   res = PQprepare(dbConn, "copyUpdates",
-                   "select copy_updates($1, $2, $3);",
-//                   "begin; create temporary table tmptable (like updates) on commit drop; insert into tmptable select * from updates where pid = $1 and updateid <= $2; update only tmptable set pid=$3; insert into updates (select * from tmptable); commit;",
+   res = PQprepare(dbConn, "getLatestUpdatesPage", LATEST_UPDATES " limit $4;", 0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      log(LSQL, "getLatestUpdatesPage: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+   res = PQprepare(dbConn, "findCompactable",
+                   "select p.pid from projects p left join checkpoints c on c.pid = p.pid "
+                   "where (select count(*) from updates u where u.pid = p.pid and u.updateid > coalesce(c.updateid, 0)) >= $1 "
+                   "order by p.pid asc;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      log(LSQL, "findCompactable: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+   res = PQprepare(dbConn, "addSuperseded",
+                   "insert into superseded (pid,updateid) select $1, unnest($2::bigint[]) on conflict do nothing;",
                    0, NULL);
    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-      log(LSQL, "copyUpdates: %s\n", PQerrorMessage(dbConn));
+      log(LSQL, "addSuperseded: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+   res = PQprepare(dbConn, "setCheckpoint",
+                   "insert into checkpoints (pid,updateid) values ($1,$2) "
+                   "on conflict (pid) do update set updateid = excluded.updateid, compacted = current_timestamp;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      log(LSQL, "setCheckpoint: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
-   sem_init(&ppu_sem, 0, 1);
    res = PQprepare(dbConn, "projectPermsUpdate",
                    "update projects set pub=$1,sub=$2 where pid=$3",
                    0, NULL);
@@ -170,6 +208,11 @@ DatabaseConnectionManager::DatabaseConnectionManager(json_object *conf) : Connec
 //   if (dbConn) return;
    map<string,string> dbkeys;
    sem_init(&map_sem, 0, 1);
+   meta_ttl = getIntOption(conf, "META_CACHE_TTL", 30);
+   project_hits = project_misses = 0;
+   gpid_hits = gpid_misses = 0;
+   user_hits = user_misses = 0;
+   invalidations = 0;
 
    string dbHost = getStringOption(conf, "DB_HOST", "");
    if (dbHost.length() > 0) {
@@ -198,53 +241,66 @@ DatabaseConnectionManager::DatabaseConnectionManager(json_object *conf) : Connec
       log(LDEBUG, "%s:%s\n", (*i).first.c_str(), (*i).second.c_str());
    }
    keywords[idx] = values[idx] = NULL;
-   dbConn = PQconnectdbParams(keywords, values, 0);
+   pool = new DbPool(keywords, values, getIntOption(conf, "DB_POOL_SIZE", 4), init_queries,
+                     getIntOption(conf, "DB_POOL_VALIDATE", 30));
 //   memset(dbPass, 0, strlen(dbPass));
 
-   /* Check to see that the backend connection was successfully made */
-   if (PQstatus(dbConn) != CONNECTION_OK) {
-      log(LSQL, "Connection to database failed: %s\n", PQerrorMessage(dbConn));
-      PQfinish(dbConn);
-   }
-   else {
-      init_queries();
-   }
    delete [] keywords;
    delete [] values;
+
+   done = false;
+   commit_window_ms = getIntOption(conf, "DB_COMMIT_WINDOW_MS", 2);
+   int limit = getIntOption(conf, "DB_COMMIT_BATCH", 256);
+   if (limit < 1) {
+      limit = 1;
+   }
+   else if (limit > MAX_COMMIT_BATCH) {
+      limit = MAX_COMMIT_BATCH;
+   }
+   commit_batch = limit;
+   pipeline = getIntOption(conf, "DB_PIPELINE", 1) == 1;
+   batches = batched_rows = failed_batches = max_batch = 0;
+   memset(batch_hist, 0, sizeof(batch_hist));
+   sem_init(&pending_lock, 0, 1);
+   sem_init(&pending_count, 0, 0);
+   pthread_create(&committer, NULL, commitThread, this);
+
+   compact_interval = getIntOption(conf, "COMPACT_INTERVAL", 3600);
+   compact_min = getIntOption(conf, "COMPACT_MIN_UPDATES", 1000);
+   compact_runs = compacted_projects = superseded_updates = 0;
+   sem_init(&compact_wake, 0, 0);
+   sem_init(&compact_lock, 0, 1);
+   pthread_create(&compactor, NULL, compactThread, this);
 }
 
 DatabaseConnectionManager::~DatabaseConnectionManager() {
-   PGresult *res = PQexec(dbConn, "DEALLOCATE postUpdate;");
-   PQclear(res);
-   res = PQexec(dbConn, "DEALLOCATE postUpdate;");
-   PQclear(res);
-   res = PQexec(dbConn, "DEALLOCATE addProject;");
-   PQclear(res);
-   res = PQexec(dbConn, "DEALLOCATE addProjectSnap;");
-   PQclear(res);
-   res = PQexec(dbConn, "DEALLOCATE addProjectFork;");
-   PQclear(res);
-   res = PQexec(dbConn, "DEALLOCATE findProjects;");
-   PQclear(res);
-   res = PQexec(dbConn, "DEALLOCATE findProjectsByHash;");
-   PQclear(res);
-   res = PQexec(dbConn, "DEALLOCATE findProjectByPid;");
-   PQclear(res);
-   res = PQexec(dbConn, "DEALLOCATE findProjectByGpid;");
-   PQclear(res);
-   res = PQexec(dbConn, "DEALLOCATE getUserInfo;");
-   PQclear(res);
-   res = PQexec(dbConn, "DEALLOCATE getLatestUpdates;");
-   PQclear(res);
-   res = PQexec(dbConn, "DEALLOCATE copyUpdates;");
-   PQclear(res);
-   res = PQexec(dbConn, "DEALLOCATE projectPermsUpdate;");
-   PQclear(res);
-   PQfinish(dbConn);
-   dbConn = NULL;
+   done = true;
+   sem_post(&pending_count);
+   pthread_join(committer, NULL);
+   sem_post(&compact_wake);
+   pthread_join(compactor, NULL);
+   sem_destroy(&compact_wake);
+   sem_destroy(&compact_lock);
+   //anything that arrived after the final batch is dropped
+   sem_destroy(&pending_lock);
+   sem_destroy(&pending_count);
+   //prepared statements go away with their sessions
+   delete pool;
 }
 
-uint32_t DatabaseConnectionManager::doAuth(NetworkIO *nio) {
+/**
+ * execPrepared runs a prepared statement on a connection checked out of the
+ * pool for just this one call.  Arguments are as for PQexecPrepared.
+ */
+PGresult *DatabaseConnectionManager::execPrepared(const char *stmt, int nParams, const char * const *paramValues,
+                                                  const int *paramLengths, const int *paramFormats, int resultFormat) {
+   PGconn *conn = pool->checkout();
+   PGresult *res = PQexecPrepared(conn, stmt, nParams, paramValues, paramLengths, paramFormats, resultFormat);
+   pool->checkin(conn);
+   return res;
+}
+
+uint32_t DatabaseConnectionManager::doAuth(NetworkIO *nio, uint32_t *features) {
    uint8_t challenge[CHALLENGE_SIZE];
    fill_random(challenge, CHALLENGE_SIZE);
    json_object *obj = json_object_new_object();
@@ -262,64 +318,204 @@ uint32_t DatabaseConnectionManager::doAuth(NetworkIO *nio) {
    const char *type = string_from_json(obj, "type");
    uint8_t *response = hex_from_json(obj, "hmac", &rlen);
    const char *user = string_from_json(obj, "user");
-   json_object_put(obj);
-   if (strcmp(type, MSG_AUTH_REQUEST) || response == NULL || user == NULL || rlen != MD5_SIZE) {
+   //type and user point into obj, so release it only once we are done with them
+   if (type == NULL || strcmp(type, MSG_AUTH_REQUEST) || response == NULL || user == NULL || rlen != MD5_SIZE) {
+      delete [] response;
+      json_object_put(obj);
       return AUTH_INVALID_PROTO;
    }
 
    uint32_t result = AUTH_FAIL;
-   static const int plens[1] = {0};
-   static const int pformats[1] = {0};
-   //insert into files values(stream_id, fname);
-   const char * const parms[1] = {user};
-
-   sem_wait(&gui_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "getUserInfo",
-                       1, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&gui_sem);
-
-   ExecStatusType qres = PQresultStatus(rset);
-   if (qres != PGRES_TUPLES_OK || PQntuples(rset) != 1) {
-      log(LSQL, "authenticate: %s (%s), %d\n", PQerrorMessage(dbConn), user, qres);
+   CachedUser u;
+   if (!lookupUser(user, u)) {
       result = AUTH_INVALID_USER;
    }
    else {
-//         log(LSQL, "authenticate: good add file for %d\n", htonl(id));
-      //userid,pwhash,pub,sub
-      uint32_t uid = ntohl(*(uint32_t*)PQgetvalue(rset, 0, 0));
-      char *pwhash = PQgetvalue(rset, 0, 1);
       uint32_t hashlen;
-      uint8_t *key = toByteArray(pwhash, &hashlen);
-      int hlen = PQgetlength(rset, 0, 1);
+      uint8_t *key = toByteArray(u.pwhash.c_str(), &hashlen);
+      int hlen = (int)u.pwhash.length();
       uint8_t *hmac = HmacMD5(challenge, CHALLENGE_SIZE, key, hlen / 2);
       delete [] key;
 #ifdef DEBUG
-      log(LDEBUG, "Trying to authenticate uid: %d, pwhash %s, hashlen: %d\n", uid, pwhash, hlen);
-      log(LDEBUG, "   challenge: %s, hmac: %s\n", toHexString(challenge, CHALLENGE_SIZE).c_str(), toHexString(hmac, 16).c_str());
-      log(LDEBUG, "    response: %s, rlen: %d\n", toHexString(response, 16).c_str(), rlen);
+      log(LDEBUG, "Trying to authenticate uid: %d, pwhash %s, hashlen: %d\n", u.uid, u.pwhash.c_str(), hlen);
+      LOG(LDEBUG, "   challenge: %s, hmac: %s\n", toHexString(challenge, CHALLENGE_SIZE).c_str(), toHexString(hmac, 16).c_str());
+      LOG(LDEBUG, "    response: %s, rlen: %d\n", toHexString(response, 16).c_str(), rlen);
 #endif
 
       if (response != NULL && memcmp(response, hmac, 16) == 0) {
-         result = uid;
-         user_map[uid] = UserInfo(user, uid, ntohll(*(uint64_t*)PQgetvalue(rset, 0, 2)), ntohll(*(uint64_t*)PQgetvalue(rset, 0, 3)));
+         result = u.uid;
+         user_map[u.uid] = UserInfo(user, u.uid, u.pub, u.sub);
+         *features = negotiate(obj);
       }
       else {
 #ifdef DEBUG
          log(LDEBUG, "authenticate failure\n");
 #endif
+         //the password may just have changed, so don't trust the cached copy again
+         sem_wait(&map_sem);
+         user_cache.erase(user);
+         sem_post(&map_sem);
          result = AUTH_INVALID_USER;
       }
       delete [] hmac;
    }
    delete [] response;
-   PQclear(rset);
+   json_object_put(obj);
    return result;
 }
 
+/**
+ * lookupUser finds the credentials and permissions of a user, only going to
+ * the database when the cached copy is missing or older than META_CACHE_TTL
+ * @param user the name of the user
+ * @param u filled in with the user's details
+ * @return true if the user exists
+ */
+bool DatabaseConnectionManager::lookupUser(const char *user, CachedUser &u) {
+   time_t now = time(NULL);
+   sem_wait(&map_sem);
+   map<string,CachedUser>::iterator ui = user_cache.find(user);
+   if (ui != user_cache.end() && fresh((*ui).second.loaded, now)) {
+      u = (*ui).second;
+      user_hits++;
+      sem_post(&map_sem);
+      return true;
+   }
+   user_misses++;
+   sem_post(&map_sem);
+
+   static const int plens[1] = {0};
+   static const int pformats[1] = {0};
+   //insert into files values(stream_id, fname);
+   const char * const parms[1] = {user};
+
+   PGresult *rset = execPrepared("getUserInfo",
+                                 1, //int nParams,   size of arrays that follow
+                                 parms, //parms,  //const char * const *paramValues, array of string values
+                                 plens, //const int *paramLengths,
+                                 pformats, //const int *paramFormats,
+                                 1); //int resultFormat); 0 == text, 1 == binary
+
+   ExecStatusType qres = PQresultStatus(rset);
+   bool found = qres == PGRES_TUPLES_OK && PQntuples(rset) == 1;
+   if (!found) {
+      log(LSQL, "authenticate: %s (%s), %d\n", PQresultErrorMessage(rset), user, qres);
+   }
+   else {
+      //userid,pwhash,pub,sub
+      u.uid = ntohl(*(uint32_t*)PQgetvalue(rset, 0, 0));
+      u.pwhash.assign(PQgetvalue(rset, 0, 1), PQgetlength(rset, 0, 1));
+      u.pub = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 2));
+      u.sub = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 3));
+      u.loaded = now;
+      sem_wait(&map_sem);
+      user_cache[user] = u;
+      sem_post(&map_sem);
+   }
+   PQclear(rset);
+   return found;
+}
+
+/**
+ * lookupProject copies out the metadata for a project.  The cached Project in
+ * pid_project_map is used as is unless it has been invalidated or is older
+ * than META_CACHE_TTL, in which case it is refreshed from the database.
+ * The cached copy may be refreshed by another thread at any time, so it is
+ * only ever read or written while holding map_sem.
+ * @param lpid the local pid of the project
+ * @param out receives the project's metadata
+ * @return false if there is no such project
+ */
+bool DatabaseConnectionManager::lookupProject(uint32_t lpid, Project &out) {
+   bool found = false;
+   time_t now = time(NULL);
+   sem_wait(&map_sem);
+   map<uint32_t,Project*>::iterator pi = pid_project_map.find(lpid);
+   if (pi != pid_project_map.end() && fresh((*pi).second->loaded, now)) {
+      out = *(*pi).second;
+      project_hits++;
+      sem_post(&map_sem);
+      return true;
+   }
+   project_misses++;
+   sem_post(&map_sem);
+
+   static const int plens[1] = {4};
+   static const int pformats[1] = {1};
+
+   uint32_t tpid = htonl(lpid);
+   const char * const parms[1] = {(char*)&tpid};
+
+   PGresult *rset = execPrepared("findProjectByPid",
+                                 1, //int nParams,   size of arrays that follow
+                                 parms, //parms,  //const char * const *paramValues, array of string values
+                                 plens, //const int *paramLengths,
+                                 pformats, //const int *paramFormats,
+                                 1); //int resultFormat); 0 == text, 1 == binary
+
+   ExecStatusType qres = PQresultStatus(rset);
+   //expecting a single row returned
+   if (qres != PGRES_TUPLES_OK || PQntuples(rset) != 1) {
+      log(LSQL, "findProjectByPid: %s\n", PQresultErrorMessage(rset));
+   }
+   else {
+      int32_t parent = -1;
+      if (!PQgetisnull(rset, 0, 5)) {
+         parent = ntohl(*(int32_t*)PQgetvalue(rset, 0, 5));
+      }
+      const char *pdesc = "";
+      if (!PQgetisnull(rset, 0, 6)) {
+         pdesc = PQgetvalue(rset, 0, 6);
+      }
+
+      Project *pinfo;
+      sem_wait(&map_sem);
+      pi = pid_project_map.find(lpid);
+      if (pi != pid_project_map.end()) {
+         pinfo = (*pi).second;
+      }
+      else {
+         pinfo = new Project(lpid, "");
+         pid_project_map[lpid] = pinfo;
+      }
+
+      //now make sure all project info is consistent with database, even if Project record already existed
+      pinfo->desc = PQgetvalue(rset, 0, 4);
+      pinfo->gpid = PQgetvalue(rset, 0, 2);
+      pinfo->hash = PQgetvalue(rset, 0, 1);
+      pinfo->parent = parent;
+      pinfo->pdesc = pdesc;
+      pinfo->snapupdateid = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 3));
+      pinfo->pub = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 7));
+      pinfo->sub = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 8));
+      pinfo->owner = PQgetvalue(rset, 0, 9);
+      pinfo->proto = ntohl(*(uint32_t*)PQgetvalue(rset, 0, 10));
+      pinfo->loaded = now;
+      CachedPid cp = {lpid, now};
+      gpid_map[pinfo->gpid] = cp;
+      out = *pinfo;
+      found = true;
+      sem_post(&map_sem);
+   }
+   PQclear(rset);
+   return found;
+}
+
+/**
+ * invalidateProject makes the next lookup of a project go to the database,
+ * called whenever the server changes the project's row
+ * @param lpid the local pid of the project
+ */
+void DatabaseConnectionManager::invalidateProject(uint32_t lpid) {
+   sem_wait(&map_sem);
+   map<uint32_t,Project*>::iterator pi = pid_project_map.find(lpid);
+   if (pi != pid_project_map.end()) {
+      (*pi).second->loaded = 0;
+   }
+   invalidations++;
+   sem_post(&map_sem);
+}
+
 /**
  * importUpdate is very similar to 'post', importUpdate only
  * archives the udpate in the database so that future clients can receive it
@@ -333,181 +529,475 @@ void DatabaseConnectionManager::importUpdate(const char *newowner, int pid, cons
 }
 
 /**
- * post both queues a newly received update to be sent to other clients and (if in DB mode)
+ * relay both queues a newly received update to be sent to other clients and
  * archives the udpate in the database so that future clients can receive it
  * @param src the client that made the update
  * @param cmd the 'command' that was performed (comment, rename, etc)
- * @param data the 'data' portion of the command (the comment text, etc)
-            note that this data array already has 8 bytes (8-15) reserved to receive the updateid
-            when updates are requested in the future
+ * @param json the update as received from the client, it is stored as is
+ * @param len the length of json
  */
-void DatabaseConnectionManager::post(Client *c, const char *cmd, json_object *obj) {
-   uint64_t updateid = 0;
-   //db insert
-   const int plens[4] = {0, 4, 0, 0};
-   static const int pformats[4] = {0, 1, 0, 0};
+void DatabaseConnectionManager::relay(Client *c, CommandId cmd, const char *json, size_t len) {
+   PendingUpdate u;
+   u.c = c;
+   u.pid = c->getPid();
+   u.user = c->getUser();
+   u.batch = false;
+   u.updates.resize(1);
+   u.updates[0].cmd = cmd;
+   u.updates[0].json.assign(json, len);
+   sem_wait(&pending_lock);
+   pending.push_back(u);
+   sem_post(&pending_lock);
+   sem_post(&pending_count);
+}
 
-   int pid = htonl(c->getPid());
+/**
+ * relayBatch queues the updates from an update_batch to be committed in the
+ * same transaction and dispatched as a single packet
+ * @param src the client that made the updates
+ * @param updates the updates in the order they were sent
+ */
+void DatabaseConnectionManager::relayBatch(Client *c, vector<RawUpdate> &updates) {
+   PendingUpdate u;
+   u.c = c;
+   u.pid = c->getPid();
+   u.user = c->getUser();
+   u.batch = true;
+   sem_wait(&pending_lock);
+   pending.push_back(u);
+   pending.back().updates.swap(updates);
+   sem_post(&pending_lock);
+   sem_post(&pending_count);
+}
 
-   size_t jlen;
-   const char *jstr = json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &jlen);
+void *DatabaseConnectionManager::commitThread(void *arg) {
+   ((DatabaseConnectionManager*)arg)->commitLoop();
+   return NULL;
+}
 
-   const char * const parms[4] = {c->getUser().c_str(), (char*)&pid, cmd, jstr};
+/**
+ * commitLoop waits for the first pending update, then keeps collecting for
+ * up to commit_window_ms or until commit_batch updates are waiting, and
+ * archives everything collected with a single insert.  Updates are only
+ * dispatched once the insert has committed, so no client ever sees an
+ * updateid that is not yet in the database.
+ */
+void DatabaseConnectionManager::commitLoop() {
+   vector<PendingUpdate> batch;
+   while (true) {
+      sem_wait(&pending_count);
+      size_t n = 1;
+      if (commit_window_ms > 0 && !done) {
+         timespec deadline;
+         clock_gettime(CLOCK_REALTIME, &deadline);
+         deadline.tv_nsec += (commit_window_ms % 1000) * 1000000L;
+         deadline.tv_sec += commit_window_ms / 1000 + deadline.tv_nsec / 1000000000L;
+         deadline.tv_nsec %= 1000000000L;
+         while (n < commit_batch && sem_timedwait(&pending_count, &deadline) == 0) {
+            n++;
+         }
+      }
+      //take anything else that is already waiting
+      while (n < commit_batch && sem_trywait(&pending_count) == 0) {
+         n++;
+      }
 
-   sem_wait(&pu_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "postUpdate",
-                       4, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&pu_sem);
-   ExecStatusType qres = PQresultStatus(rset);
-   if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
-      log(LSQL, "postUpdate: %s\n", PQerrorMessage(dbConn));
-   }
-   else {
-      //postgres integers are big endian so swap if necessary
-      updateid = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 0));
-//      log(LDEBUG, "Added update: %lld\n", updateid);
-//      log(LDEBUG, "Added update: %lld, cmd: %d, pid: %d, size: %d\n", updateid, cmd, pid, dlen);
-//      logln(LINFO4, "Added update: " + updateid + ", cmd: " + cmd + ", pid: " + pid + ", size: " + data.length);
-      sem_wait(&queueMutex);
-      queue.push_back(new Packet(c, cmd, obj, updateid));   //add a new packet with the binary data to the queue
-      sem_post(&queueMutex);
-      sem_post(&queueSem);
+      sem_wait(&pending_lock);
+      //the wakeup posted at shutdown has no update behind it
+      n = min(n, pending.size());
+      batch.assign(pending.begin(), pending.begin() + n);
+      pending.erase(pending.begin(), pending.begin() + n);
+      sem_post(&pending_lock);
+
+      if (n > 0) {
+         commitBatch(batch);
+      }
+      if (done) {
+         break;
+      }
    }
-   PQclear(rset);
 }
 
 /**
- * sendLatestUpdates sends updates from LastUpdate to current
- * it is expected that the client has already joined a project before calling this function
- * it is expected that the client has already received updates from 0 - lastUpdate
- * this function is typically called when a user is re-joining a project that they had previously worked on
- * @param c the client requesting updates
- * @param lastUpdate the last update the client received
+ * commitBatch archives a batch of updates in a single transaction, then hands
+ * them to the dispatchers in their original order.  Depending on DB_PIPELINE
+ * the batch is sent either as one pipelined postUpdate per update or as one
+ * multi-row insert.
+ * @param batch the updates to archive, in the order they were received
  */
-void DatabaseConnectionManager::sendLatestUpdates(Client *c, uint64_t lastUpdate) {
-   static const int plens[2] = {8, 4};
-   static const int pformats[2] = {1, 1};
-
-   int pid = htonl(c->getPid());
+void DatabaseConnectionManager::commitBatch(vector<PendingUpdate> &batch) {
+   //each update in a client's update_batch is a row of its own
+   size_t n = 0;
+   for (size_t i = 0; i < batch.size(); i++) {
+      n += batch[i].updates.size();
+   }
+   vector<const char*> parms(n * 5);
+   vector<int> plens(n * 5);
+   vector<int> pformats(n * 5);
+   vector<uint32_t> pids(n);
+   vector<uint64_t> masks(n);
+   vector<uint64_t> ids;
+
+   size_t r = 0;
+   for (vector<PendingUpdate>::iterator pi = batch.begin(); pi != batch.end(); pi++) {
+      PendingUpdate &u = *pi;
+      for (vector<RawUpdate>::iterator ri = u.updates.begin(); ri != u.updates.end(); ri++, r++) {
+         pids[r] = htonl(u.pid);
+         //lets catch-up filter on subscriptions before rows leave the database
+         masks[r] = htonll((uint64_t)command_mask((*ri).cmd));
+         parms[r * 5] = u.user.c_str();
+         parms[r * 5 + 1] = (char*)&pids[r];
+         parms[r * 5 + 2] = command_name((*ri).cmd);
+         parms[r * 5 + 3] = (*ri).json.c_str();
+         parms[r * 5 + 4] = (char*)&masks[r];
+         plens[r * 5 + 1] = 4;
+         pformats[r * 5 + 1] = 1;
+         plens[r * 5 + 4] = 8;
+         pformats[r * 5 + 4] = 1;
+      }
+   }
 
-   lastUpdate = htonll(lastUpdate);
-   const char * const parms[2] = {(char*)&lastUpdate, (char*)&pid};
-
-   sem_wait(&glu_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "getLatestUpdates",
-                       2, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&glu_sem);
-   ExecStatusType qres = PQresultStatus(rset);
-   if (qres != PGRES_TUPLES_OK) {
-      log(LSQL, "getLatestUpdates: %s\n", PQerrorMessage(dbConn));
+   if (n == 1) {
+      PGresult *rset = execPrepared("postUpdate", 5, &parms[0], &plens[0], &pformats[0], 1);
+      if (PQresultStatus(rset) == PGRES_TUPLES_OK && PQntuples(rset) == 1) {
+         //postgres integers are big endian so swap if necessary
+         ids.push_back(ntohll(*(uint64_t*)PQgetvalue(rset, 0, 0)));
+      }
+      else {
+         log(LSQL, "postUpdate: %s\n", PQresultErrorMessage(rset));
+      }
+      PQclear(rset);
+   }
+   else if (pipeline || n > MAX_COMMIT_BATCH) {
+      //update_batch can take a commit past the parameter limit of a single insert
+      //results come back in the order the executions were sent
+      vector<PGresult*> results;
+      PGconn *conn = pool->checkout();
+      if (pool->execPipelined(conn, "postUpdate", n, 5, &parms[0], &plens[0], &pformats[0], 1, results)) {
+         for (size_t i = 0; i < n; i++) {
+            PGresult *rset = results[i];
+            if (PQresultStatus(rset) == PGRES_TUPLES_OK && PQntuples(rset) == 1) {
+               ids.push_back(ntohll(*(uint64_t*)PQgetvalue(rset, 0, 0)));
+            }
+            else if (PQresultStatus(rset) != PGRES_PIPELINE_ABORTED) {
+               log(LSQL, "postUpdate: %s\n", PQresultErrorMessage(rset));
+            }
+            PQclear(rset);
+         }
+      }
+      pool->checkin(conn);
    }
    else {
-      int rows = PQntuples(rset);
-      for (int i = 0; i < rows; i++) {
-         //integer values coming from database are big endian so swap if neccessary
-         uint64_t updateid = *(uint64_t*)PQgetvalue(rset, i, 0);
-         updateid = ntohll(updateid);
-         const char *cmd = (const char*)PQgetvalue(rset, i, 1);
-         const char *json = (const char*)PQgetvalue(rset, i, 2);
-         json_object *obj = json_tokener_parse(json);
-
-//         int dlen = PQgetlength(rset, i, 2);
+      string sql = "insert into updates (username,pid,cmd,json,mask) values ";
+      char row[80];
+      for (size_t i = 0; i < n; i++) {
+         snprintf(row, sizeof(row), "%s($%u,$%u,$%u,$%u,$%u)", i ? "," : "",
+                  (uint32_t)(i * 5 + 1), (uint32_t)(i * 5 + 2), (uint32_t)(i * 5 + 3),
+                  (uint32_t)(i * 5 + 4), (uint32_t)(i * 5 + 5));
+         sql += row;
+      }
+      sql += " returning updateid;";
+      PGconn *conn = pool->checkout();
+      PGresult *rset = PQexecParams(conn, sql.c_str(), (int)(n * 5), NULL, &parms[0], &plens[0], &pformats[0], 1);
+      pool->checkin(conn);
+      if (PQresultStatus(rset) == PGRES_TUPLES_OK && (size_t)PQntuples(rset) == n) {
+         for (size_t i = 0; i < n; i++) {
+            ids.push_back(ntohll(*(uint64_t*)PQgetvalue(rset, (int)i, 0)));
+         }
+         //updateid defaults are drawn in row order, but returning makes no
+         //promise about the order it hands them back in
+         sort(ids.begin(), ids.end());
+      }
+      else {
+         log(LSQL, "postUpdate: %s\n", PQresultErrorMessage(rset));
+      }
+      PQclear(rset);
+   }
 
-//         log(LDEBUG, "posting %lld (cmd %d)\n", ntohll(updateid), cmd);
-//         logln(LDEBUG, "posting " + updateid + " (cmd " + cmd + ")");
+   if (ids.size() != n) {
+      //the batch shares a transaction, so none of it was archived
+      log(LSQL, "postUpdate: dropped batch of %u updates\n", (uint32_t)n);
+      failed_batches++;
+      return;
+   }
+   r = 0;
+   for (vector<PendingUpdate>::iterator pi = batch.begin(); pi != batch.end(); pi++) {
+      PendingUpdate &u = *pi;
+      if (!u.batch) {
+         RawUpdate &one = u.updates[0];
+         enqueue(new Packet(u.c, u.pid, one.cmd, one.json.data(), one.json.length(), ids[r++]));
+         continue;
+      }
+      Packet *pkt = new Packet(u.c, u.pid);
+      for (vector<RawUpdate>::iterator ri = u.updates.begin(); ri != u.updates.end(); ri++) {
+         size_t len = (*ri).json.length();
+         pkt->add((*ri).cmd, (*ri).json.data(), &len, ids[r++]);
+      }
+      pkt->seal();
+      enqueue(pkt);
+   }
+   batches++;
+   batched_rows += n;
+   if (n > max_batch) {
+      max_batch = n;
+   }
+   batch_hist[n == 1 ? 0 : n < 8 ? 1 : n < 64 ? 2 : 3]++;
+}
 
-         json_object_object_del(obj, "updateid");  //make sure key doesn't exist from old update
-         append_json_uint64_val(obj, "updateid", updateid);
-         c->post(cmd, obj);
+void *DatabaseConnectionManager::compactThread(void *arg) {
+   DatabaseConnectionManager *dm = (DatabaseConnectionManager*)arg;
+   while (!dm->done) {
+      if (dm->compact_interval > 0) {
+         timespec deadline;
+         clock_gettime(CLOCK_REALTIME, &deadline);
+         deadline.tv_sec += dm->compact_interval;
+         if (sem_timedwait(&dm->compact_wake, &deadline) == 0 || errno != ETIMEDOUT) {
+            //only ever woken to shut down
+            continue;
+         }
+         dm->compact(0);
+      }
+      else {
+         sem_wait(&dm->compact_wake);
       }
    }
-   PQclear(rset);
+   return NULL;
+}
 
+int64_t DatabaseConnectionManager::compact(uint32_t pid) {
+   int64_t total = 0;
+   sem_wait(&compact_lock);
+   if (pid != 0) {
+      total = compactProject(pid);
+   }
+   else {
+      static const int plens[1] = {8};
+      static const int pformats[1] = {1};
+      uint64_t min = htonll(compact_min);
+      const char * const parms[1] = {(char*)&min};
+      PGresult *rset = execPrepared("findCompactable", 1, parms, plens, pformats, 1);
+      if (PQresultStatus(rset) != PGRES_TUPLES_OK) {
+         log(LSQL, "findCompactable: %s\n", PQresultErrorMessage(rset));
+         total = -1;
+      }
+      else {
+         int rows = PQntuples(rset);
+         for (int i = 0; i < rows && !done; i++) {
+            int64_t n = compactProject(ntohl(*(uint32_t*)PQgetvalue(rset, i, 0)));
+            if (n > 0) {
+               total += n;
+            }
+         }
+      }
+      PQclear(rset);
+   }
+   compact_runs++;
+   sem_post(&compact_lock);
+   return total;
 }
 
 /**
- * getProject gets informatio related to a local project
- * @param pid the local pid of a project to get info on
- * @return a  project info object for the provided pid
+ * compactProject replays a project's update log, as a catching up client
+ * would see it, through a Compactor, records everything it finds to be
+ * superseded, and moves the project's checkpoint to the last update seen.
+ * Updates superseded earlier are already left out of the replay, so each
+ * run only has to look at the project's current state plus what is new.
+ * @param pid the project to compact
+ * @return the number of newly superseded updates, or -1 on error
  */
-const Project *DatabaseConnectionManager::getProject(uint32_t pid) {
-   Project *pinfo = NULL;
-
-   static const int plens[1] = {4};
-   static const int pformats[1] = {1};
-
-   pid = htonl(pid);
-   const char * const parms[1] = {(char*)&pid};
-
-   sem_wait(&fpbp_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "findProjectByPid",
-                       1, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&fpbp_sem);
-
-   ExecStatusType qres = PQresultStatus(rset);
-   //expecting a single row returned
-   if (qres != PGRES_TUPLES_OK || PQntuples(rset) != 1) {
-      log(LSQL, "findProjectByPid: %s\n", PQerrorMessage(dbConn));
+int64_t DatabaseConnectionManager::compactProject(uint32_t pid) {
+   static const int plens[3] = {8, 4, 8};
+   static const int pformats[3] = {1, 1, 1};
+   uint64_t zero = 0;
+   uint32_t npid = htonl(pid);
+   //every update, whatever its permission bit
+   uint64_t all = ~(uint64_t)0;
+   const char * const parms[3] = {(char*)&zero, (char*)&npid, (char*)&all};
+
+   PGconn *conn = pool->checkout();
+   if (!PQsendQueryPrepared(conn, "getLatestUpdates", 3, parms, plens, pformats, 1)) {
+      log(LSQL, "getLatestUpdates: %s\n", PQerrorMessage(conn));
+      pool->checkin(conn);
+      return -1;
    }
-   else {
-      uint32_t proto = ntohl(*(uint32_t*)PQgetvalue(rset, 0, 10));
-      if (proto == PROTOCOL_VERSION) {
-         uint32_t lpid = ntohl(*(uint32_t*)PQgetvalue(rset, 0, 0));
-         char *desc = PQgetvalue(rset, 0, 4);
-         int32_t parent = -1;
-         if (!PQgetisnull(rset, 0, 5)) {
-            parent = ntohl(*(int32_t*)PQgetvalue(rset, 0, 5));
-         }
-         uint64_t snapupdateid = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 3));
-         const char *pdesc = "";
-         if (!PQgetisnull(rset, 0, 6)) {
-            pdesc = PQgetvalue(rset, 0, 6);
+   PQsetSingleRowMode(conn);
+
+   Compactor compactor;
+   vector<uint64_t> dropped;
+   uint64_t last = 0;
+   bool ok = true;
+   PGresult *rset;
+   while ((rset = PQgetResult(conn)) != NULL) {
+      ExecStatusType qres = PQresultStatus(rset);
+      if (qres == PGRES_SINGLE_TUPLE) {
+         last = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 0));
+         json_object *obj = json_tokener_parse(PQgetvalue(rset, 0, 2));
+         if (obj != NULL) {
+            uint64_t old = compactor.add(last, command_id(PQgetvalue(rset, 0, 1)), obj);
+            if (old != 0) {
+               dropped.push_back(old);
+            }
+            json_object_put(obj);
          }
+      }
+      else if (qres != PGRES_TUPLES_OK) {
+         log(LSQL, "getLatestUpdates: %s\n", PQresultErrorMessage(rset));
+         ok = false;
+      }
+      PQclear(rset);
+   }
 
-         const char *hash = PQgetvalue(rset, 0, 1);
-         const char *owner = PQgetvalue(rset, 0, 9);
-
-         sem_wait(&map_sem);
-         map<uint32_t,Project*>::iterator pi = pid_project_map.find(lpid);
-         if (pi != pid_project_map.end()) {
-            pinfo = (*pi).second;
+   if (ok && last != 0) {
+      //superseded updates and the checkpoint go in together
+      rset = PQexec(conn, "begin;");
+      ok = PQresultStatus(rset) == PGRES_COMMAND_OK;
+      PQclear(rset);
+      for (size_t i = 0; ok && i < dropped.size(); i += SUPERSEDED_CHUNK) {
+         //updateids go in as a text array literal
+         string ids = "{";
+         char num[32];
+         for (size_t j = i; j < dropped.size() && j < i + SUPERSEDED_CHUNK; j++) {
+            snprintf(num, sizeof(num), "%s%llu", j == i ? "" : ",", (unsigned long long)dropped[j]);
+            ids += num;
          }
-         else {
-            pinfo = new Project(lpid, "");
-            pid_project_map[lpid] = pinfo;
+         ids += "}";
+         static const int slens[2] = {4, 0};
+         static const int sformats[2] = {1, 0};
+         const char * const sparms[2] = {(char*)&npid, ids.c_str()};
+         rset = PQexecPrepared(conn, "addSuperseded", 2, sparms, slens, sformats, 1);
+         if (PQresultStatus(rset) != PGRES_COMMAND_OK) {
+            log(LSQL, "addSuperseded: %s\n", PQresultErrorMessage(rset));
+            ok = false;
          }
-         sem_post(&map_sem);
+         PQclear(rset);
+      }
+      if (ok) {
+         static const int clens[2] = {4, 8};
+         static const int cformats[2] = {1, 1};
+         uint64_t nlast = htonll(last);
+         const char * const cparms[2] = {(char*)&npid, (char*)&nlast};
+         rset = PQexecPrepared(conn, "setCheckpoint", 2, cparms, clens, cformats, 1);
+         if (PQresultStatus(rset) != PGRES_COMMAND_OK) {
+            log(LSQL, "setCheckpoint: %s\n", PQresultErrorMessage(rset));
+            ok = false;
+         }
+         PQclear(rset);
+      }
+      rset = PQexec(conn, ok ? "commit;" : "rollback;");
+      PQclear(rset);
+   }
+   pool->checkin(conn);
 
-         const char *gpid = PQgetvalue(rset, 0, 2);
+   if (!ok) {
+      return -1;
+   }
+   compacted_projects++;
+   superseded_updates += dropped.size();
+   log(LINFO, "Compacted project %u through update %llu, %u updates superseded\n",
+       pid, (unsigned long long)last, (uint32_t)dropped.size());
+   return dropped.size();
+}
 
-         //now make sure all project info is consistent with database, even if Project record already existed
-         pinfo->desc = desc;
-         pinfo->gpid = gpid;
-         pinfo->hash = hash;
-         pinfo->parent = parent;
-         pinfo->pdesc = pdesc;
-         pinfo->snapupdateid = snapupdateid;
-         pinfo->pub = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 7));
-         pinfo->sub = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 8));
-         pinfo->owner = owner;
-         pinfo->proto = proto;
-         ClientSet *cs = projects.get(lpid);
-         pinfo->connected = cs ? cs->size() : 0;
+/**
+ * dumpStats adds group commit, compaction and metadata cache stats to the usual client and dispatcher stats
+ */
+string DatabaseConnectionManager::dumpStats() {
+   string sb = ConnectionManager::dumpStats();
+   char buf[256];
+   sem_wait(&pending_lock);
+   uint32_t waiting = (uint32_t)pending.size();
+   sem_post(&pending_lock);
+   snprintf(buf, sizeof(buf), "Group commit: pending %u, batches %llu, rows %llu, avg %.1f, max %llu, failed %llu, "
+            "sizes 1:%llu 2-7:%llu 8-63:%llu 64+:%llu\n", waiting,
+            (unsigned long long)batches, (unsigned long long)batched_rows,
+            batches ? (double)batched_rows / batches : 0.0,
+            (unsigned long long)max_batch, (unsigned long long)failed_batches,
+            (unsigned long long)batch_hist[0], (unsigned long long)batch_hist[1],
+            (unsigned long long)batch_hist[2], (unsigned long long)batch_hist[3]);
+   sb += buf;
+   snprintf(buf, sizeof(buf), "Compaction: runs %llu, projects %llu, superseded %llu\n",
+            (unsigned long long)compact_runs, (unsigned long long)compacted_projects,
+            (unsigned long long)superseded_updates);
+   sb += buf;
+   sem_wait(&map_sem);
+   snprintf(buf, sizeof(buf), "Metadata cache: projects %llu hits %llu misses, gpids %llu hits %llu misses, "
+            "users %llu hits %llu misses, %llu invalidations\n",
+            (unsigned long long)project_hits, (unsigned long long)project_misses,
+            (unsigned long long)gpid_hits, (unsigned long long)gpid_misses,
+            (unsigned long long)user_hits, (unsigned long long)user_misses,
+            (unsigned long long)invalidations);
+   sem_post(&map_sem);
+   sb += buf;
+   return sb;
+}
+
+/**
+ * readUpdates reads one page of a client's catch-up.  The pooled connection
+ * goes back before anything is sent, and the client pulls the next page only
+ * once it has taken this one, so a client that is slow to read holds neither
+ * a connection nor the thread serving it.
+ */
+bool DatabaseConnectionManager::readUpdates(Client *c, uint64_t *after, deque<string> &chunks) {
+   static const int plens[4] = {8, 4, 8, 4};
+   static const int pformats[4] = {1, 1, 1, 1};
+
+   int pid = htonl(c->getPid());
+   uint64_t sub = htonll(c->getSub());
+   int limit = htonl(CATCHUP_PAGE);
+   uint64_t from = htonll(*after);
+   const char * const parms[4] = {(char*)&from, (char*)&pid, (char*)&sub, (char*)&limit};
+   PGresult *rset = execPrepared("getLatestUpdatesPage", 4, parms, plens, pformats, 1);
+   if (PQresultStatus(rset) != PGRES_TUPLES_OK) {
+      log(LSQL, "getLatestUpdatesPage: %s\n", PQresultErrorMessage(rset));
+      PQclear(rset);
+      return false;
+   }
+   string chunk;
+   chunk.reserve(CATCHUP_CHUNK + 1024);
+   int rows = PQntuples(rset);
+   for (int r = 0; r < rows; r++) {
+      //integer values coming from database are big endian so swap if neccessary
+      uint64_t updateid = ntohll(*(uint64_t*)PQgetvalue(rset, r, 0));
+      *after = updateid;
+      CommandId cmd = command_id(PQgetvalue(rset, r, 1));
+      if (c->admit(cmd)) {
+         const char *json = PQgetvalue(rset, r, 2);
+         if (!splice_updateid(chunk, json, PQgetlength(rset, r, 2), updateid)) {
+            //an older update carrying its own updateid, do it the slow way
+            json_object *obj = json_tokener_parse(json);
+            if (obj != NULL) {
+               json_object_object_del(obj, "updateid");  //make sure key doesn't exist from old update
+               append_json_uint64_val(obj, "updateid", updateid);
+               chunk += json_object_to_json_string_ext(obj, JSON_C_TO_STRING_PLAIN);
+               json_object_put(obj);
+            }
+         }
+      }
+      if (chunk.length() >= CATCHUP_CHUNK) {
+         chunks.push_back(chunk);
+         chunk.clear();
       }
    }
    PQclear(rset);
+   if (chunk.length() > 0) {
+      chunks.push_back(chunk);
+   }
+   return rows == CATCHUP_PAGE;
+}
+
+/**
+ * getProject gets informatio related to a local project
+ * @param pid the local pid of a project to get info on
+ * @return a  project info object for the provided pid
+ */
+const Project *DatabaseConnectionManager::getProject(uint32_t pid) {
+   Project *pinfo = new Project(pid, "");
+   if (!lookupProject(pid, *pinfo) || pinfo->proto != PROTOCOL_VERSION) {
+      delete pinfo;
+      return NULL;
+   }
+   ClientSet *cs = projects.get(pid);
+   pinfo->connected = cs ? cs->size() : 0;
    return pinfo;
 }
 
@@ -536,18 +1026,16 @@ vector<const Project*> *DatabaseConnectionManager::getProjectList(const string &
 
    const char * const parms[1] = {phash.c_str()};
 
-   sem_wait(&fpbh_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "findProjectsByHash",
-                       1, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&fpbh_sem);
+   PGresult *rset = execPrepared("findProjectsByHash",
+                                 1, //int nParams,   size of arrays that follow
+                                 parms, //parms,  //const char * const *paramValues, array of string values
+                                 plens, //const int *paramLengths,
+                                 pformats, //const int *paramFormats,
+                                 1); //int resultFormat); 0 == text, 1 == binary
 
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_TUPLES_OK) {
-      log(LSQL, "findProjectsByHash: %s\n", PQerrorMessage(dbConn));
+      log(LSQL, "findProjectsByHash: %s\n", PQresultErrorMessage(rset));
    }
    else {
       int rows = PQntuples(rset);
@@ -568,6 +1056,8 @@ vector<const Project*> *DatabaseConnectionManager::getProjectList(const string &
             pdesc = PQgetvalue(rset, i, 6);
          }
 
+         const char *gpid = PQgetvalue(rset, 0, 2);
+
          Project *pinfo;
          sem_wait(&map_sem);
          map<uint32_t,Project*>::iterator pi = pid_project_map.find(lpid);
@@ -578,9 +1068,6 @@ vector<const Project*> *DatabaseConnectionManager::getProjectList(const string &
             pinfo = new Project(lpid, "");
             pid_project_map[lpid] = pinfo;
          }
-         sem_post(&map_sem);
-
-         const char *gpid = PQgetvalue(rset, 0, 2);
 
          //now make sure all project info is consistent with database, even if Project record already existed
          pinfo->desc = desc;
@@ -595,7 +1082,9 @@ vector<const Project*> *DatabaseConnectionManager::getProjectList(const string &
          pinfo->proto = proto;
          ClientSet *cs = projects.get(lpid);
          pinfo->connected = cs ? cs->size() : 0;
-         plist->push_back(pinfo);
+         //the caller gets its own copy, the cached one may change under it
+         plist->push_back(new Project(*pinfo));
+         sem_post(&map_sem);
       }
    }
    PQclear(rset);
@@ -613,37 +1102,14 @@ int DatabaseConnectionManager::joinProject(Client *c, uint32_t lpid) {
 
    bool foundPid = false;
 
-   uint32_t tpid = htonl(lpid);
-   static const int plens[1] = {sizeof(tpid)};
-   static const int pformats[1] = {1};
-
-   const char * const parms[1] = {(char*)&tpid};
-
 #ifdef DEBUG
    log(LINFO4, "trying to join project %u\n", lpid);
 #endif
-   sem_wait(&fpbp_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "findProjectByPid",
-                       1, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&fpbp_sem);
-
-   ExecStatusType qres = PQresultStatus(rset);
-   //expecting a single row returned
-   if (qres != PGRES_TUPLES_OK || PQntuples(rset) != 1) {
-      log(LSQL, "findProjectByPid: %s\n", PQerrorMessage(dbConn));
-   }
-   else {
-      uint32_t proto = ntohl(*(uint32_t*)PQgetvalue(rset, 0, 10));
-      if (proto == PROTOCOL_VERSION) {
-         const char *hash = PQgetvalue(rset, 0, 1);
-
-         uint64_t snapupdateid = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 3));
+   Project pinfo(lpid, "");
+   if (lookupProject(lpid, pinfo)) {
+      if (pinfo.proto == PROTOCOL_VERSION) {
    //      logln(LDEBUG, "in joinProject: " + lpid + " " + hash + " " + snapupdateid + " " + rs.getString(5) + " " + rs.getString(7));
-         if (snapupdateid > 0) {  //pid is a snapshot pid
+         if (pinfo.snapupdateid > 0) {  //pid is a snapshot pid
             //this should now be an error condition
 
             //logln(LINFO4, "Attempt to join snapshot " + lpid + " forking instead");
@@ -653,56 +1119,22 @@ int DatabaseConnectionManager::joinProject(Client *c, uint32_t lpid) {
             return -1;
          }
          c->setPid(lpid);
-         c->setHash(hash);
+         c->setHash(pinfo.hash);
+         c->setGpid(pinfo.gpid);
 
-         const char *gpid = PQgetvalue(rset, 0, 2);
-         c->setGpid(gpid);
-
-         const char *owner = PQgetvalue(rset, 0, 9);
-         const char *desc = PQgetvalue(rset, 0, 4);
-         const char *pdesc = PQgetvalue(rset, 0, 6);
-         uint32_t parent = ntohl(*(uint32_t*)PQgetvalue(rset, 0, 5));
-
-         Project *pinfo;
-         sem_wait(&map_sem);
-         map<uint32_t,Project*>::iterator pi = pid_project_map.find(lpid);
-         if (pi != pid_project_map.end()) {
-            pinfo = (*pi).second;
-         }
-         else {
-            pinfo = new Project(lpid, "");
-            pid_project_map[lpid] = pinfo;
-         }
-         sem_post(&map_sem);
-
-         //now make sure all project info is consistent with database, even if Project record already existed
-         pinfo->desc = desc;
-         pinfo->gpid = gpid;
-         pinfo->hash = hash;
-         pinfo->parent = parent;
-         pinfo->pdesc = pdesc;
-         pinfo->snapupdateid = snapupdateid;
-         pinfo->pub = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 7));
-         pinfo->sub = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 8));
-         pinfo->owner = owner;
-         pinfo->proto = proto;
-         ClientSet *cs = projects.get(lpid);
-         pinfo->connected = cs ? cs->size() : 0;
-
-         if (c->getUser() == owner) { //project owner gets full perms, regardless of user, project, or requested perms
+         if (c->getUser() == pinfo.owner) { //project owner gets full perms, regardless of user, project, or requested perms
             log(LINFO3, "Project Owner joined! yay!");
             c->setPub(FULL_PERMISSIONS);
             c->setSub(FULL_PERMISSIONS);
          }
          else { //effective permissions are user perms ANDed with project perms ANDed with the perms requested by the user
-            c->setPub(pinfo->pub & c->getUserPub() & c->getReqPub());
-            c->setSub(pinfo->sub & c->getUserSub() & c->getReqSub());
+            c->setPub(pinfo.pub & c->getUserPub() & c->getReqPub());
+            c->setSub(pinfo.sub & c->getUserSub() & c->getReqSub());
          }
 
          foundPid = true;
       }
    }
-   PQclear(rset);
 
    if (foundPid) {
       projects.addClient(c);
@@ -729,6 +1161,8 @@ int DatabaseConnectionManager::snapProject(Client *c, uint64_t lastupdateid, con
    int oldpid = htonl(c->getPid());
    string gpid;
 
+   lastupdateid = htonll(lastupdateid);
+
 //   log(LINFO, "User %u adding snapshot for %s\n", uid, c->getHash());
    while (true) {
       //generate a new GPID; We optimistically insert, assuming
@@ -743,22 +1177,19 @@ int DatabaseConnectionManager::snapProject(Client *c, uint64_t lastupdateid, con
       static const int pformats[6] = {0, 0, 0, 0, 1, 1};
 
       int proto = htonl(PROTOCOL_VERSION);
-      lastupdateid = htonll(lastupdateid);
       const char * const parms[6] = {c->getHash().c_str(), gpid.c_str(),
                                      desc.c_str(), c->getUser().c_str(), (char*)&lastupdateid, (char*)&proto};
 
-      sem_wait(&aps_sem);
-      PGresult *rset = PQexecPrepared(dbConn, "addProjectSnap",
-                          6, //int nParams,   size of arrays that follow
-                          parms, //parms,  //const char * const *paramValues, array of string values
-                          plens, //const int *paramLengths,
-                          pformats, //const int *paramFormats,
-                          1); //int resultFormat); 0 == text, 1 == binary
-      sem_post(&aps_sem);
+      PGresult *rset = execPrepared("addProjectSnap",
+                                    6, //int nParams,   size of arrays that follow
+                                    parms, //parms,  //const char * const *paramValues, array of string values
+                                    plens, //const int *paramLengths,
+                                    pformats, //const int *paramFormats,
+                                    1); //int resultFormat); 0 == text, 1 == binary
 
       ExecStatusType qres = PQresultStatus(rset);
       if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
-         log(LSQL, "addProjectSnap: %s\n", PQerrorMessage(dbConn));
+         log(LSQL, "addProjectSnap: %s\n", PQresultErrorMessage(rset));
       }
       else {
          spid = *(int*)PQgetvalue(rset, 0, 0);  //leave in network byte order for now
@@ -768,23 +1199,22 @@ int DatabaseConnectionManager::snapProject(Client *c, uint64_t lastupdateid, con
       PQclear(rset);
    }
 
-   static const int plens[2] = {4, 4};
-   static const int pformats[2] = {1, 1};
+   //the snapshot shares its parent's history up to the snapshot point
+   static const int plens[3] = {4, 4, 8};
+   static const int pformats[3] = {1, 1, 1};
 
-   const char * const parms[2] = {(char*)&spid, (char*)&oldpid};
+   const char * const parms[3] = {(char*)&spid, (char*)&oldpid, (char*)&lastupdateid};
 
-   sem_wait(&apf_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "addProjectFork",
-                       2, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&apf_sem);
+   PGresult *rset = execPrepared("addProjectFork",
+                                 3, //int nParams,   size of arrays that follow
+                                 parms, //parms,  //const char * const *paramValues, array of string values
+                                 plens, //const int *paramLengths,
+                                 pformats, //const int *paramFormats,
+                                 1); //int resultFormat); 0 == text, 1 == binary
 
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
-      log(LSQL, "addProjectFork: %s\n", PQerrorMessage(dbConn));
+      log(LSQL, "addProjectFork: %s\n", PQresultErrorMessage(rset));
    }
    else {
       int fid = ntohl(*(int*)PQgetvalue(rset, 0, 0));
@@ -796,13 +1226,14 @@ int DatabaseConnectionManager::snapProject(Client *c, uint64_t lastupdateid, con
       }
    }
    PQclear(rset);
+   invalidateProject(ntohl(spid));
    return ntohl(spid);
 }
 
 
 /**
- * forkProject  forks a project - creats new project and copies all updates to point to the new project,
- * publish and subscribe values are inherited
+ * forkProject  forks a project - creats new project that shares the original project's updates
+ * up to the fork point, publish and subscribe values are inherited
  * @param c client object invoking the fork
  * @param lastupdateid the updateid value the fork is to occur at
  * @param desc user provided description of the fork
@@ -812,41 +1243,19 @@ int DatabaseConnectionManager::snapProject(Client *c, uint64_t lastupdateid, con
 int DatabaseConnectionManager::forkProject(Client *c, uint64_t lastupdateid, const string &desc) {
    int rval = -1;
 
-   static const int plens[1] = {4};
-   static const int pformats[1] = {1};
-
-   int pid = htonl(c->getPid());
-   const char * const parms[1] = {(char*)&pid};
-
-   sem_wait(&fpbp_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "findProjectByPid",
-                       1, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&fpbp_sem);
-
-   ExecStatusType qres = PQresultStatus(rset);
-   //expecting a single row returned
-   if (qres != PGRES_TUPLES_OK || PQntuples(rset) != 1) {
-      log(LSQL, "findProjectByPid: %s\n", PQerrorMessage(dbConn));
-   }
-   else {
-      uint64_t pub = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 7));
-      uint64_t sub = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 8));
-
+   Project pinfo(c->getPid(), "");
+   if (lookupProject(c->getPid(), pinfo)) {
 //      logln("forking " + pid + " pub is " + pub + " sub is " + sub);
-      rval = forkProject(c, lastupdateid, desc, pub, sub);
+      rval = forkProject(c, lastupdateid, desc, pinfo.pub, pinfo.sub);
    }
-   PQclear(rset);
 
    return rval;
 }
 
 
 /**
- * forkProject  forks a project - creats new project and copies all updates to point to the new project
+ * forkProject  forks a project - creats new project that shares the original project's updates
+ * up to the fork point.  Only a forklist entry is written, however long the history
  * @param c client object invoking the fork
  * @param lastupdateid the updateid value the fork is to occur at
  * @param desc user provided description of the fork
@@ -864,59 +1273,35 @@ int DatabaseConnectionManager::forkProject(Client *c, uint64_t lastupdateid, con
    int lpid = addProject(c, c->getHash(), desc, pub, sub);  //could add "forked from" to desc at this point
    if (lpid >= 0) {
       //gpid and lpid are set in addProject
-      //add to forklist
+      //add to forklist, the new project shares the old project's updates up to
+      //lastupdateid rather than getting copies of them
 
-      static const int plens[2] = {4, 4};
-      static const int pformats[2] = {1, 1};
+      static const int plens[3] = {4, 4, 8};
+      static const int pformats[3] = {1, 1, 1};
 
       int tlpid = htonl(lpid);
-      const char * const parms[2] = {(char*)&tlpid, (char*)&told};
+      uint64_t last = htonll(lastupdateid);
+      const char * const parms[3] = {(char*)&tlpid, (char*)&told, (char*)&last};
 
-      sem_wait(&apf_sem);
-      PGresult *rset = PQexecPrepared(dbConn, "addProjectFork",
-                          2, //int nParams,   size of arrays that follow
-                          parms, //parms,  //const char * const *paramValues, array of string values
-                          plens, //const int *paramLengths,
-                          pformats, //const int *paramFormats,
-                          1); //int resultFormat); 0 == text, 1 == binary
-      sem_post(&apf_sem);
+      PGresult *rset = execPrepared("addProjectFork",
+                                    3, //int nParams,   size of arrays that follow
+                                    parms, //parms,  //const char * const *paramValues, array of string values
+                                    plens, //const int *paramLengths,
+                                    pformats, //const int *paramFormats,
+                                    1); //int resultFormat); 0 == text, 1 == binary
 
       ExecStatusType qres = PQresultStatus(rset);
       if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
-         log(LSQL, "addProjectFork: %s\n", PQerrorMessage(dbConn));
+         log(LSQL, "addProjectFork: %s\n", PQresultErrorMessage(rset));
       }
       else {
 //         int fid  = ntohl(*(int*)PQgetvalue(rset, 0, 0));
 //         logln("Forked (" + fid + "): Project " + lpid + " forked from " + oldlpid, LINFO);
-      }
-      PQclear(rset);
-
-      //dup update records
-      static const int plens2[3] = {4, 8, 4};
-      static const int pformats2[3] = {1, 1, 1};
-
-      uint64_t last = htonll(lastupdateid);
-      const char * const parms2[3] = {(char*)&told, (char*)&last, (char*)&tlpid};
-
-      sem_wait(&cu_sem);
-      rset = PQexecPrepared(dbConn, "copyUpdates",
-                          3, //int nParams,   size of arrays that follow
-                          parms2, //parms,  //const char * const *paramValues, array of string values
-                          plens2, //const int *paramLengths,
-                          pformats2, //const int *paramFormats,
-                          1); //int resultFormat); 0 == text, 1 == binary
-      sem_post(&cu_sem);
-
-      qres = PQresultStatus(rset);
-      if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
-         log(LSQL, "copyUpdates: %s\n", PQerrorMessage(dbConn));
-      }
-      else {
-//         uint64_t lastinserted = *(uint64_t*)PQgetvalue(rset, 0, 0);
-//         logln("Last inserted was " + lastinserted + ", lastupdateid was " + lastupdateid, LINFO);
          rval = lpid;
       }
       PQclear(rset);
+      //addProject only knew part of the new project's row
+      invalidateProject(lpid);
 
       //at this point the project has forked and the plugin that forked is on the new project
 
@@ -968,8 +1353,8 @@ void DatabaseConnectionManager::sendForkFollows(Client *originator, int oldlpid,
 /**
  * snapforkProject -  this is a special version of forkProject that is designed to work
  * on snapshots (instead of existing projects) this works exactly like forkProject, execpt
- * updates are copied from the 'parent' of the snapshot instead of the client's currently
- * associated project, also updates are copied until the lastupdateid from the snapshot,
+ * updates are shared from the 'parent' of the snapshot instead of the client's currently
+ * associated project, also updates are shared until the lastupdateid from the snapshot,
  * not from the plugin (last received update is stored in the idb)
  * @param c client invoking the snapforkProject
  * @param spid the pid of the project that is being snapshotted
@@ -986,91 +1371,43 @@ int DatabaseConnectionManager::snapforkProject(Client *c, int spid, const string
    uint64_t lastupdateid = -1;
    int parentlpid = -1;
 
-   static const int plens[1] = {4};
-   static const int pformats[1] = {1};
-
-   const char * const parms[1] = {(char*)&oldlpid};
-
-   sem_wait(&fpbp_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "findProjectByPid",
-                       1, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&fpbp_sem);
-
-   ExecStatusType qres = PQresultStatus(rset);
-   //expecting a single row returned
-   if (qres != PGRES_TUPLES_OK || PQntuples(rset) != 1) {
-      log(LSQL, "findProjectByPid: %s\n", PQerrorMessage(dbConn));
+   Project pinfo(spid, "");
+   if (lookupProject(spid, pinfo)) {
+      parentlpid = pinfo.parent;
+      lastupdateid = pinfo.snapupdateid;
    }
-   else {
-      if (!PQgetisnull(rset, 0, 5)) {
-         parentlpid = ntohl(*(int*)PQgetvalue(rset, 0, 5));
-      }
-      lastupdateid = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 3));
-   }
-   PQclear(rset);
 
    if (lastupdateid >= 0 && parentlpid >= 0 ) {
       int lpid = addProject(c, c->getHash(), desc, pub, sub);
       if (lpid >= 0) {
          //gpid and lpid are set in addProject
-         //add to forklist
+         //add to forklist, the snapshot in turn leads back to its parent
 
-         static const int plens[2] = {4, 4};
-         static const int pformats[2] = {1, 1};
+         static const int plens[3] = {4, 4, 8};
+         static const int pformats[3] = {1, 1, 1};
 
          int tlpid = htonl(lpid);
-         const char * const parms[2] = {(char*)&tlpid, (char*)&oldlpid};
+         lastupdateid = htonll(lastupdateid);
+         const char * const parms[3] = {(char*)&tlpid, (char*)&oldlpid, (char*)&lastupdateid};
 
-         sem_wait(&apf_sem);
-         PGresult *rset = PQexecPrepared(dbConn, "addProjectFork",
-                             2, //int nParams,   size of arrays that follow
-                             parms, //parms,  //const char * const *paramValues, array of string values
-                             plens, //const int *paramLengths,
-                             pformats, //const int *paramFormats,
-                             1); //int resultFormat); 0 == text, 1 == binary
-         sem_post(&apf_sem);
+         PGresult *rset = execPrepared("addProjectFork",
+                                       3, //int nParams,   size of arrays that follow
+                                       parms, //parms,  //const char * const *paramValues, array of string values
+                                       plens, //const int *paramLengths,
+                                       pformats, //const int *paramFormats,
+                                       1); //int resultFormat); 0 == text, 1 == binary
 
          ExecStatusType qres = PQresultStatus(rset);
          if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
-            log(LSQL, "addProjectFork: %s\n", PQerrorMessage(dbConn));
+            log(LSQL, "addProjectFork: %s\n", PQresultErrorMessage(rset));
          }
          else {
 //            int fid = ntohl(*(int*)PQgetvalue(rset, 0, 0));
 //            logln("Forked (" + fid + "): Project " + lpid + " forked from snapshot " + oldlpid + "(original project " + parentlpid + ")", LINFO);
-         }
-         PQclear(rset);
-
-         //dup update records
-         static const int plens2[3] = {4, 8, 4};
-         static const int pformats2[3] = {1, 1, 1};
-
-         parentlpid = htonl(parentlpid);
-         lastupdateid = htonll(lastupdateid);
-         const char * const parms2[3] = {(char*)&parentlpid, (char*)&lastupdateid, (char*)&tlpid};
-
-         sem_wait(&cu_sem);
-         rset = PQexecPrepared(dbConn, "copyUpdates",
-                             3, //int nParams,   size of arrays that follow
-                             parms2, //parms,  //const char * const *paramValues, array of string values
-                             plens2, //const int *paramLengths,
-                             pformats2, //const int *paramFormats,
-                             1); //int resultFormat); 0 == text, 1 == binary
-         sem_post(&cu_sem);
-
-         qres = PQresultStatus(rset);
-         if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
-            log(LSQL, "copyUpdates: %s\n", PQerrorMessage(dbConn));
-         }
-         else {
-//            uint64_t lastinserted = *(uint64_t*)PQgetvalue(rset, 0, 0);
-//            logln("Last inserted was " + lastinserted + ", lastupdateid was " + lastupdateid, LINFO);
             rval = lpid;
          }
          PQclear(rset);
+         invalidateProject(lpid);
       }
       else {
          c->send_error("attempt to snapfork a project (not a snapshot)");
@@ -1144,28 +1481,22 @@ int DatabaseConnectionManager::addProject(Client *c, const string &hash, const s
       const char * const parms[7] = {hash.c_str(), gpid.c_str(),
                                      desc.c_str(), c->getUser().c_str(), (char*)&pub, (char*)&sub, (char*)&proto};
 
-      sem_wait(&ap_sem);
-      PGresult *rset = PQexecPrepared(dbConn, "addProject",
-                          7, //int nParams,   size of arrays that follow
-                          parms, //parms,  //const char * const *paramValues, array of string values
-                          plens, //const int *paramLengths,
-                          pformats, //const int *paramFormats,
-                          1); //int resultFormat); 0 == text, 1 == binary
-      sem_post(&ap_sem);
+      PGresult *rset = execPrepared("addProject",
+                                    7, //int nParams,   size of arrays that follow
+                                    parms, //parms,  //const char * const *paramValues, array of string values
+                                    plens, //const int *paramLengths,
+                                    pformats, //const int *paramFormats,
+                                    1); //int resultFormat); 0 == text, 1 == binary
 
       ExecStatusType qres = PQresultStatus(rset);
       if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
-         log(LSQL, "addProject: %s\n", PQerrorMessage(dbConn));
+         log(LSQL, "addProject: %s\n", PQresultErrorMessage(rset));
       }
       else {
          lpid = ntohl(*(int*)PQgetvalue(rset, 0, 0));
 
-         Project *pinfo;
-         sem_wait(&map_sem);
-         pinfo = new Project(lpid, desc);
-         pid_project_map[lpid] = pinfo;
-         sem_post(&map_sem);
-         //now make sure all project info is consistent with database, even if Project record already existed
+         //filled in before it is published, since other threads may look it up at once
+         Project *pinfo = new Project(lpid, desc);
          pinfo->owner = c->getUser();
          pinfo->gpid = gpid;
          pinfo->hash = hash;
@@ -1173,6 +1504,13 @@ int DatabaseConnectionManager::addProject(Client *c, const string &hash, const s
          pinfo->sub = sub;
          pinfo->proto = proto;
          pinfo->connected = 1;
+         sem_wait(&map_sem);
+         map<uint32_t,Project*>::iterator pi = pid_project_map.find(lpid);
+         if (pi != pid_project_map.end()) {
+            delete (*pi).second;
+         }
+         pid_project_map[lpid] = pinfo;
+         sem_post(&map_sem);
 
          c->setPid(lpid);
          c->setGpid(gpid);
@@ -1234,20 +1572,19 @@ void DatabaseConnectionManager::updateProjectPerms(Client *c, uint64_t pub, uint
    const char * const parms[3] = {(char*)&tpub, (char*)&tsub, (char*)&pid};
 
 //   logln("Setting project " + pid + " permissions to p " + pub + " s " + sub, LINFO2);
-   sem_wait(&ppu_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "projectPermsUpdate",
-                       3, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&ppu_sem);
+   PGresult *rset = execPrepared("projectPermsUpdate",
+                                 3, //int nParams,   size of arrays that follow
+                                 parms, //parms,  //const char * const *paramValues, array of string values
+                                 plens, //const int *paramLengths,
+                                 pformats, //const int *paramFormats,
+                                 1); //int resultFormat); 0 == text, 1 == binary
 
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_COMMAND_OK) {
-      log(LSQL, "projectPermsUpdate: %s\n", PQerrorMessage(dbConn));
+      log(LSQL, "projectPermsUpdate: %s\n", PQresultErrorMessage(rset));
    }
    PQclear(rset);
+   invalidateProject(c->getPid());
 
    log(LINFO3, "recalculating effective permissions for connected clients\n");
 
@@ -1264,29 +1601,42 @@ void DatabaseConnectionManager::updateProjectPerms(Client *c, uint64_t pub, uint
 int DatabaseConnectionManager::gpid2lpid(const string &gpid) {
    int lpid = -1;
 //   logln("lookup up: " + gpid, LINFO3);
+   time_t now = time(NULL);
+   sem_wait(&map_sem);
+   map<string,CachedPid>::iterator gi = gpid_map.find(gpid);
+   if (gi != gpid_map.end() && fresh((*gi).second.loaded, now)) {
+      lpid = (*gi).second.lpid;
+      gpid_hits++;
+      sem_post(&map_sem);
+      return lpid;
+   }
+   gpid_misses++;
+   sem_post(&map_sem);
 
    static const int plens[1] = {0};
    static const int pformats[1] = {0};
 
    const char * const parms[1] = {gpid.c_str()};
 
-   sem_wait(&fpbg_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "findProjectByGpid",
-                       1, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&fpbg_sem);
+   PGresult *rset = execPrepared("findProjectByGpid",
+                                 1, //int nParams,   size of arrays that follow
+                                 parms, //parms,  //const char * const *paramValues, array of string values
+                                 plens, //const int *paramLengths,
+                                 pformats, //const int *paramFormats,
+                                 1); //int resultFormat); 0 == text, 1 == binary
 
    ExecStatusType qres = PQresultStatus(rset);
    //expecting exactly 1 row
    if (qres != PGRES_TUPLES_OK || PQntuples(rset) != 1) {
-      log(LSQL, "findProjectByGpid: %s\n", PQerrorMessage(dbConn));
+      log(LSQL, "findProjectByGpid: %s\n", PQresultErrorMessage(rset));
    }
    else {
       lpid = ntohl(*(int*)PQgetvalue(rset, 0, 0));
 //      logln("found: " + lpid, LINFO3);
+      CachedPid cp = {(uint32_t)lpid, now};
+      sem_wait(&map_sem);
+      gpid_map[gpid] = cp;
+      sem_post(&map_sem);
    }
    PQclear(rset);
 
@@ -22,13 +22,18 @@
 #define __DB_SUPPORT_H
 
 #include <map>
+#include <deque>
+#include <string>
+#include <vector>
 #include <stdint.h>
+#include <pthread.h>
 #include <libpq-fe.h>
 #include <semaphore.h>
 
 #include "cli_mgr.h"
 #include "client.h"
 #include "proj_info.h"
+#include "db_pool.h"
 
 using namespace std;
 
@@ -41,13 +46,15 @@ public:
     * doAuth authenticates a user
     * bacially this is standard CHAP with HMAC (md5)
     * @param nio The network connection to authenticate
+    * @param features receives the protocol features agreed with the client
     * @return the user id of an authenticated user, or failure code
     */
-   uint32_t doAuth(NetworkIO *nio);
+   uint32_t doAuth(NetworkIO *nio, uint32_t *features);
 
    void importUpdate(const char *newowner, int pid, const char *cmd, json_object *obj);
-   void post(Client *src, const char *cmd, json_object *obj);
-   void sendLatestUpdates(Client *c, uint64_t lastUpdate);
+   void relay(Client *src, CommandId cmd, const char *json, size_t len);
+   void relayBatch(Client *src, vector<RawUpdate> &updates);
+   bool readUpdates(Client *c, uint64_t *after, deque<string> &chunks);
    const Project *getProject(uint32_t pid);
 
    vector<const Project*> *getProjectList(const string &phash);
@@ -64,26 +71,106 @@ public:
    void updateProjectPerms(Client *c, uint64_t pub, uint64_t sub);
    int gpid2lpid(const string &gpid);
 
+   string dumpStats();
+   int64_t compact(uint32_t pid);
+
 private:
+   /**
+    * PendingUpdate is an update, or the updates from an update_batch,
+    * waiting for the commit thread.  Everything needed to archive and later
+    * dispatch it is copied out of the client since the client may disconnect
+    * before the update is committed.
+    */
+   struct PendingUpdate {
+      Client *c;
+      uint32_t pid;
+      string user;
+      bool batch;
+      vector<RawUpdate> updates;
+   };
+
+   /**
+    * CachedUser is what doAuth needs from a users row
+    */
+   struct CachedUser {
+      uint32_t uid;
+      string pwhash;
+      uint64_t pub;
+      uint64_t sub;
+      time_t loaded;
+   };
+
+   /**
+    * CachedPid maps a gpid to its local pid
+    */
+   struct CachedPid {
+      uint32_t lpid;
+      time_t loaded;
+   };
+
+   bool fresh(time_t loaded, time_t now) {
+      return meta_ttl > 0 && loaded != 0 && (now - loaded) < meta_ttl;
+   }
+   bool lookupProject(uint32_t lpid, Project &out);
+   bool lookupUser(const char *user, CachedUser &u);
+   void invalidateProject(uint32_t lpid);
+
+   int64_t compactProject(uint32_t pid);
+   static void *compactThread(void *arg);
+
+   static void *commitThread(void *arg);
+   void commitLoop();
+   void commitBatch(vector<PendingUpdate> &batch);
+
    map<uint32_t,Project*> pid_project_map;
       
-   void init_queries();
-
-   sem_t pu_sem;
-   sem_t ap_sem;
-   sem_t aps_sem;
-   sem_t apf_sem;
-   sem_t fp_sem;
-   sem_t fpbh_sem;
-   sem_t fpbp_sem;
-   sem_t fpbg_sem;
-   sem_t gui_sem;
-   sem_t glu_sem;
-   sem_t cu_sem;
-   sem_t ppu_sem;
+   static void init_queries(PGconn *dbConn);
+   PGresult *execPrepared(const char *stmt, int nParams, const char * const *paramValues,
+                          const int *paramLengths, const int *paramFormats, int resultFormat);
+
    sem_t map_sem;
 
-   PGconn *dbConn;
+   //project, gpid and user metadata is reused for up to meta_ttl seconds,
+   //less if the server changes it.  All of it is guarded by map_sem
+   int meta_ttl;
+   map<string,CachedPid> gpid_map;
+   map<string,CachedUser> user_cache;
+   uint64_t project_hits, project_misses;
+   uint64_t gpid_hits, gpid_misses;
+   uint64_t user_hits, user_misses;
+   uint64_t invalidations;
+
+   //queries check out their own connection so they may run concurrently
+   DbPool *pool;
+
+   //group commit: updates are collected for up to commit_window_ms, or until
+   //commit_batch of them are waiting, then archived in a single insert
+   deque<PendingUpdate> pending;
+   sem_t pending_lock;
+   sem_t pending_count;
+   pthread_t committer;
+   bool done;
+   int commit_window_ms;
+   size_t commit_batch;
+   bool pipeline;         //pipeline batches rather than using one multi-row insert
+
+   //group commit stats, only written by the commit thread
+   uint64_t batches;
+   uint64_t batched_rows;
+   uint64_t failed_batches;
+   uint64_t max_batch;
+   uint64_t batch_hist[4];   //batches of 1, 2-7, 8-63, 64+ updates
+
+   //compaction runs every compact_interval seconds on projects with at least
+   //compact_min updates since they were last compacted, or when asked
+   pthread_t compactor;
+   sem_t compact_wake;
+   sem_t compact_lock;       //one compaction at a time
+   int compact_interval;
+   uint64_t compact_min;
+   uint64_t compact_runs;
+   uint64_t compacted_projects;
+   uint64_t superseded_updates;
 };
 
 #endif
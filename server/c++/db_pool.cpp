@@ -0,0 +1,201 @@
+/*
+   collabREate db_pool.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <errno.h>
+#include <poll.h>
+
+#include "db_pool.h"
+#include "utils.h"
+
+DbPool::DbPool(const char * const *keywords, const char * const *values, int size,
+               Preparer prepare, int validate) {
+   this->prepare = prepare;
+   this->validate = validate;
+   if (size < 1) {
+      size = 1;
+   }
+   sem_init(&lock, 0, 1);
+   sem_init(&avail, 0, size);
+   time_t now = time(NULL);
+   for (int i = 0; i < size; i++) {
+      PGconn *conn = PQconnectdbParams(keywords, values, 0);
+      /* Check to see that the backend connection was successfully made */
+      if (PQstatus(conn) != CONNECTION_OK) {
+         log(LSQL, "Connection to database failed: %s\n", PQerrorMessage(conn));
+      }
+      else {
+         (*prepare)(conn);
+      }
+      //keep failed connections too, they are retried when checked out
+      conns.push_back(conn);
+      Slot s = {conn, now};
+      idle.push_back(s);
+   }
+   log(LINFO, "Database pool opened %d connections\n", size);
+}
+
+DbPool::~DbPool() {
+   for (vector<PGconn*>::iterator i = conns.begin(); i != conns.end(); i++) {
+      PQfinish(*i);
+   }
+   sem_destroy(&avail);
+   sem_destroy(&lock);
+}
+
+//re-establish a connection and its prepared statements
+bool DbPool::reconnect(PGconn *conn) {
+   PQreset(conn);
+   if (PQstatus(conn) != CONNECTION_OK) {
+      log(LSQL, "Database reconnect failed: %s\n", PQerrorMessage(conn));
+      return false;
+   }
+   log(LINFO, "Database connection re-established\n");
+   (*prepare)(conn);
+   return true;
+}
+
+/*
+ * A connection that went bad while in use is reported by PQstatus.  One the
+ * server dropped while it sat idle is not noticed until it is used, so
+ * connections that have been idle for a while are pinged with an empty
+ * query first.
+ */
+PGconn *DbPool::checkout() {
+   sem_wait(&avail);
+   sem_wait(&lock);
+   Slot s = idle.back();
+   idle.pop_back();
+   sem_post(&lock);
+
+   if (PQstatus(s.conn) == CONNECTION_OK && (time(NULL) - s.last_used) >= validate) {
+      PGresult *res = PQexec(s.conn, "");
+      PQclear(res);
+   }
+   if (PQstatus(s.conn) != CONNECTION_OK) {
+      reconnect(s.conn);
+   }
+   return s.conn;
+}
+
+void DbPool::checkin(PGconn *conn) {
+   if (PQstatus(conn) != CONNECTION_OK) {
+      reconnect(conn);
+   }
+   Slot s = {conn, time(NULL)};
+   sem_wait(&lock);
+   idle.push_back(s);
+   sem_post(&lock);
+   sem_post(&avail);
+}
+
+/*
+ * Executions are written while the socket will take them and results are read
+ * as they arrive.  The connection is non-blocking for the duration so that a
+ * server stalled writing results back can never leave both ends waiting on
+ * each other.
+ */
+bool DbPool::execPipelined(PGconn *conn, const char *stmt, size_t count, int nParams,
+                           const char * const *paramValues, const int *paramLengths,
+                           const int *paramFormats, int resultFormat, vector<PGresult*> &results) {
+   results.clear();
+   if (PQstatus(conn) != CONNECTION_OK || !PQenterPipelineMode(conn)) {
+      log(LSQL, "pipeline: %s\n", PQerrorMessage(conn));
+      return false;
+   }
+   PQsetnonblocking(conn, 1);
+   int sock = PQsocket(conn);
+   size_t sent = 0;
+   bool synced = false;
+   bool finished = false;
+   bool ok = true;
+   while (ok && !finished) {
+      while (sent < count) {
+         size_t off = sent * nParams;
+         if (!PQsendQueryPrepared(conn, stmt, nParams, paramValues + off, paramLengths + off,
+                                  paramFormats + off, resultFormat)) {
+            ok = false;
+            break;
+         }
+         sent++;
+         if (PQflush(conn) != 0) {
+            //socket is full (or broken), go and read some results
+            break;
+         }
+      }
+      if (ok && sent == count && !synced) {
+         ok = PQpipelineSync(conn) == 1;
+         synced = true;
+      }
+      int unsent = PQflush(conn);
+      if (!ok || unsent == -1) {
+         ok = false;
+         break;
+      }
+      pollfd pfd;
+      pfd.fd = sock;
+      pfd.events = POLLIN | (unsent ? POLLOUT : 0);
+      pfd.revents = 0;
+      if (poll(&pfd, 1, -1) == -1) {
+         ok = errno == EINTR;
+         continue;
+      }
+      if ((pfd.revents & (POLLIN | POLLERR | POLLHUP)) == 0) {
+         continue;
+      }
+      if (!PQconsumeInput(conn)) {
+         ok = false;
+         break;
+      }
+      bool idle = false;
+      while (!PQisBusy(conn)) {
+         PGresult *res = PQgetResult(conn);
+         if (res == NULL) {
+            //each execution's results are followed by a NULL, two in a row
+            //means everything sent so far has been answered
+            if (idle) {
+               break;
+            }
+            idle = true;
+            continue;
+         }
+         idle = false;
+         if (PQresultStatus(res) == PGRES_PIPELINE_SYNC) {
+            PQclear(res);
+            finished = true;
+            break;
+         }
+         results.push_back(res);
+      }
+   }
+   if (ok && results.size() == count) {
+      PQexitPipelineMode(conn);
+      PQsetnonblocking(conn, 0);
+      return true;
+   }
+   log(LSQL, "pipeline: %s\n", PQerrorMessage(conn));
+   for (vector<PGresult*>::iterator i = results.begin(); i != results.end(); i++) {
+      PQclear(*i);
+   }
+   results.clear();
+   //there is no telling what state the session was left in
+   PQsetnonblocking(conn, 0);
+   reconnect(conn);
+   return false;
+}
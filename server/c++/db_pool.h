@@ -0,0 +1,100 @@
+/*
+   collabREate db_pool.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __DB_POOL_H
+#define __DB_POOL_H
+
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+#include <libpq-fe.h>
+#include <semaphore.h>
+
+using namespace std;
+
+/**
+ * DbPool
+ * A fixed size pool of database connections.  A libpq connection may only
+ * be used by one thread at a time, so each query checks out a connection
+ * for its exclusive use and returns it when finished.  Every connection is
+ * prepared with the same statements, by the Preparer supplied at construction,
+ * both when it is first opened and whenever it has to be re-established.
+ */
+class DbPool {
+public:
+   typedef void (*Preparer)(PGconn *conn);
+
+   /**
+    * @param keywords NULL terminated list of libpq connection keywords
+    * @param values values corresponding to keywords
+    * @param size the number of connections to open
+    * @param prepare called on every new or reset connection to prepare statements
+    * @param validate connections idle for longer than this many seconds are
+    * checked before being handed out
+    */
+   DbPool(const char * const *keywords, const char * const *values, int size,
+          Preparer prepare, int validate);
+   ~DbPool();
+
+   /**
+    * checkout blocks until a connection is available
+    * @return a healthy connection if at all possible, which must be
+    * handed back with checkin
+    */
+   PGconn *checkout();
+   void checkin(PGconn *conn);
+
+   /**
+    * execPipelined executes a prepared statement count times on a checked out
+    * connection using libpq pipeline mode, so every execution is in flight
+    * at once and the whole set costs a single round trip.  The executions
+    * share one implicit transaction, if any of them fails none take effect.
+    * @param conn a connection obtained from checkout
+    * @param stmt name of the prepared statement
+    * @param count number of times to execute stmt
+    * @param nParams parameters per execution, paramValues, paramLengths and
+    * paramFormats each hold count * nParams entries, one execution after another
+    * @param results receives one result per execution, in execution order,
+    * which the caller must PQclear
+    * @return false if the pipeline broke down, in which case results is empty
+    */
+   bool execPipelined(PGconn *conn, const char *stmt, size_t count, int nParams,
+                      const char * const *paramValues, const int *paramLengths,
+                      const int *paramFormats, int resultFormat, vector<PGresult*> &results);
+
+   size_t size() {return conns.size();};
+
+private:
+   struct Slot {
+      PGconn *conn;
+      time_t last_used;
+   };
+
+   bool reconnect(PGconn *conn);
+
+   vector<PGconn*> conns;   //every connection, for cleanup
+   vector<Slot> idle;       //connections available for checkout
+   sem_t avail;             //counts idle connections
+   sem_t lock;              //protects idle
+   Preparer prepare;
+   int validate;
+};
+
+#endif
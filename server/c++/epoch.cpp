@@ -0,0 +1,56 @@
+/*
+   collabREate epoch.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <sched.h>
+
+#include "epoch.h"
+
+/*
+ * Readers count themselves against the parity of the current epoch.
+ * synchronize moves the epoch forward and waits for the count on the old
+ * parity to drain.  A reader that raced with the flip notices that the
+ * epoch moved underneath it and retries on the new parity.
+ */
+Epoch::Epoch() {
+   epoch = 0;
+   readers[0] = readers[1] = 0;
+}
+
+uint32_t Epoch::enter() {
+   while (true) {
+      uint32_t e = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+      __sync_fetch_and_add(&readers[e & 1], 1);
+      if (__atomic_load_n(&epoch, __ATOMIC_SEQ_CST) == e) {
+         return e & 1;
+      }
+      __sync_fetch_and_sub(&readers[e & 1], 1);
+   }
+}
+
+void Epoch::leave(uint32_t token) {
+   __sync_fetch_and_sub(&readers[token], 1);
+}
+
+void Epoch::synchronize() {
+   uint32_t old = __sync_fetch_and_add(&epoch, 1);
+   while (__atomic_load_n(&readers[old & 1], __ATOMIC_SEQ_CST) != 0) {
+      sched_yield();
+   }
+}
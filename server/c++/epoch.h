@@ -0,0 +1,58 @@
+/*
+   collabREate epoch.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __EPOCH_H
+#define __EPOCH_H
+
+#include <stdint.h>
+
+/**
+ * Epoch
+ * Protects read-mostly data that is replaced copy-on-write.  Readers bracket
+ * their access with enter/leave and never block.  A writer publishes a new
+ * copy, then calls synchronize, which returns once every reader that might
+ * still be looking at the old copy has left.  The old copy (and anything
+ * only reachable through it) may then be released.
+ *
+ * synchronize must never be called from inside a read section of the same
+ * Epoch, and writers must serialize among themselves.
+ */
+class Epoch {
+public:
+   Epoch();
+
+   /**
+    * enter begins a read section
+    * @return a token that must be passed to leave
+    */
+   uint32_t enter();
+   void leave(uint32_t token);
+
+   /**
+    * synchronize waits for all read sections that began before the call
+    */
+   void synchronize();
+
+private:
+   uint32_t epoch;
+   uint32_t readers[2];
+};
+
+#endif
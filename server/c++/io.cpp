@@ -20,12 +20,16 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <time.h>
+#include <poll.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
@@ -39,15 +43,44 @@
 #include <json-c/json.h>
 
 #include "io.h"
+#include "writer.h"
 #include "utils.h"
 
 using std::string;
 
+//how long throttle waits for a client to accept more data before giving up
+#define THROTTLE_TIMEOUT_MS 30000
+
 #define ERROR_CREATE_SOCK "Unable to create socket"
 #define ERROR_REUSE_SOCK "Unable to set reuse"
 #define ERROR_BIND_SOCK "Unable to bind socket"
 #define ERROR_LISTEN_SOCK "Unable to listen on socket"
 
+//initial and maximum sizes of the per connection receive buffer
+#define RECV_BUF_INIT 16384
+#define RECV_BUF_MAX (1024 * 1024)
+
+//the receive buffer grows past RECV_BUF_MAX to hold a single message up to this size
+#define MAX_FRAME_SIZE (16 * 1024 * 1024)
+
+/*
+ * The header and the bytes live in a single allocation
+ */
+SharedBuffer *SharedBuffer::create(const void *data, size_t len) {
+   SharedBuffer *b = (SharedBuffer*)malloc(offsetof(SharedBuffer, bytes) + len + 1);
+   b->refs = 1;
+   b->len = len;
+   memcpy(b->bytes, data, len);
+   b->bytes[len] = 0;
+   return b;
+}
+
+SharedBuffer *SharedBuffer::fromJson(json_object *obj) {
+   size_t jlen;
+   const char *json = json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &jlen);
+   return create(json, jlen);
+}
+
 IOException::IOException(const string &msg) {
    this->msg = msg;
 }
@@ -55,6 +88,32 @@ const string &IOException::getMessage() {
    return msg;
 }
 
+void NetworkIO::init(int fd) {
+   this->fd = fd;
+   did_ping = false;
+   ping_val = 0;
+   last_rx = time(NULL);
+   tok = json_tokener_new();
+   rcap = RECV_BUF_INIT;
+   rbuf = (char*)malloc(rcap);
+   rpos = rend = 0;
+   scan_len = 0;
+   scan_depth = 0;
+   scan_str = scan_esc = false;
+   frame_pending = false;
+   writer = NULL;
+   out_head = out_bytes = 0;
+   out_failed = false;
+   sem_init(&outLock, 0, 1);
+}
+
+NetworkIO::~NetworkIO() {
+   close();
+   json_tokener_free(tok);
+   free(rbuf);
+   sem_destroy(&outLock);
+}
+
 bool NetworkIO::writeJson(json_object *obj) {
    size_t jlen;
    const char *json = json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &jlen);
@@ -63,60 +122,291 @@ bool NetworkIO::writeJson(json_object *obj) {
    return true;
 }
 
-json_object *NetworkIO::readJson() {
-   json_object *obj;
-   uint64_t ping_val;
+/*
+ * Returns true if obj is a pong reply to one of our pings
+ */
+bool NetworkIO::checkPong(json_object *obj) {
+   const char *type = string_from_json(obj, "type");
+   if (type == NULL || strcmp(type, "pong") != 0) {
+      return false;
+   }
+   return true;
+}
+
+void NetworkIO::sendPing() {
+   //send a ping to see if they are alive
+   char ping[256];
+   fill_random((unsigned char*)&ping_val, sizeof(ping_val));
+   ping_val &= 0x7fffffffffffffff;  //make sure it's >= 0
+   snprintf(ping, sizeof(ping), "{\"type\":\"ping\",\"id\":%llu}", (long long unsigned int)ping_val);
+   did_ping = true;
+   sendMsg(ping);
+}
+
+/*
+ * waitForData blocks until more data has been received, pinging the peer
+ * if it goes quiet
+ * returns false if the connection has failed or the peer stopped answering pings
+ */
+bool NetworkIO::waitForData() {
    while (true) {
-      bool res = ::readJson(fd, json_buffer, &obj, ping_timeout);
-      if (res) {
-         if (obj == NULL) {
-            //we really can't do anything anymore
-            break;
+      fd_set rset;
+      timeval timeo = {ping_timeout, 0};
+      FD_ZERO(&rset);
+      FD_SET(fd, &rset);
+      int nfds = select(fd + 1, &rset, NULL, NULL, ping_timeout ? &timeo : NULL);
+      if (nfds == 0) {
+         //timed out
+         if (did_ping) {
+            return false;
          }
-         else {
-            //the client remains alive
-            did_ping = false;
-            const char *type = string_from_json(obj, "type");
-            if (strcmp(type, "pong") == 0) {
-               uint64_t val;
-               bool has_id = uint64_from_json(obj, "id", &val);
-               json_object_put(obj);
-               if (has_id) {
-                  if (ping_val != val) {
-                     return NULL;
-                  }
-               }
-               else {
-                  //malformed pong
-                  return NULL;
-               }
-            }
-            else {
-               //not a pong, return object to caller
-               break;
-            }
+         sendPing();
+      }
+      else if (nfds < 0) {
+         if (errno != EINTR) {
+            return false;
          }
       }
       else {
-         //timed out
-         if (did_ping) {
-            return NULL;
+         //recv error or EOF, in any case we quit
+         return recvSome(0) > 0;
+      }
+   }
+}
+
+json_object *NetworkIO::readJson() {
+   json_object *obj;
+   while (true) {
+      if (!nextJson(&obj)) {
+         //we really can't do anything anymore
+         return NULL;
+      }
+      if (obj != NULL) {
+         return obj;
+      }
+      //couldn't build a json object so we need to read more data
+      if (!waitForData()) {
+         return NULL;
+      }
+   }
+}
+
+bool NetworkIO::readFrame(const char **frame, size_t *len) {
+   while (true) {
+      if (!nextFrame(frame, len)) {
+         return false;
+      }
+      if (*frame != NULL) {
+         return true;
+      }
+      if (!waitForData()) {
+         return false;
+      }
+   }
+}
+
+bool NetworkIO::setNonBlocking() {
+   int flags = fcntl(fd, F_GETFL, 0);
+   if (flags == -1) {
+      return false;
+   }
+   return fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+/*
+ * Read whatever is available into the receive buffer.  A read that
+ * fills all of the available space suggests that a large message is
+ * in flight, so the buffer is grown to take bigger bites next time
+ */
+ssize_t NetworkIO::recvSome(int flags) {
+   if (rpos == rend) {
+      //everything has been parsed, start over at the front of the buffer
+      rpos = rend = 0;
+   }
+   else if (rend == rcap && rpos > 0) {
+      memmove(rbuf, rbuf + rpos, rend - rpos);
+      rend -= rpos;
+      rpos = 0;
+   }
+   size_t avail = rcap - rend;
+   if (avail == 0) {
+      if (!frame_pending || rcap >= MAX_FRAME_SIZE) {
+         errno = ENOBUFS;
+         return -1;
+      }
+      //a single message fills the buffer, make room for the rest of it
+      rcap *= 2;
+      rbuf = (char*)realloc(rbuf, rcap);
+      avail = rcap - rend;
+   }
+   ssize_t len = recv(fd, rbuf + rend, avail, flags);
+   if (len > 0) {
+      rend += len;
+      last_rx = time(NULL);
+      if ((size_t)len == avail && rcap < RECV_BUF_MAX) {
+         rcap *= 2;
+         rbuf = (char*)realloc(rbuf, rcap);
+      }
+   }
+   return len;
+}
+
+bool NetworkIO::fill() {
+   while (true) {
+      ssize_t len = recvSome(MSG_DONTWAIT);
+      if (len > 0) {
+         continue;
+      }
+      else if (len == 0) {
+         //EOF
+         return false;
+      }
+      else if (errno == EINTR) {
+         continue;
+      }
+      else if (errno == ENOBUFS) {
+         //leave the rest in the socket until the buffer has been parsed
+         return true;
+      }
+      else {
+         //EAGAIN means we have everything the kernel had for us
+         return errno == EAGAIN || errno == EWOULDBLOCK;
+      }
+   }
+}
+
+/*
+ * scanFrame resumes scanning at the first unscanned byte of the message at
+ * the front of the receive buffer.  Only string and nesting state is tracked,
+ * validating the message is left to whoever consumes it.
+ * returns false if the buffered data can't be the start of a message
+ */
+bool NetworkIO::scanFrame(const char **frame, size_t *len) {
+   *frame = NULL;
+   if (scan_len == 0) {
+      //skip anything between messages
+      while (rpos < rend && (isspace(rbuf[rpos]) || rbuf[rpos] == 0)) {
+         rpos++;
+      }
+      if (rpos == rend) {
+         frame_pending = false;
+         return true;
+      }
+      if (rbuf[rpos] != '{') {
+         log(LERROR, "json parse error: message does not start with an object\n");
+         return false;
+      }
+   }
+   const char *msg = rbuf + rpos;
+   size_t avail = rend - rpos;
+   while (scan_len < avail) {
+      char ch = msg[scan_len++];
+      if (scan_str) {
+         if (scan_esc) {
+            scan_esc = false;
+         }
+         else if (ch == '\\') {
+            scan_esc = true;
+         }
+         else if (ch == '"') {
+            scan_str = false;
          }
-         //send a ping to see if they are alive
-         char ping[256];
-         fill_random((unsigned char*)&ping_val, sizeof(ping_val));
-         ping_val &= 0x7fffffffffffffff;  //make sure it's >= 0
-         snprintf(ping, sizeof(ping), "{\"type\":\"ping\",\"id\":%llu}", (long long unsigned int)ping_val);
-         did_ping = true;
-         sendMsg(ping);
       }
+      else if (ch == '"') {
+         scan_str = true;
+      }
+      else if (ch == '{' || ch == '[') {
+         scan_depth++;
+      }
+      else if ((ch == '}' || ch == ']') && --scan_depth == 0) {
+         *frame = msg;
+         *len = scan_len;
+         rpos += scan_len;
+         scan_len = 0;
+         frame_pending = false;
+         return true;
+      }
+   }
+   frame_pending = true;
+   if (avail >= MAX_FRAME_SIZE) {
+      log(LERROR, "json parse error: message exceeds %u bytes\n", MAX_FRAME_SIZE);
+      return false;
+   }
+   return true;
+}
+
+json_object *NetworkIO::parseFrame(const char *frame, size_t len) {
+   json_object *obj = json_tokener_parse_ex(tok, frame, len);
+   if (obj == NULL) {
+      log(LERROR, "json parse error: %s\n", json_tokener_error_desc(json_tokener_get_error(tok)));
    }
+   json_tokener_reset(tok);
    return obj;
 }
 
-Tcp6IO::Tcp6IO(int fd, sockaddr_in6 &peer) {
+bool NetworkIO::nextFrame(const char **frame, size_t *len) {
+   while (true) {
+      if (!scanFrame(frame, len)) {
+         return false;
+      }
+      if (*frame == NULL) {
+         //need more data
+         return true;
+      }
+      //the client remains alive
+      did_ping = false;
+      if (memmem(*frame, *len, "\"pong\"", 6) == NULL) {
+         //can't be a pong, no need to look any closer
+         return true;
+      }
+      json_object *obj = parseFrame(*frame, *len);
+      if (obj == NULL) {
+         return false;
+      }
+      if (!checkPong(obj)) {
+         json_object_put(obj);
+         return true;
+      }
+      uint64_t val;
+      bool has_id = uint64_from_json(obj, "id", &val);
+      json_object_put(obj);
+      *frame = NULL;
+      if (!has_id || ping_val != val) {
+         //malformed or unexpected pong
+         return false;
+      }
+   }
+}
+
+bool NetworkIO::nextJson(json_object **obj) {
+   const char *frame;
+   size_t len;
+   *obj = NULL;
+   if (!nextFrame(&frame, &len)) {
+      return false;
+   }
+   if (frame != NULL) {
+      *obj = parseFrame(frame, len);
+      return *obj != NULL;
+   }
+   return true;
+}
+
+bool NetworkIO::checkIdle(time_t now) {
+   if (ping_timeout == 0 || (now - last_rx) < ping_timeout) {
+      return true;
+   }
+   if (did_ping) {
+      return false;
+   }
+   //restart the clock so the peer gets a full PING_TIMEOUT to answer
+   last_rx = now;
+   sendPing();
+   return true;
+}
+
+Tcp6IO::Tcp6IO(int fd, sockaddr_in6 &peer) : NetworkIO(fd) {
    this->peer = new sockaddr_in6(peer);
-   this->fd = fd;
 }
 
 Tcp6IO::~Tcp6IO() {
@@ -163,19 +453,197 @@ ssize_t NetworkIO::sendMsg(const char *buf, bool nullflag) {
 /*
  * write size characters from buf to the client socket
  * returns -1 on error or size if all chars were
- * written.
+ * written (or queued when a Writer is in use).
  */
 ssize_t NetworkIO::sendAll(const void *buf, ssize_t size) {
+   if (writer != NULL) {
+      return queueAll((const char*)buf, size, NULL) ? size : -1;
+   }
    ssize_t total = 0;
    const unsigned char *b = (const unsigned char *)buf;
    while (total < size) {
       ssize_t nbytes = ::write(fd, b + total, size - total);
-      if (nbytes == 0) return -1;
+      if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+         //non-blocking (reactor mode) socket is full, wait for the peer to drain it
+         pollfd pfd;
+         pfd.fd = fd;
+         pfd.events = POLLOUT;
+         if (poll(&pfd, 1, ping_timeout ? ping_timeout * 1000 : -1) <= 0) return -1;
+         continue;
+      }
+      if (nbytes <= 0) return -1;
       total += nbytes;
    }
    return total;
 }
 
+/*
+ * Discard all queued output and shut the socket down.  The reader (client
+ * thread or reactor) sees EOF and tears the client down in the usual way.
+ * Caller must hold outLock.
+ */
+void NetworkIO::dropOutput() {
+   out_failed = true;
+   for (deque<SharedBuffer*>::iterator i = outq.begin(); i != outq.end(); i++) {
+      (*i)->unref();
+   }
+   outq.clear();
+   out_head = out_bytes = 0;
+   if (fd != -1) {
+      shutdown(fd, SHUT_RDWR);
+   }
+}
+
+bool NetworkIO::sendBuffer(SharedBuffer *buf) {
+   if (writer == NULL) {
+      return sendAll(buf->data(), buf->length()) == (ssize_t)buf->length();
+   }
+   return queueAll(buf->data(), buf->length(), buf);
+}
+
+/*
+ * queueAll never blocks.  If nothing is already queued it tries the socket
+ * directly and only queues what the socket would not take.  Otherwise the
+ * data goes to the back of the queue to preserve ordering.  When the data
+ * belongs to a SharedBuffer, the buffer itself is queued rather than a copy.
+ */
+bool NetworkIO::queueAll(const char *data, size_t size, SharedBuffer *buf) {
+   size_t done = 0;
+   bool need_watch = false;
+   sem_wait(&outLock);
+   if (out_failed || fd == -1) {
+      sem_post(&outLock);
+      return false;
+   }
+   if (out_bytes == 0) {
+      while (done < size) {
+         ssize_t nbytes = send(fd, data + done, size - done, MSG_DONTWAIT | MSG_NOSIGNAL);
+         if (nbytes > 0) {
+            done += nbytes;
+         }
+         else if (nbytes < 0 && errno == EINTR) {
+            continue;
+         }
+         else if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+         }
+         else {
+            dropOutput();
+            sem_post(&outLock);
+            return false;
+         }
+      }
+   }
+   if (done < size) {
+      if (out_bytes + (size - done) > writer->getLimit()) {
+         log(LERROR, "Outbound queue limit exceeded for %s, disconnecting\n", getPeerAddr().c_str());
+         dropOutput();
+         sem_post(&outLock);
+         return false;
+      }
+      need_watch = out_bytes == 0;
+      if (buf != NULL) {
+         //nothing else is queued when done > 0, so the unsent part starts at out_head
+         outq.push_back(buf->ref());
+         out_head += done;
+      }
+      else {
+         outq.push_back(SharedBuffer::create(data + done, size - done));
+      }
+      out_bytes += size - done;
+   }
+   sem_post(&outLock);
+   if (need_watch) {
+      //must not hold outLock here, the writer takes its own lock before ours
+      writer->watch(this);
+   }
+   return true;
+}
+
+bool NetworkIO::flush() {
+   struct iovec iov[64];
+   sem_wait(&outLock);
+   while (out_bytes > 0) {
+      int niov = 0;
+      size_t skip = out_head;
+      for (deque<SharedBuffer*>::iterator i = outq.begin(); i != outq.end() && niov < 64; i++) {
+         iov[niov].iov_base = (void*)((*i)->data() + skip);
+         iov[niov].iov_len = (*i)->length() - skip;
+         niov++;
+         skip = 0;
+      }
+      msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = niov;
+      ssize_t nbytes = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (nbytes < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            dropOutput();
+         }
+         break;
+      }
+      out_bytes -= nbytes;
+      size_t sent = nbytes;
+      while (sent > 0) {
+         size_t left = outq.front()->length() - out_head;
+         if (sent < left) {
+            out_head += sent;
+            break;
+         }
+         sent -= left;
+         outq.front()->unref();
+         outq.pop_front();
+         out_head = 0;
+      }
+   }
+   bool pending = out_bytes > 0;
+   sem_post(&outLock);
+   return pending;
+}
+
+bool NetworkIO::throttle() {
+   if (writer == NULL) {
+      //blocking output is throttled by the socket itself
+      return fd != -1;
+   }
+   size_t max = writer->getLimit() / 2;
+   sem_wait(&outLock);
+   while (out_bytes > max && !out_failed) {
+      size_t before = out_bytes;
+      sem_post(&outLock);
+      pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = POLLOUT;
+      pfd.revents = 0;
+      if (poll(&pfd, 1, THROTTLE_TIMEOUT_MS) == 0) {
+         log(LERROR, "Client %s stopped accepting data\n", getPeerAddr().c_str());
+         return false;
+      }
+      flush();
+      sem_wait(&outLock);
+      if (out_bytes == before && (pfd.revents & (POLLERR | POLLHUP))) {
+         break;
+      }
+   }
+   bool ok = !out_failed && out_bytes <= max;
+   sem_post(&outLock);
+   return ok;
+}
+
+bool NetworkIO::backlogged() {
+   if (writer == NULL) {
+      return false;
+   }
+   sem_wait(&outLock);
+   bool res = out_bytes > writer->getLimit() / 2;
+   sem_post(&outLock);
+   return res;
+}
+
 ssize_t NetworkIO::sendFormat(const char *format, ...) {
    ssize_t result = 0;
    char *ptr = NULL;
@@ -305,7 +773,22 @@ Tcp6Service::Tcp6Service(const char *host, int port) {
 }
 
 bool NetworkIO::close() {
-   return ::close(fd) == 0;
+   if (writer != NULL) {
+      writer->forget(this);
+   }
+   sem_wait(&outLock);
+   int res = 0;
+   if (fd != -1) {
+      res = ::close(fd);
+      fd = -1;
+   }
+   for (deque<SharedBuffer*>::iterator i = outq.begin(); i != outq.end(); i++) {
+      (*i)->unref();
+   }
+   outq.clear();
+   out_head = out_bytes = 0;
+   sem_post(&outLock);
+   return res == 0;
 }
 
 NetworkService::~NetworkService() {
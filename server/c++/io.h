@@ -22,17 +22,55 @@
 #define __COLLAB_IO_H
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <stdarg.h>
+#include <time.h>
 #include <sys/select.h>
 #include <string>
 #include <vector>
+#include <deque>
+#include <semaphore.h>
 #include <json-c/json.h>
 
 using std::string;
 using std::vector;
+using std::deque;
 
 struct sockaddr_in6;
 class NetworkIO;
+class Writer;
+
+/**
+ * SharedBuffer is an immutable, reference counted block of bytes that is
+ * ready to be written to a socket as is.  An update that is broadcast to
+ * many clients is serialized into one SharedBuffer, and every recipient's
+ * outbound queue references those same bytes.
+ */
+class SharedBuffer {
+public:
+   static SharedBuffer *create(const void *data, size_t len);
+   static SharedBuffer *fromJson(json_object *obj);
+
+   SharedBuffer *ref() {
+      __sync_add_and_fetch(&refs, 1);
+      return this;
+   };
+   void unref() {
+      if (__sync_sub_and_fetch(&refs, 1) == 0) {
+         free(this);
+      }
+   };
+
+   const char *data() {return bytes;};
+   size_t length() {return len;};
+
+private:
+   SharedBuffer();   //only ever allocated by create
+
+   uint32_t refs;
+   size_t len;
+   char bytes[1];
+};
 
 class IOException {
 public:
@@ -44,24 +82,157 @@ private:
 
 class NetworkIO {
 public:
-   NetworkIO() {this->fd = -1; did_ping = false;};
-   NetworkIO(int fd) {this->fd = fd; did_ping = false;};
-   ~NetworkIO() {close();};
+   NetworkIO() {init(-1);};
+   NetworkIO(int fd) {init(fd);};
+   virtual ~NetworkIO();
 
    bool writeJson(json_object *obj);
    ssize_t sendMsg(const char *buf, bool nullflag = 0);
    ssize_t sendAll(const void *buf, ssize_t len);
    ssize_t sendFormat(const char *format, ...);
 
+   /**
+    * sendBuffer sends a shared buffer, referencing rather than copying
+    * its contents if they need to be queued
+    * @param buf the buffer to send
+    * @return false if the connection is no longer usable
+    */
+   bool sendBuffer(SharedBuffer *buf);
+
    json_object *readJson();
+
+   /**
+    * readFrame is readJson for callers that want the raw message, it blocks
+    * until a complete message arrives
+    * @param frame receives the message, which points into the receive buffer
+    * and is only valid until the next read from this connection
+    * @param len receives the length of the message
+    * @return false if the connection failed or sent malformed data
+    */
+   bool readFrame(const char **frame, size_t *len);
+
+   /**
+    * parseFrame builds the json object for a message returned by readFrame or nextFrame
+    * @return the object, or NULL if the message is not valid json
+    */
+   json_object *parseFrame(const char *frame, size_t len);
+
    int getPeerPort();
    string getPeerAddr();
    bool close();
+
+   /**
+    * The following form the non-blocking interface used by the Reactor
+    */
+   int getFd() {return fd;};
+   bool setNonBlocking();
+
+   /**
+    * fill drains everything currently readable from the socket into the
+    * receive buffer without blocking
+    * @return false if the peer has closed the connection or an error occurred
+    */
+   bool fill();
+
+   /**
+    * nextJson extracts the next complete json object from the receive buffer,
+    * consuming any pong replies along the way
+    * @param obj receives the next object, or NULL if no complete object is buffered
+    * @return false if the buffered data is malformed
+    */
+   bool nextJson(json_object **obj);
+
+   /**
+    * nextFrame is nextJson without the parsing.  Messages are delimited by
+    * matching braces and returned as the bytes that were received.
+    * @param frame receives the next message, or NULL if no complete message
+    * is buffered.  It points into the receive buffer and is only valid until
+    * the next read from this connection
+    * @param len receives the length of the message
+    * @return false if the buffered data is malformed
+    */
+   bool nextFrame(const char **frame, size_t *len);
+
+   /**
+    * checkIdle pings an idle peer once PING_TIMEOUT seconds pass without any traffic
+    * @param now the current time
+    * @return false if a previous ping went unanswered
+    */
+   bool checkIdle(time_t now);
+
+   /**
+    * setWriter switches this connection to queued, non-blocking output.
+    * Anything the socket can't take immediately is queued (up to the
+    * writer's limit) and drained by the writer thread
+    * @param w the writer responsible for this connection
+    */
+   void setWriter(Writer *w) {writer = w;};
+
+   /**
+    * flush writes as much queued output as the socket will take without blocking
+    * @return true if output remains queued
+    */
+   bool flush();
+
+   /**
+    * throttle is for bulk senders.  It blocks, flushing as the socket allows,
+    * until at most half of the writer's limit is queued, so a large transfer
+    * can be fed in pieces without ever pushing the client over the limit.
+    * @return false if the connection failed or made no progress for too long
+    */
+   bool throttle();
+
+   /**
+    * backlogged is throttle for callers that must not block
+    * @return true while more than half of the writer's limit is queued
+    */
+   bool backlogged();
+
+   /**
+    * getQueued returns the number of bytes waiting in the outbound queue
+    */
+   size_t getQueued() {return out_bytes;};
+
 protected:
+   void init(int fd);
+
    int fd;
 private:
-   string json_buffer;
+   bool checkPong(json_object *obj);
+   void sendPing();
+   bool scanFrame(const char **frame, size_t *len);
+   bool waitForData();
+   ssize_t recvSome(int flags);
+   bool queueAll(const char *data, size_t len, SharedBuffer *buf);
+   void dropOutput();
+
+   json_tokener *tok;
+
+   //receive buffer, bytes in [rpos, rend) have not been consumed yet
+   char *rbuf;
+   size_t rcap;
+   size_t rpos;
+   size_t rend;
+
+   //progress through a partially received message starting at rpos, kept
+   //so that bytes are only scanned once no matter how many reads it takes
+   size_t scan_len;
+   int scan_depth;
+   bool scan_str;
+   bool scan_esc;
+   bool frame_pending;   //the buffer ends with an incomplete message
+
    bool did_ping;
+   uint64_t ping_val;
+   time_t last_rx;
+
+   //outbound queue, the first out_head bytes of the front buffer have already been sent
+   Writer *writer;
+   deque<SharedBuffer*> outq;
+   size_t out_head;
+   size_t out_bytes;
+   bool out_failed;
+   sem_t outLock;
 };
 
 class NetworkService {
@@ -184,6 +184,8 @@ void ManagerHelper::init_handlers() {
    (*handlers)[MNG_IMPORT_UPDATE] = mng_import_update;
    (*handlers)[MNG_PROJECT_LIST] = mng_project_list;
    (*handlers)[MNG_PROJECT_EXPORT] = mng_project_export;
+   (*handlers)[MNG_COMPACT] = mng_compact;
+   (*handlers)[MNG_SET_LIMITS] = mng_set_limits;
 }
 
 void ManagerHelper::mng_get_connections(json_object *obj, ManagerHelper *mh) {
@@ -202,6 +204,46 @@ void ManagerHelper::mng_get_stats(json_object *obj, ManagerHelper *mh) {
    mh->send_data(MNG_STATS, out);
 }
 
+void ManagerHelper::mng_compact(json_object *obj, ManagerHelper *mh) {
+   uint32_t pid = 0;
+   uint32_from_json(obj, "pid", &pid);
+   log(LINFO, "compacting %s\n", pid ? "project" : "all projects");
+   int64_t n = mh->cm->compact(pid);
+   json_object *out = json_object_new_object();
+   json_object_object_add_ex(out, "superseded", json_object_new_int64(n), JSON_NEW_CONST_KEY);
+   mh->send_data(MNG_COMPACT_REPLY, out);
+}
+
+/**
+ * mng_set_limits changes whichever rate limits are present in the request
+ * and replies with the limits now in force, so an empty request is a query
+ */
+void ManagerHelper::mng_set_limits(json_object *obj, ManagerHelper *mh) {
+   RateLimits l = mh->cm->getRateLimits();
+   bool changed = false;
+   changed |= uint32_from_json(obj, "client_msgs", &l.client_msgs);
+   changed |= uint32_from_json(obj, "client_bytes", &l.client_bytes);
+   changed |= uint32_from_json(obj, "project_msgs", &l.project_msgs);
+   changed |= uint32_from_json(obj, "project_bytes", &l.project_bytes);
+   changed |= uint32_from_json(obj, "burst_ms", &l.burst_ms);
+   const char *action = string_from_json(obj, "action");
+   if (action != NULL) {
+      l.reject = strcmp(action, "reject") == 0;
+      changed = true;
+   }
+   if (changed) {
+      mh->cm->setRateLimits(l);
+   }
+   json_object *out = json_object_new_object();
+   json_object_object_add_ex(out, "client_msgs", json_object_new_int64(l.client_msgs), JSON_NEW_CONST_KEY);
+   json_object_object_add_ex(out, "client_bytes", json_object_new_int64(l.client_bytes), JSON_NEW_CONST_KEY);
+   json_object_object_add_ex(out, "project_msgs", json_object_new_int64(l.project_msgs), JSON_NEW_CONST_KEY);
+   json_object_object_add_ex(out, "project_bytes", json_object_new_int64(l.project_bytes), JSON_NEW_CONST_KEY);
+   json_object_object_add_ex(out, "burst_ms", json_object_new_int64(l.burst_ms), JSON_NEW_CONST_KEY);
+   json_object_object_add_ex(out, "action", json_object_new_string(l.reject ? "reject" : "delay"), JSON_NEW_CONST_KEY);
+   mh->send_data(MNG_LIMITS, out);
+}
+
 void ManagerHelper::shutdown() {
    done = true;
    log(LINFO, "client requested server shutdown\n");
@@ -100,6 +100,8 @@ private:
    static void mng_import_update(json_object *obj, ManagerHelper *mh);
    static void mng_project_list(json_object *obj, ManagerHelper *mh);
    static void mng_project_export(json_object *obj, ManagerHelper *mh);
+   static void mng_compact(json_object *obj, ManagerHelper *mh);
+   static void mng_set_limits(json_object *obj, ManagerHelper *mh);
 
    void init_handlers();
 
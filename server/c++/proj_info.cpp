@@ -18,9 +18,17 @@
    Place, Suite 330, Boston, MA 02111-1307 USA
  */
 
+#include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include "proj_info.h"
 
+//memory is taken for updates this many bytes at a time
+#define ARENA_SIZE (1024 * 1024)
+
+//records between entries in the arena index
+#define ARENA_INDEX_INTERVAL 32
+
 sem_t uidMutex;
 
 Project::Project(uint32_t localpid, const string &description, uint32_t currentlyconnected) {
@@ -34,6 +42,7 @@ Project::Project(uint32_t localpid, const string &description, uint32_t currentl
    proto = 0;
    hash = "";
    gpid = "";
+   loaded = 0;
 }
 
 Project::Project(const Project &p) {
@@ -43,7 +52,10 @@ Project::Project(const Project &p) {
 BasicProject::BasicProject(uint32_t localpid, const string &description, uint32_t currentlyconnected, uint64_t init_uid) :
          Project(localpid, description, currentlyconnected) {
    updateid = init_uid;
+   updateLog = NULL;
+   records = 0;
    sem_init(&uidMutex, 0, 1);
+   sem_init(&postMutex, 0, 1);
 }
 
 BasicProject::BasicProject(const BasicProject &bp) {
@@ -51,9 +63,10 @@ BasicProject::BasicProject(const BasicProject &bp) {
 }
 
 BasicProject::~BasicProject() {
-   for (vector<char*>::iterator i = updates.begin(); i != updates.end(); i++) {
-      free(*i);
+   for (vector<Arena>::iterator i = arenas.begin(); i != arenas.end(); i++) {
+      free((*i).base);
    }
+   delete updateLog;
 }
 
 uint64_t BasicProject::next_uid() {
@@ -64,7 +77,90 @@ uint64_t BasicProject::next_uid() {
    return result;
 }
 
-void BasicProject::append_update(const char *update) {
-   updates.push_back(strdup(update));
+uint64_t BasicProject::curr_uid() {
+   uint64_t result;
+   sem_wait(&uidMutex);
+   result = updateid;
+   sem_post(&uidMutex);
+   return result;
+}
+
+void BasicProject::advance_uid(uint64_t id) {
+   sem_wait(&uidMutex);
+   if (id > updateid) {
+      updateid = id;
+   }
+   sem_post(&uidMutex);
 }
 
+void BasicProject::attach(UpdateLog *log) {
+   updateLog = log;
+   advance_uid(log->lastId());
+}
+
+bool BasicProject::append_update(uint64_t updateid, uint32_t cmd, const char *update, size_t len, bool sync) {
+   if (updateLog) {
+      return updateLog->append(updateid, cmd, update, len, sync);
+   }
+   RecordHeader hdr;
+   hdr.updateid = updateid;
+   hdr.cmd = cmd;
+   hdr.len = (uint32_t)len;
+   size_t need = sizeof(hdr) + len;
+   sem_wait(&uidMutex);
+   if (arenas.empty() || arenas.back().size - arenas.back().used < need) {
+      Arena a;
+      a.size = need > ARENA_SIZE ? need : ARENA_SIZE;
+      a.base = (char*)malloc(a.size);
+      a.used = 0;
+      arenas.push_back(a);
+   }
+   Arena &a = arenas.back();
+   if ((records++ % ARENA_INDEX_INTERVAL) == 0) {
+      IndexEntry e;
+      e.updateid = updateid;
+      e.arena = (uint32_t)(arenas.size() - 1);
+      e.offset = (uint32_t)a.used;
+      index.push_back(e);
+   }
+   memcpy(a.base + a.used, &hdr, sizeof(hdr));
+   memcpy(a.base + a.used + sizeof(hdr), update, len);
+   a.used += need;
+   sem_post(&uidMutex);
+   return true;
+}
+
+void BasicProject::scan(uint64_t after, UpdateLog::Visitor visit, void *user) {
+   if (updateLog) {
+      updateLog->scan(after, visit, user);
+      return;
+   }
+   //records are never moved or freed while the project exists, so only the
+   //extent of each arena still to be visited needs copying
+   sem_wait(&uidMutex);
+   vector<IndexEntry>::iterator ie = lower_bound(index.begin(), index.end(), after + 1);
+   if (ie != index.begin()) {
+      ie--;
+   }
+   vector<Arena> pending;
+   uint32_t offset = 0;
+   if (ie != index.end()) {
+      pending.assign(arenas.begin() + (*ie).arena, arenas.end());
+      offset = (*ie).offset;
+   }
+   sem_post(&uidMutex);
+   for (vector<Arena>::iterator i = pending.begin(); i != pending.end(); i++) {
+      const char *p = (*i).base + offset;
+      const char *end = (*i).base + (*i).used;
+      while (p < end) {
+         RecordHeader hdr;
+         memcpy(&hdr, p, sizeof(hdr));
+         p += sizeof(hdr);
+         if (hdr.updateid > after && !visit(hdr.updateid, hdr.cmd, p, hdr.len, user)) {
+            return;
+         }
+         p += hdr.len;
+      }
+      offset = 0;
+   }
+}
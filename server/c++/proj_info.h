@@ -22,9 +22,11 @@
 #define __PROJ_INFO_H
 
 #include <stdint.h>
+#include <time.h>
 #include <semaphore.h>
 #include <string>
 #include <vector>
+#include "update_log.h"
 
 using namespace std;
 
@@ -45,6 +47,7 @@ public:
    uint32_t proto;
    string hash;
    string gpid;
+   time_t loaded;   //when the metadata was last read from the database, 0 if it needs reading
 
    Project(uint32_t localpid, const string &description, uint32_t currentlyconnected = 0);
    Project(const Project &pi);
@@ -66,13 +69,76 @@ public:
    uint64_t next_uid();
    uint64_t curr_uid();
 
-   void append_update(const char *update);
-   const vector<char*> &get_updates() {return updates;};
+   /**
+    * attach hands the project a durable log, which it takes ownership of.
+    * Updates are then written to the log rather than held in memory, and
+    * updateids continue on from the last one in the log.
+    */
+   void attach(UpdateLog *log);
+   UpdateLog *getLog() {return updateLog;};
+
+   /**
+    * lock and unlock bracket the allocation of an updateid and the archiving
+    * of its update so that updates reach the log in updateid order
+    */
+   void lock() {sem_wait(&postMutex);};
+   void unlock() {sem_post(&postMutex);};
+
+   /**
+    * append_update archives a serialized update
+    * @param sync false if more updates that belong with this one follow
+    * @return false if the update could not be stored
+    */
+   bool append_update(uint64_t updateid, uint32_t cmd, const char *update, size_t len, bool sync = true);
+
+   /**
+    * advance_uid makes sure future updateids follow an imported one
+    */
+   void advance_uid(uint64_t updateid);
+
+   /**
+    * scan visits every archived update with an updateid greater than after.
+    * Its cost depends on the number of updates visited, not the size of the project.
+    */
+   void scan(uint64_t after, UpdateLog::Visitor visit, void *user);
 
 private:
    sem_t uidMutex;
+   sem_t postMutex;
+   /*
+    * Without a log, updates are held in memory as records packed end to end
+    * in large arenas.  A record is a RecordHeader followed by the update and
+    * never spans two arenas.
+    */
+   struct RecordHeader {
+      uint64_t updateid;
+      uint32_t cmd;
+      uint32_t len;
+   };
+
+   struct Arena {
+      char *base;
+      size_t size;
+      size_t used;
+   };
+
+   /*
+    * One IndexEntry is kept for every ARENA_INDEX_INTERVAL records, in
+    * updateid order, so a catch-up can binary search for where to start.
+    */
+   struct IndexEntry {
+      uint64_t updateid;
+      uint32_t arena;
+      uint32_t offset;
+
+      bool operator<(uint64_t id) const {return updateid < id;};
+   };
+
    uint64_t updateid;
-   vector<char*> updates;
+   vector<Arena> arenas;       //only used when there is no log
+   vector<IndexEntry> index;
+   uint64_t records;
+   UpdateLog *updateLog;
 };
 
 #endif
@@ -23,27 +23,26 @@
 #include "clientset.h"
 
 ProjectMap::ProjectMap() {
-   pthread_mutexattr_t attr;
-   pthread_mutexattr_init(&attr);
-   pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-   pthread_mutex_init(&mutex, &attr);
-   pthread_mutexattr_destroy(&attr);
+   projects = new map<uint32_t,ClientSet*>;
+   pthread_mutex_init(&mutex, NULL);
 }
 
 ProjectMap::~ProjectMap() {
+   delete projects;
    pthread_mutex_destroy(&mutex);
 }
 
 //iterate over all projects in the set
 void ProjectMap::loop(pcb func, void *user) {
-   pthread_mutex_lock(&mutex);
-   for (map<uint32_t,ClientSet*>::iterator i = projects.begin(); i != projects.end(); i++) {
+   uint32_t token = epoch.enter();
+   map<uint32_t,ClientSet*> *snap = __atomic_load_n(&projects, __ATOMIC_ACQUIRE);
+   for (map<uint32_t,ClientSet*>::iterator i = snap->begin(); i != snap->end(); i++) {
       ClientSet *s = (*i).second;
       if (!(*func)(s, user)) {
          break;
       }
    }
-   pthread_mutex_unlock(&mutex);
+   epoch.leave(token);
 }
 
 //loop across all clients in a single project
@@ -56,89 +55,95 @@ void ProjectMap::loopProject(uint32_t key, ccb func, void *user) {
 
 //loop across all clients in all projects
 void ProjectMap::loopClients(ccb func, void *user) {
-   pthread_mutex_lock(&mutex);
-   for (map<uint32_t,ClientSet*>::iterator i = projects.begin(); i != projects.end(); i++) {
+   uint32_t token = epoch.enter();
+   map<uint32_t,ClientSet*> *snap = __atomic_load_n(&projects, __ATOMIC_ACQUIRE);
+   for (map<uint32_t,ClientSet*>::iterator i = snap->begin(); i != snap->end(); i++) {
       ClientSet *s = (*i).second;
       s->loop(func, user);
    }
-   pthread_mutex_unlock(&mutex);
+   epoch.leave(token);
+}
+
+void ProjectMap::allClients(vector<Client*> &out) {
+   uint32_t token = epoch.enter();
+   map<uint32_t,ClientSet*> *snap = __atomic_load_n(&projects, __ATOMIC_ACQUIRE);
+   for (map<uint32_t,ClientSet*>::iterator i = snap->begin(); i != snap->end(); i++) {
+      (*i).second->members(out);
+   }
+   epoch.leave(token);
+}
+
+//swap in a copy of the map with key set to val
+//call this only while holding mutex
+void ProjectMap::putPriv(uint32_t key, ClientSet *val) {
+   map<uint32_t,ClientSet*> *old = projects;
+   map<uint32_t,ClientSet*> *next = new map<uint32_t,ClientSet*>(*old);
+   (*next)[key] = val;
+   __atomic_store_n(&projects, next, __ATOMIC_RELEASE);
+   epoch.synchronize();
+   delete old;
 }
 
 //add a new project
 void ProjectMap::put(uint32_t key, ClientSet *val) {
    pthread_mutex_lock(&mutex);
-   projects[key] = val;
+   putPriv(key, val);
    pthread_mutex_unlock(&mutex);
 }
 
-//call this only if you already hold a lock
-ClientSet *ProjectMap::getPriv(uint32_t key) {
-   ClientSet *res = NULL;
-   map<uint32_t,ClientSet*>::iterator it = projects.find(key);
-   if (it != projects.end()) {
-      res = (*it).second;
+//get the client set for a project, creating it if necessary
+ClientSet *ProjectMap::getOrCreate(uint32_t key) {
+   ClientSet *proj = get(key);
+   if (proj == NULL) {
+      pthread_mutex_lock(&mutex);
+      //check again, someone may have beaten us to it
+      map<uint32_t,ClientSet*>::iterator it = projects->find(key);
+      if (it != projects->end()) {
+         proj = (*it).second;
+      }
+      else {
+         proj = new ClientSet;
+         putPriv(key, proj);
+      }
+      pthread_mutex_unlock(&mutex);
    }
-   return res;
+   return proj;
 }
 
 //add client to the given project
 void ProjectMap::addClient(uint32_t key, Client *c) {
-   pthread_mutex_lock(&mutex);
-   ClientSet *proj = getPriv(key);
-   if (proj == NULL) {
-      proj = new ClientSet;
-      //already have a lock don't neet to call put
-      projects[key] = proj;
-   }
-   proj->add(c);
-   pthread_mutex_unlock(&mutex);
+   getOrCreate(key)->add(c);
 }
 
 //add client to the given project
 void ProjectMap::addClient(Client *c) {
-   pthread_mutex_lock(&mutex);
-   ClientSet *proj = getPriv(c->getPid());
-   if (proj == NULL) {
-      proj = new ClientSet;
-      //already have a lock don't neet to call put
-      projects[c->getPid()] = proj;
-   }
-   proj->add(c);
-   pthread_mutex_unlock(&mutex);
+   getOrCreate(c->getPid())->add(c);
 }
 
 //add client to the given project
 void ProjectMap::removeClient(Client *c) {
-   pthread_mutex_lock(&mutex);
-   ClientSet *proj = getPriv(c->getPid());
+   ClientSet *proj = get(c->getPid());
    if (proj != NULL) {
       proj->remove(c);
    }
-   pthread_mutex_unlock(&mutex);
 }
 
 //number of clients connected to the given project
 int ProjectMap::numClients(uint32_t key) {
-   int res = 0;
-   pthread_mutex_lock(&mutex);
-   ClientSet *proj = getPriv(key);
-   if (proj != NULL) {
-      res = proj->size();
-   }
-   pthread_mutex_unlock(&mutex);
-   return res;
+   ClientSet *proj = get(key);
+   return proj ? proj->size() : 0;
 }
 
 //get the list of clients connected to the given project
-//should this be a cloned set ?? probably
+//ClientSets live as long as the ProjectMap so the result may be used without a lock
 ClientSet *ProjectMap::get(uint32_t key) {
    ClientSet *res = NULL;
-   pthread_mutex_lock(&mutex);
-   map<uint32_t,ClientSet*>::iterator it = projects.find(key);
-   if (it != projects.end()) {
+   uint32_t token = epoch.enter();
+   map<uint32_t,ClientSet*> *snap = __atomic_load_n(&projects, __ATOMIC_ACQUIRE);
+   map<uint32_t,ClientSet*>::iterator it = snap->find(key);
+   if (it != snap->end()) {
       res = (*it).second;
    }
-   pthread_mutex_unlock(&mutex);
+   epoch.leave(token);
    return res;
 }
-
@@ -29,6 +29,8 @@
 #include <sys/types.h>
 #include <pthread.h>
 
+#include "epoch.h"
+
 class ClientSet;
 class Client;
 
@@ -39,12 +41,20 @@ typedef bool (*pcb)(ClientSet *c, void *user);
 //client callback function
 typedef bool (*ccb)(Client *c, void *user);
 
+/**
+ * ProjectMap maps local project ids to the set of clients subscribed to each
+ * project.  Like ClientSet, the map is an immutable snapshot replaced
+ * copy-on-write when a project is added, so lookups and loops take no
+ * locks.  ClientSets are never removed once created.
+ */
 class ProjectMap {
 private:
-   map<uint32_t,ClientSet*> projects;
-   pthread_mutex_t mutex;
+   map<uint32_t,ClientSet*> *projects;
+   pthread_mutex_t mutex;   //serializes writers only
+   Epoch epoch;
 
-   ClientSet *getPriv(uint32_t key);
+   ClientSet *getOrCreate(uint32_t key);
+   void putPriv(uint32_t key, ClientSet *val);
 
 public:
    ProjectMap();
@@ -62,6 +72,8 @@ public:
    void loopProject(uint32_t key, ccb func, void *user);
    //loop across all clients in all projects
    void loopClients(ccb func, void *user);
+   //copy every client in every project, for callers that need to modify membership
+   void allClients(vector<Client*> &out);
 
 };
 
@@ -0,0 +1,113 @@
+/*
+   collabREate ratelimit.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "ratelimit.h"
+#include "utils.h"
+
+TokenBucket::TokenBucket() {
+   level = 0;
+   capacity = 0;
+   last_us = 0;
+}
+
+void TokenBucket::refill(uint32_t rate, uint32_t burst_ms, uint64_t now) {
+   if (rate == 0) {
+      return;
+   }
+   capacity = rate * (burst_ms / 1000.0);
+   if (capacity < 1) {
+      capacity = 1;
+   }
+   if (last_us == 0) {
+      //new buckets start full
+      level = capacity;
+   }
+   else if (now > last_us) {
+      level += (now - last_us) * (rate / 1000000.0);
+      if (level > capacity) {
+         level = capacity;
+      }
+   }
+   last_us = now;
+}
+
+uint64_t TokenBucket::wait(double cost, uint32_t rate) {
+   if (cost > capacity) {
+      //a message larger than the whole bucket gets through once the bucket is full
+      cost = capacity;
+   }
+   if (rate == 0 || level >= cost) {
+      return 0;
+   }
+   return (uint64_t)((cost - level) * 1000000.0 / rate) + 1;
+}
+
+void TokenBucket::take(double cost, uint32_t rate) {
+   if (rate != 0) {
+      level -= cost;
+   }
+}
+
+void TokenBucket::refund(double cost, uint32_t rate) {
+   if (rate != 0) {
+      level += cost;
+      if (level > capacity) {
+         level = capacity;
+      }
+   }
+}
+
+RateLimiter::RateLimiter() {
+   sem_init(&lock, 0, 1);
+}
+
+RateLimiter::~RateLimiter() {
+   sem_destroy(&lock);
+}
+
+uint64_t RateLimiter::take(uint32_t msg_rate, uint32_t byte_rate, uint32_t burst_ms,
+                           uint32_t n, size_t len, bool force) {
+   uint64_t now = monotonic_us();
+   sem_wait(&lock);
+   msgs.refill(msg_rate, burst_ms, now);
+   bytes.refill(byte_rate, burst_ms, now);
+   if (!force) {
+      uint64_t w1 = msgs.wait(n, msg_rate);
+      uint64_t w2 = bytes.wait(len, byte_rate);
+      uint64_t w = w1 > w2 ? w1 : w2;
+      if (w != 0) {
+         sem_post(&lock);
+         return w;
+      }
+   }
+   msgs.take(n, msg_rate);
+   bytes.take(len, byte_rate);
+   uint64_t w1 = msgs.wait(0, msg_rate);
+   uint64_t w2 = bytes.wait(0, byte_rate);
+   sem_post(&lock);
+   return w1 > w2 ? w1 : w2;
+}
+
+void RateLimiter::refund(uint32_t msg_rate, uint32_t byte_rate, uint32_t n, size_t len) {
+   sem_wait(&lock);
+   msgs.refund(n, msg_rate);
+   bytes.refund(len, byte_rate);
+   sem_post(&lock);
+}
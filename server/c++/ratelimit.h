@@ -0,0 +1,113 @@
+/*
+   collabREate ratelimit.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __RATE_LIMIT_H
+#define __RATE_LIMIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <semaphore.h>
+
+/**
+ * RateLimits holds the configured publishing limits.  A rate of 0 means
+ * unlimited.  Buckets are handed the current limits on every call, so a
+ * change made through the management port applies to existing clients.
+ */
+struct RateLimits {
+   uint32_t client_msgs;    //updates per second from one client
+   uint32_t client_bytes;   //bytes per second from one client
+   uint32_t project_msgs;   //updates per second into one project
+   uint32_t project_bytes;  //bytes per second into one project
+   uint32_t burst_ms;       //how many milliseconds of traffic a full bucket holds
+   bool reject;             //discard excess updates rather than delaying them
+};
+
+/**
+ * TokenBucket
+ * A single token bucket.  It starts full, refills at rate tokens per second
+ * and holds at most rate * burst_ms / 1000 tokens.  The level may go
+ * negative, in which case the owner is in debt until it refills.
+ */
+class TokenBucket {
+public:
+   TokenBucket();
+
+   /**
+    * refill adds the tokens earned since the last refill
+    * @param rate tokens per second, 0 for unlimited
+    * @param burst_ms the bucket capacity expressed as time at rate
+    * @param now the current time from monotonic_us
+    */
+   void refill(uint32_t rate, uint32_t burst_ms, uint64_t now);
+
+   /**
+    * wait returns how long until the bucket holds at least cost tokens, or
+    * is full if cost exceeds its capacity
+    * @return microseconds, 0 if cost tokens are available now
+    */
+   uint64_t wait(double cost, uint32_t rate);
+
+   void take(double cost, uint32_t rate);
+
+   /**
+    * refund returns tokens taken for something that was not sent after all
+    */
+   void refund(double cost, uint32_t rate);
+
+private:
+   double level;
+   double capacity;
+   uint64_t last_us;
+};
+
+/**
+ * RateLimiter
+ * Pairs a message bucket with a byte bucket.  Safe to share between threads.
+ */
+class RateLimiter {
+public:
+   RateLimiter();
+   ~RateLimiter();
+
+   /**
+    * take charges msgs messages totalling len bytes against the buckets
+    * @param msg_rate messages per second, 0 for unlimited
+    * @param byte_rate bytes per second, 0 for unlimited
+    * @param burst_ms the bucket capacity expressed as time at each rate
+    * @param force charge even if that puts the buckets into debt
+    * @return 0 if the charge left the buckets in credit.  Otherwise the
+    * microseconds until they are out of debt (force) or until the charge
+    * would fit, in which case nothing was taken (!force)
+    */
+   uint64_t take(uint32_t msg_rate, uint32_t byte_rate, uint32_t burst_ms,
+                 uint32_t msgs, size_t len, bool force);
+
+   /**
+    * refund gives back a successful take whose messages were then discarded
+    */
+   void refund(uint32_t msg_rate, uint32_t byte_rate, uint32_t msgs, size_t len);
+
+private:
+   TokenBucket msgs;
+   TokenBucket bytes;
+   sem_t lock;
+};
+
+#endif
@@ -0,0 +1,282 @@
+/*
+   collabREate reactor.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "reactor.h"
+#include "client.h"
+#include "io.h"
+#include "utils.h"
+
+//maximum number of events to collect in a single epoll_wait
+#define MAX_EVENTS 64
+
+//how often (in seconds) each worker checks its clients for idle timeouts
+#define SWEEP_INTERVAL 5
+
+//stack size for reactor threads
+#define REACTOR_STACK_SIZE (512 * 1024)
+
+Reactor::Reactor(int nthreads) {
+   next = 0;
+   done = false;
+   sem_init(&nextLock, 0, 1);
+   if (nthreads < 1) {
+      nthreads = 1;
+   }
+   for (int i = 0; i < nthreads; i++) {
+      Worker *w = new Worker;
+      w->reactor = this;
+      w->epfd = epoll_create1(EPOLL_CLOEXEC);
+      if (w->epfd == -1) {
+         log(LERROR, "Reactor: epoll_create1 failed: %s\n", strerror(errno));
+         delete w;
+         continue;
+      }
+      w->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+      epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN;
+      ev.data.ptr = NULL;   //never a client
+      if (w->wakefd == -1 || epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wakefd, &ev) == -1) {
+         log(LERROR, "Reactor: failed to create wakeup eventfd: %s\n", strerror(errno));
+         if (w->wakefd != -1) {
+            ::close(w->wakefd);
+         }
+         ::close(w->epfd);
+         delete w;
+         continue;
+      }
+      w->started = false;
+      sem_init(&w->lock, 0, 1);
+      workers.push_back(w);
+   }
+}
+
+Reactor::~Reactor() {
+   terminate();
+   for (vector<Worker*>::iterator i = workers.begin(); i != workers.end(); i++) {
+      ::close((*i)->wakefd);
+      ::close((*i)->epfd);
+      sem_destroy(&(*i)->lock);
+      delete *i;
+   }
+   sem_destroy(&nextLock);
+}
+
+void Reactor::start() {
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   //workers stay joinable so that terminate can wait for them
+   pthread_attr_setstacksize(&attr, REACTOR_STACK_SIZE);
+   for (vector<Worker*>::iterator i = workers.begin(); i != workers.end(); i++) {
+      (*i)->started = pthread_create(&(*i)->tid, &attr, run, (void*)*i) == 0;
+   }
+   pthread_attr_destroy(&attr);
+   log(LINFO, "Reactor started with %u threads\n", (uint32_t)workers.size());
+}
+
+void Reactor::terminate() {
+   __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+   for (vector<Worker*>::iterator i = workers.begin(); i != workers.end(); i++) {
+      uint64_t one = 1;
+      if (write((*i)->wakefd, &one, sizeof(one)) != sizeof(one)) {
+         log(LERROR, "Reactor: failed to wake worker: %s\n", strerror(errno));
+      }
+   }
+   for (vector<Worker*>::iterator i = workers.begin(); i != workers.end(); i++) {
+      if ((*i)->started) {
+         pthread_join((*i)->tid, NULL);
+         (*i)->started = false;
+      }
+   }
+}
+
+/**
+ * add assigns a newly authenticated client to one of the worker
+ * threads in round robin fashion
+ */
+bool Reactor::add(Client *c) {
+   if (workers.size() == 0) {
+      return false;
+   }
+   NetworkIO *nio = c->getConnection();
+   if (!nio->setNonBlocking()) {
+      log(LERROR, "Reactor: failed to make client socket non-blocking\n");
+      return false;
+   }
+   sem_wait(&nextLock);
+   Worker *w = workers[next++ % workers.size()];
+   sem_post(&nextLock);
+
+   sem_wait(&w->lock);
+   w->clients.insert(c);
+   sem_post(&w->lock);
+
+   epoll_event ev;
+   memset(&ev, 0, sizeof(ev));
+   ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+   ev.data.ptr = c;
+   if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, nio->getFd(), &ev) == -1) {
+      log(LERROR, "Reactor: epoll_ctl add failed: %s\n", strerror(errno));
+      sem_wait(&w->lock);
+      w->clients.erase(c);
+      sem_post(&w->lock);
+      return false;
+   }
+   return true;
+}
+
+size_t Reactor::size() {
+   size_t total = 0;
+   for (vector<Worker*>::iterator i = workers.begin(); i != workers.end(); i++) {
+      sem_wait(&(*i)->lock);
+      total += (*i)->clients.size();
+      sem_post(&(*i)->lock);
+   }
+   return total;
+}
+
+/**
+ * drop disconnects a client, removes it from the connection manager
+ * and releases it.  Only ever called from the client's worker thread.
+ */
+void Reactor::drop(Worker *w, Client *c) {
+   w->deferred.erase(make_pair(c->throttledUntil(), c));
+   epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->getConnection()->getFd(), NULL);
+   sem_wait(&w->lock);
+   w->clients.erase(c);
+   sem_post(&w->lock);
+   log(LINFO, "Client loop has ended\n");
+   c->terminate();
+   delete c;
+}
+
+/**
+ * sweep pings clients that have been idle for PING_TIMEOUT seconds and
+ * drops clients that failed to answer a previous ping
+ */
+void Reactor::sweep(Worker *w, time_t now) {
+   vector<Client*> idle;
+   sem_wait(&w->lock);
+   for (set<Client*>::iterator i = w->clients.begin(); i != w->clients.end(); i++) {
+      idle.push_back(*i);
+   }
+   sem_post(&w->lock);
+   for (vector<Client*>::iterator i = idle.begin(); i != idle.end(); i++) {
+      if (!(*i)->checkIdle(now)) {
+         log(LINFO, "Reactor: dropping unresponsive client\n");
+         drop(w, *i);
+      }
+   }
+}
+
+/**
+ * rearm waits for more input from a client that has handled everything it
+ * could, unless the client is over its rate limit, in which case its socket
+ * stays disarmed until resume picks it up.  A client that is catching up
+ * waits for its socket to drain instead.
+ */
+void Reactor::rearm(Worker *w, Client *c) {
+   uint64_t until = c->throttledUntil();
+   if (until != 0) {
+      w->deferred.insert(make_pair(until, c));
+      return;
+   }
+   epoll_event ev;
+   memset(&ev, 0, sizeof(ev));
+   //no EPOLLRDHUP while writing, a half closed peer would wake us continually
+   ev.events = c->catchingUp() ? EPOLLOUT | EPOLLONESHOT : EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+   ev.data.ptr = c;
+   epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->getConnection()->getFd(), &ev);
+}
+
+/**
+ * resume lets throttled clients whose delay has expired carry on with the
+ * messages they already have buffered
+ */
+void Reactor::resume(Worker *w) {
+   uint64_t now = monotonic_us();
+   while (!w->deferred.empty() && w->deferred.begin()->first <= now) {
+      Client *c = w->deferred.begin()->second;
+      w->deferred.erase(w->deferred.begin());
+      if (c->resume()) {
+         rearm(w, c);
+      }
+      else {
+         drop(w, c);
+      }
+   }
+}
+
+/**
+ * run is the main loop for each reactor thread.  Every ready client has all of
+ * its complete messages handled, or its catch-up continued, then its socket is
+ * re-armed for the next event
+ */
+void *Reactor::run(void *arg) {
+   Worker *w = (Worker*)arg;
+   epoll_event events[MAX_EVENTS];
+   time_t last_sweep = time(NULL);
+   while (!__atomic_load_n(&w->reactor->done, __ATOMIC_ACQUIRE)) {
+      int timeout = SWEEP_INTERVAL * 1000;
+      if (!w->deferred.empty()) {
+         uint64_t now = monotonic_us();
+         uint64_t next = w->deferred.begin()->first;
+         //round up so we don't wake just before the client is due
+         uint64_t ms = next > now ? (next - now + 999) / 1000 : 0;
+         if (ms < (uint64_t)timeout) {
+            timeout = (int)ms;
+         }
+      }
+      int n = epoll_wait(w->epfd, events, MAX_EVENTS, timeout);
+      if (n == -1 && errno != EINTR) {
+         log(LERROR, "Reactor: epoll_wait failed: %s\n", strerror(errno));
+         break;
+      }
+      for (int i = 0; i < n; i++) {
+         Client *c = (Client*)events[i].data.ptr;
+         if (c == NULL) {
+            //woken by terminate, the eventfd is left set so every later wait returns too
+            continue;
+         }
+         bool ok = c->catchingUp() ? c->onWritable() : c->onReadable();
+         if (ok) {
+            rearm(w, c);
+         }
+         else {
+            drop(w, c);
+         }
+      }
+      resume(w);
+      time_t now = time(NULL);
+      if ((now - last_sweep) >= SWEEP_INTERVAL) {
+         sweep(w, now);
+         last_sweep = now;
+      }
+   }
+   return NULL;
+}
@@ -0,0 +1,96 @@
+/*
+   collabREate reactor.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __REACTOR_H
+#define __REACTOR_H
+
+#include <set>
+#include <vector>
+#include <utility>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+using namespace std;
+
+class Client;
+
+/**
+ * Reactor
+ * This class services every authenticated client connection from a small
+ * fixed pool of epoll threads (IO_THREADS) instead of dedicating a thread
+ * to each client.  It is used when IO_MODE is "epoll" in the config file.
+ * Each client is owned by exactly one thread, and its socket is armed
+ * one-shot so that its messages are always handled in order.  A client
+ * that exceeds its rate limit is left disarmed until it may continue, and
+ * one being sent a catch-up is armed for output until it has taken it all.
+ */
+class Reactor {
+public:
+   Reactor(int nthreads);
+   ~Reactor();
+
+   void start();
+
+   /**
+    * add hands an authenticated client over to the reactor.  From this
+    * point on the reactor owns the client and deletes it when the
+    * connection closes
+    * @param c the client to add
+    * @return false if the client could not be registered
+    */
+   bool add(Client *c);
+
+   /**
+    * size returns the number of clients currently being serviced
+    */
+   size_t size();
+
+   /**
+    * terminate wakes every worker thread and waits for it to exit
+    */
+   void terminate();
+
+private:
+   struct Worker {
+      Reactor *reactor;
+      int epfd;
+      int wakefd;     //eventfd registered with epfd to break out of epoll_wait
+      pthread_t tid;
+      bool started;
+      sem_t lock;
+      set<Client*> clients;
+      //throttled clients keyed by when they may be read again, worker thread only
+      set<pair<uint64_t,Client*> > deferred;
+   };
+
+   static void *run(void *arg);
+   static void drop(Worker *w, Client *c);
+   static void sweep(Worker *w, time_t now);
+   static void rearm(Worker *w, Client *c);
+   static void resume(Worker *w);
+
+   vector<Worker*> workers;
+   uint32_t next;
+   sem_t nextLock;
+   bool done;
+};
+
+#endif
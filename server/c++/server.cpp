@@ -43,6 +43,8 @@
 #include "db_mgr.h"
 #include "mgr_helper.h"
 #include "client.h"
+#include "reactor.h"
+#include "writer.h"
 
 #define ERROR_NO_USER "Failed to find user %s"
 #define ERROR_NO_PRIVS "drop_privs failed!"
@@ -80,9 +82,10 @@ void sigchld(int sig) {
 }
 
 struct ClientArgs {
-   ClientArgs(ConnectionManager *_cm, NetworkIO *_nio) : cm(_cm), nio(_nio) {};
+   ClientArgs(ConnectionManager *_cm, NetworkIO *_nio, Reactor *_reactor) : cm(_cm), nio(_nio), reactor(_reactor) {};
    ConnectionManager *cm;
    NetworkIO *nio;
+   Reactor *reactor;    //NULL unless IO_MODE is epoll
 };
 
 #define AUTH_TRIES 3
@@ -91,18 +94,31 @@ struct ClientArgs {
 void *client_func(void *arg) {
    if (arg) {
       ClientArgs *ca = (ClientArgs*)arg;
+      NetworkIO *nio = ca->nio;
       for (int i = 0; i < AUTH_TRIES; i++) {
          json_object *response = json_object_new_object();
          append_json_string_val(response, "type", MSG_AUTH_REPLY);
 
-         uint32_t uid = ca->cm->doAuth(ca->nio);
+         uint32_t features = 0;
+         uint32_t uid = ca->cm->doAuth(ca->nio, &features);
          if (uid < FIRST_BAD_UID) {
             append_json_int32_val(response, "reply", AUTH_REPLY_SUCCESS);
+            //older plugins don't look for this and never send anything that needs it
+            append_json_uint32_val(response, "features", features);
             ca->nio->writeJson(response);
             Client *c = new Client(ca->cm, ca->nio, uid);
-            delete ca;
-            c->run();
-            delete c;
+            c->setFeatures(features);
+            Reactor *reactor = ca->reactor;
+            nio = NULL;    //now owned by the client
+            if (reactor == NULL) {
+               c->run();
+               delete c;
+            }
+            else if (!reactor->add(c)) {
+               //on success the reactor owns the client from here on
+               c->terminate();
+               delete c;
+            }
             break;
          }
          else {
@@ -110,18 +126,22 @@ void *client_func(void *arg) {
             ca->nio->writeJson(response);
          }
       }
+      //nio is still ours if authentication never succeeded
+      delete nio;
+      delete ca;
    }
    return NULL;
 }
 
 //create a new thread to handle the new connection
-void start_client(ConnectionManager *cm, NetworkIO *nio) {
+//in epoll mode this thread only lives long enough to authenticate the client
+void start_client(ConnectionManager *cm, NetworkIO *nio, Reactor *reactor) {
    pthread_attr_t attr;
    pthread_attr_init(&attr);
    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
    pthread_t tid;
    //handle the new client in a new thread
-   pthread_create(&tid, &attr, client_func, new ClientArgs(cm, nio));
+   pthread_create(&tid, &attr, client_func, new ClientArgs(cm, nio, reactor));
 }
 
 /*
@@ -147,6 +167,17 @@ void loop(NetworkService *svc) {
    }
    //should choose between Basic and Database connection managers here
    mgr->start();
+   //all client output is queued and sent without blocking, so one slow
+   //client can't hold up delivery to everyone else
+   Writer writer(getIntOption(conf, "CLIENT_QUEUE_LIMIT", 16 * 1024 * 1024));
+   writer.start();
+   Reactor *reactor = NULL;
+   string io_mode = getStringOption(conf, "IO_MODE", "threads");
+   if (io_mode == "epoll") {
+      fprintf(stderr, "Using epoll reactor for client io\n");
+      reactor = new Reactor(getIntOption(conf, "IO_THREADS", 4));
+      reactor->start();
+   }
    //need to instantiate a ManagerHelper here as well
    ManagerHelper hlp(mgr, conf);
    hlp.start();
@@ -155,9 +186,14 @@ void loop(NetworkService *svc) {
       NetworkIO *nio = svc->accept();
       fprintf(stderr, "Accepted new client\n");
       if (nio) {
-         start_client(mgr, nio);
+         nio->setWriter(&writer);
+         start_client(mgr, nio, reactor);
       }
    }
+   if (reactor) {
+      reactor->terminate();
+   }
+   writer.terminate();
    while (!hlp.quit) {};
 }
 
@@ -303,6 +339,8 @@ int main(int argc, char **argv, char **envp) {
       daemon(1, 0);
    }
    writePidFile();
+   //only once we are done forking, the flusher thread would not survive it
+   startAsyncLog(conf);
    loop(svc);
    return 0;
 }
@@ -38,6 +38,7 @@
 #include <json-c/json.h>
 #include "client.h"
 #include "utils.h"
+#include "commands.h"
 #include "proj_info.h"
 #include "server_mgr.h"
 
@@ -54,6 +55,9 @@ using namespace std;
 #define DEFAULT_PORT 5043
 #define DEFAULT_HOST "localhost"
 
+//updates copied per transaction by migrate
+#define DEFAULT_MIGRATE_CHUNK 10000
+
 sem_t waiter;
 
 char *readLine(char *buf, int sz) {
@@ -91,6 +95,7 @@ ServerManager::ServerManager(json_object *p) {
    done = false;
    config = p;
    dbConn = NULL;
+   partitioned = false;
    json_fd = -1;
    port = getShortOption(config, "MANAGE_PORT", 5043);
    host = getStringOption(config, "MANAGE_HOST", DEFAULT_HOST);
@@ -170,6 +175,32 @@ void ServerManager::mng_stats(json_object *reply, ServerManager *sm) {
    printf("%s\n", json_object_get_string(stats));
 }
 
+void ServerManager::mng_compact_reply(json_object *obj, ServerManager *sm) {
+   json_object *val = json_object_object_get(obj, "superseded");
+   int64_t superseded = val ? json_object_get_int64(val) : -1;
+   if (superseded < 0) {
+      printf("\nCompaction failed (server not in database mode?)\n");
+   }
+   else {
+      printf("\nCompaction superseded %" PRId64 " updates\n", superseded);
+   }
+}
+
+void ServerManager::mng_limits(json_object *obj, ServerManager *sm) {
+   uint32_t client_msgs = 0, client_bytes = 0, project_msgs = 0, project_bytes = 0, burst_ms = 0;
+   uint32_from_json(obj, "client_msgs", &client_msgs);
+   uint32_from_json(obj, "client_bytes", &client_bytes);
+   uint32_from_json(obj, "project_msgs", &project_msgs);
+   uint32_from_json(obj, "project_bytes", &project_bytes);
+   uint32_from_json(obj, "burst_ms", &burst_ms);
+   const char *action = string_from_json(obj, "action");
+   printf("\nRate limits (0 is unlimited)\n");
+   printf("   per client:  %u updates/s, %u bytes/s\n", client_msgs, client_bytes);
+   printf("   per project: %u updates/s, %u bytes/s\n", project_msgs, project_bytes);
+   printf("   burst: %ums, excess updates are %s\n", burst_ms,
+          action && !strcmp(action, "reject") ? "rejected" : "delayed");
+}
+
 void ServerManager::mng_import_reply(json_object *obj, ServerManager *sm) {
    int status;
    if (!int32_from_json(obj, "status", &status) || status != MNG_MIGRATE_REPLY_SUCCESS) {
@@ -328,7 +359,10 @@ void ServerManager::deleteProject(int pid) {
       //insert into files values(stream_id, fname);
       const char * const parms[1] = {(char*)&pid};
       pid = htonl(pid);
-      PGresult *rset = PQexecPrepared(dbConn, "deleteUpdatesByPID",
+      PGresult *rset = PQexec(dbConn, "begin;");
+      PQclear(rset);
+      //a partitioned project's updates go with its partition
+      rset = PQexecPrepared(dbConn, partitioned ? "dropProjectUpdates" : "deleteUpdatesByPID",
                           1, //int nParams,   size of arrays that follow
                           parms, //parms,  //const char * const *paramValues, array of string values
                           plens, //const int *paramLengths,
@@ -336,21 +370,31 @@ void ServerManager::deleteProject(int pid) {
                           1); //int resultFormat); 0 == text, 1 == binary
 
       ExecStatusType qres = PQresultStatus(rset);
-      if (qres != PGRES_COMMAND_OK) {
-         fprintf(stderr, "deleteUpdatesByPID: %s\n", PQerrorMessage(dbConn));
+      bool ok = qres == PGRES_COMMAND_OK || qres == PGRES_TUPLES_OK;
+      if (!ok) {
+         fprintf(stderr, "%s: %s\n", partitioned ? "dropProjectUpdates" : "deleteUpdatesByPID", PQerrorMessage(dbConn));
+      }
+      else if (qres == PGRES_TUPLES_OK && *PQgetvalue(rset, 0, 0) == 0) {
+         fprintf(stderr, "project %d still shares its updates with forks, not deleted\n", ntohl(pid));
+         ok = false;
       }
       PQclear(rset);
-      rset = PQexecPrepared(dbConn, "deleteProjectByPID",
-                          1, //int nParams,   size of arrays that follow
-                          parms, //parms,  //const char * const *paramValues, array of string values
-                          plens, //const int *paramLengths,
-                          pformats, //const int *paramFormats,
-                          1); //int resultFormat); 0 == text, 1 == binary
+      if (ok) {
+         rset = PQexecPrepared(dbConn, "deleteProjectByPID",
+                             1, //int nParams,   size of arrays that follow
+                             parms, //parms,  //const char * const *paramValues, array of string values
+                             plens, //const int *paramLengths,
+                             pformats, //const int *paramFormats,
+                             1); //int resultFormat); 0 == text, 1 == binary
 
-      qres = PQresultStatus(rset);
-      if (qres != PGRES_COMMAND_OK) {
-         fprintf(stderr, "deleteProjectByPID: %s\n", PQerrorMessage(dbConn));
+         qres = PQresultStatus(rset);
+         if (qres != PGRES_COMMAND_OK) {
+            fprintf(stderr, "deleteProjectByPID: %s\n", PQerrorMessage(dbConn));
+            ok = false;
+         }
+         PQclear(rset);
       }
+      rset = PQexec(dbConn, ok ? "commit;" : "rollback;");
       PQclear(rset);
    }
    else {
@@ -542,19 +586,35 @@ void ServerManager::initQueries() {
       }
       PQclear(res);
       res = PQprepare(dbConn, "getAllUpdates",
-                      "select updateid,username,pid,json,created from updates where pid=$1 order by updateid asc",
+                      //includes whatever the project shares with its ancestors
+                      "with recursive lineage(pid,cutoff) as ("
+                         "select $1::integer, null::bigint "
+                         "union all "
+                         "select f.parent, least(f.cutoff, l.cutoff) from lineage l join forklist f on f.child = l.pid where f.cutoff is not null) "
+                      "select u.updateid,u.username,u.pid,u.json,u.created from lineage l join updates u on u.pid = l.pid "
+                      "where l.cutoff is null or u.updateid <= l.cutoff order by u.updateid asc",
                       0, NULL);
       if (PQresultStatus(res) != PGRES_COMMAND_OK) {
          fprintf(stderr, "getAllUpdates: %s\n", PQerrorMessage(dbConn));
       }
       PQclear(res);
       res = PQprepare(dbConn, "deleteUpdatesByPID",
-                      "delete from updates where pid=$1",
+                      //forks still depending on these updates keep the project from being deleted
+                      "delete from updates where pid=$1 and not exists (select 1 from forklist where parent=$1 and cutoff is not null)",
                       0, NULL);
       if (PQresultStatus(res) != PGRES_COMMAND_OK) {
          fprintf(stderr, "deleteUpdatesByPID: %s\n", PQerrorMessage(dbConn));
       }
       PQclear(res);
+      res = PQprepare(dbConn, "dropProjectUpdates",
+                      //refuses, returning false, while forks still depend on these updates
+                      "select drop_project_updates($1)",
+                      0, NULL);
+      //only present once updates is partitioned
+      PQclear(res);
+      res = PQexec(dbConn, "select relkind from pg_class where oid = to_regclass('updates');");
+      partitioned = PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1 && *PQgetvalue(res, 0, 0) == 'p';
+      PQclear(res);
       res = PQprepare(dbConn, "deleteProjectByPID",
                       "delete from projects where pid=$1",
                       0, NULL);
@@ -584,7 +644,7 @@ void ServerManager::initQueries() {
       }
       PQclear(res);
       res = PQprepare(dbConn, "postUpdate",
-                          "insert into updates (username,pid,cmd,json) values ($1,$2,$3,$4) returning updateid;",
+                          "insert into updates (username,pid,cmd,json,mask) values ($1,$2,$3,$4,$5) returning updateid;",
                           0, NULL);
       if (PQresultStatus(res) != PGRES_COMMAND_OK) {
          fprintf(stderr, "postUpdate: %s\n", PQerrorMessage(dbConn));
@@ -630,6 +690,223 @@ void ServerManager::dumpStats() {
    sem_wait(&waiter);
 }
 
+/**
+ * compact asks the server to compact the update log of a project
+ * this requires ServerHelper to be running
+ * @param pid the project to compact or 0 for every project that is due
+ */
+void ServerManager::compact(uint32_t pid) {
+   json_object *obj = json_object_new_object();
+   json_object_object_add_ex(obj, "pid", json_object_new_int(pid), JSON_NEW_CONST_KEY);
+   send_data(MNG_COMPACT, obj);
+   sem_wait(&waiter);
+}
+
+/**
+ * setLimits changes the server's rate limits and prints the result
+ * this requires ServerHelper to be running
+ * @param obj the limits to change, empty to just show the current limits
+ */
+void ServerManager::setLimits(json_object *obj) {
+   send_data(MNG_SET_LIMITS, obj);
+   sem_wait(&waiter);
+}
+
+/**
+ * readLimit prompts for one rate limit and adds it to obj unless left blank
+ */
+static void readLimit(json_object *obj, const char *prompt, const char *key) {
+   char resp[64];
+   printf("%s (blank to keep): ", prompt);
+   if (readLine(resp, sizeof(resp)) != NULL && isNumeric(resp)) {
+      json_object_object_add_ex(obj, key, json_object_new_int64(strtoul(resp, NULL, 0)), JSON_NEW_CONST_KEY);
+   }
+}
+
+/**
+ * execSql runs one or more statements that return no rows, rolling back
+ * the current transaction if any of them fail
+ * @return true on success
+ */
+static bool execSql(PGconn *conn, const char *sql, const char *what) {
+   PGresult *res = PQexec(conn, sql);
+   bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+   if (!ok) {
+      fprintf(stderr, "%s: %s\n", what, PQerrorMessage(conn));
+      PQclear(res);
+      res = PQexec(conn, "rollback;");
+   }
+   PQclear(res);
+   return ok;
+}
+
+/**
+ * selectInt64 runs a query that returns a single bigint, 0 for null
+ * @return true on success
+ */
+static bool selectInt64(PGconn *conn, const char *sql, int nParams, const char * const *parms, uint64_t *val) {
+   PGresult *res = PQexecParams(conn, sql, nParams, NULL, parms, NULL, NULL, 0);
+   bool ok = PQresultStatus(res) == PGRES_TUPLES_OK;
+   if (!ok) {
+      fprintf(stderr, "migrate: %s\n", PQerrorMessage(conn));
+   }
+   else {
+      *val = PQntuples(res) == 0 || PQgetisnull(res, 0, 0) ? 0 : strtoull(PQgetvalue(res, 0, 0), NULL, 10);
+   }
+   PQclear(res);
+   return ok;
+}
+
+//builds updates_part, the partitioned replacement for updates, along with a
+//partition for each existing project.  Until the swap, new projects get their
+//partitions in updates_part and every new update is mirrored into it.  Each
+//statement is idempotent so that an interrupted migration can be restarted
+static const char *migrate_setup =
+   "begin;"
+   "alter table updates add column if not exists mask BIGINT;"
+   "create table if not exists updates_part ("
+      "updateid BIGINT DEFAULT nextval('updates_updateid_seq') NOT NULL,"
+      "username text REFERENCES users(username),"
+      "pid INTEGER REFERENCES projects(pid) ON DELETE CASCADE,"
+      "cmd TEXT NOT NULL,"
+      "json TEXT NOT NULL,"
+      "created TIMESTAMP DEFAULT CURRENT_TIMESTAMP,"
+      "mask BIGINT,"
+      "PRIMARY KEY (updateid,pid)"
+   ") partition by list (pid);"
+   "create table if not exists updates_part_default partition of updates_part default;"
+   "create index if not exists updates_part_pid_index on updates_part(pid, updateid);"
+   //must match add_update_partition in dbschema.sql
+   "create or replace function add_update_partition() returns trigger as $$ "
+   "declare part text := 'updates_' || NEW.pid; "
+   "begin "
+      "if to_regclass(part) is null then "
+         "execute format('create table %I (like %I including defaults)', part, TG_ARGV[0]); "
+         "execute format('alter table %I attach partition %I for values in (%s)', "
+                        "TG_ARGV[0], part, NEW.pid); "
+      "end if; "
+      "return NEW; "
+   "end; $$ language plpgsql;"
+   "create or replace function drop_project_updates(ppid integer) returns boolean as $$ "
+   "begin "
+      "if exists (select 1 from forklist where parent = ppid and cutoff is not null) then "
+         "return false; "
+      "end if; "
+      "execute format('drop table if exists %I', 'updates_' || ppid); "
+      "delete from updates where pid = ppid; "
+      "return true; "
+   "end; $$ language plpgsql;"
+   "lock table projects in share row exclusive mode;"
+   "drop trigger if exists projects_add_partition on projects;"
+   "create trigger projects_add_partition after insert on projects "
+      "for each row execute procedure add_update_partition('updates_part');"
+   "do $$ declare r record; "
+   "begin "
+      "for r in select pid from projects loop "
+         "execute format('create table if not exists %I partition of updates_part for values in (%s)', "
+                        "'updates_' || r.pid, r.pid); "
+      "end loop; "
+   "end $$;"
+   "create or replace function mirror_update() returns trigger as $$ "
+   "begin "
+      "insert into updates_part values (NEW.*) on conflict do nothing; "
+      "return NEW; "
+   "end; $$ language plpgsql;"
+   //waits for inserts already in progress, so every update from here on is
+   //either visible to the copy below or mirrored
+   "drop trigger if exists updates_mirror on updates;"
+   "create trigger updates_mirror after insert on updates "
+      "for each row execute procedure mirror_update();"
+   "commit;";
+
+//copies the next chunk of updates at or below the swap point
+static const char *migrate_copy =
+   "insert into updates_part select * from updates where updateid > $1 and updateid <= $2 "
+   "on conflict do nothing;";
+
+//swaps updates_part in for updates.  The server's prepared statements are
+//re-planned against the new table the next time they run
+static const char *migrate_swap =
+   "begin;"
+   "lock table updates in access exclusive mode;"
+   "drop trigger updates_mirror on updates;"
+   "alter table updates rename to updates_unpartitioned;"
+   "alter index updates_pkey rename to updates_unpartitioned_pkey;"
+   "alter index if exists updates_pid_index rename to updates_unpartitioned_pid_index;"
+   "alter table updates_part rename to updates;"
+   "alter index updates_part_pkey rename to updates_pkey;"
+   "alter index updates_part_pid_index rename to updates_pid_index;"
+   "alter table updates_part_default rename to updates_default;"
+   "drop trigger projects_add_partition on projects;"
+   "create trigger projects_add_partition after insert on projects "
+      "for each row execute procedure add_update_partition('updates');"
+   "drop function mirror_update();"
+   "commit;";
+
+int ServerManager::migrate() {
+   if (mode != MODE_DB) {
+      fprintf(stderr, "this only makes sense in DB MODE !\n");
+      return -1;
+   }
+   if (partitioned) {
+      printf("The updates table is already partitioned, nothing to migrate\n");
+      return 0;
+   }
+   uint64_t chunk = getIntOption(config, "MIGRATE_CHUNK", DEFAULT_MIGRATE_CHUNK);
+   if (chunk == 0) {
+      chunk = DEFAULT_MIGRATE_CHUNK;
+   }
+
+   printf("Creating partitioned updates table\n");
+   if (!execSql(dbConn, migrate_setup, "migrate setup")) {
+      return -1;
+   }
+   //everything after this is being mirrored
+   uint64_t last = 0;
+   uint64_t end;
+   if (!selectInt64(dbConn, "select max(updateid) from updates;", 0, NULL, &end)) {
+      return -1;
+   }
+
+   char lastbuf[32];
+   char hibuf[32];
+   char chunkbuf[32];
+   snprintf(chunkbuf, sizeof(chunkbuf), "%" PRIu64, chunk - 1);
+   while (last < end) {
+      uint64_t hi;
+      snprintf(lastbuf, sizeof(lastbuf), "%" PRIu64, last);
+      const char * const nparms[2] = {lastbuf, chunkbuf};
+      //each chunk ends at the chunk'th updateid past last
+      if (!selectInt64(dbConn, "select updateid from updates where updateid > $1::bigint "
+                               "order by updateid offset $2::bigint limit 1;", 2, nparms, &hi)) {
+         return -1;
+      }
+      if (hi == 0 || hi > end) {
+         hi = end;
+      }
+      snprintf(hibuf, sizeof(hibuf), "%" PRIu64, hi);
+      const char * const cparms[2] = {lastbuf, hibuf};
+      PGresult *res = PQexecParams(dbConn, migrate_copy, 2, NULL, cparms, NULL, NULL, 0);
+      if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "migrate copy: %s\n", PQerrorMessage(dbConn));
+         PQclear(res);
+         return -1;
+      }
+      PQclear(res);
+      last = hi;
+      printf("Copied updates through %" PRIu64 " of %" PRIu64 "\n", last, end);
+   }
+
+   printf("Swapping in partitioned updates table\n");
+   if (!execSql(dbConn, migrate_swap, "migrate swap")) {
+      return -1;
+   }
+   partitioned = true;
+   printf("Migration complete.  The old table remains as updates_unpartitioned\n");
+   printf("and may be dropped once you are satisfied with the result\n");
+   return 0;
+}
+
 /**
  * shutdownServer sends a request to the server to shutdown the server nicely
  * this requires ServerHelper to be running
@@ -714,7 +991,7 @@ int ServerManager::exportDatabaseProject(uint32_t lpid) {
          }
          printf("exporting %d (%s)\n", lpid, pi.gpid.c_str());
          if (pi.parent > 0 ) {
-            fprintf(stderr, "This project was forked.  Note: lineage is not preserved with export.\n");
+            fprintf(stderr, "This project was forked.  Note: lineage is not preserved with export, inherited updates are exported with it.\n");
          }
 
          json_object *obj = json_object_new_object();
@@ -933,17 +1210,18 @@ int ServerManager::importDatabaseProject() {
          printf(".");
          const char *cmd = string_from_json(update, "type");
 
-         const int plens[4] = {0, 4, 0, 0};
-         static const int pformats[4] = {0, 1, 0, 0};
+         const int plens[5] = {0, 4, 0, 0, 8};
+         static const int pformats[5] = {0, 1, 0, 0, 1};
 
          int pid = htonl(newpid);
+         uint64_t mask = htonll((uint64_t)command_mask(command_id(cmd)));
 
          size_t jlen;
          const char *jstr = json_object_to_json_string_length(update, JSON_C_TO_STRING_PLAIN, &jlen);
-         const char * const parms[4] = {import_owner.c_str(), (char*)&pid, cmd, jstr};
+         const char * const parms[5] = {import_owner.c_str(), (char*)&pid, cmd, jstr, (char*)&mask};
 
          PGresult *rset = PQexecPrepared(dbConn, "postUpdate",
-                             4, //int nParams,   size of arrays that follow
+                             5, //int nParams,   size of arrays that follow
                              parms, //parms,  //const char * const *paramValues, array of string values
                              plens, //const int *paramLengths,
                              pformats, //const int *paramFormats,
@@ -1198,6 +1476,8 @@ void ServerManager::closeDB() {
       PQclear(res);
       res = PQexec(dbConn, "DEALLOCATE deleteUpdatesByPID;");
       PQclear(res);
+      res = PQexec(dbConn, "DEALLOCATE dropProjectUpdates;");
+      PQclear(res);
       res = PQexec(dbConn, "DEALLOCATE deleteProjectByPID;");
       PQclear(res);
       res = PQexec(dbConn, "DEALLOCATE addProject;");
@@ -1273,6 +1553,8 @@ void ServerManager::exec(int argc, char **argv) {
    handlers[MNG_PROJECT_IMPORT_REPLY] = mng_import_reply;
    handlers[MNG_PROJECT_LIST_REPLY] = mng_project_list;
    handlers[MNG_EXPORT_UPDATES] = mng_export_updates;
+   handlers[MNG_COMPACT_REPLY] = mng_compact_reply;
+   handlers[MNG_LIMITS] = mng_limits;
    handlers[MSG_ERROR] = msg_error;
 
 //   printf("Got %d args\n", argc);
@@ -1292,6 +1574,12 @@ void ServerManager::exec(int argc, char **argv) {
          sm->terminate();
          exit(0);
       }
+      //schema upgrades, which need not wait for the server
+      if (!strcmp("migrate", argv[2])) {
+         int res = sm->migrate();
+         sm->closeDB();
+         exit(res == 0 ? 0 : 1);
+      }
    }
    char resp[128];
    while (true) {
@@ -1306,7 +1594,9 @@ void ServerManager::exec(int argc, char **argv) {
       printf("7)  Export a Project to file *\n");
       printf("8)  Import a Project from file *\n");
       printf("9)  Delete a Project\n");
-      printf("10) Quit\n");
+      printf("10) Compact project update logs *\n");
+      printf("11) Show or change rate limits *\n");
+      printf("12) Quit\n");
       printf("\n");
       printf(" * requires CollabREate Server to be running\n");
       printf("   others commands only require the database to be running \n");
@@ -1630,10 +1920,40 @@ void ServerManager::exec(int argc, char **argv) {
             break;
          }
          case 10: {
+            if (sm->getMode() != MODE_DB) {
+               printf("this only makes sense in DB MODE !\n");
+               continue;
+            }
+            printf("Project to compact (0 for all projects): ");
+            if (readLine(resp, sizeof(resp)) == NULL) {
+               return;
+            }
+            if (isNumeric(resp)) {
+               sm->compact(strtoul(resp, NULL, 0));
+            }
+            break;
+         }
+         case 11: {
+            sm->setLimits(NULL);
+            printf("Change the rate limits? ");
+            if (askyn()) {
+               json_object *obj = json_object_new_object();
+               readLimit(obj, "Updates per second per client", "client_msgs");
+               readLimit(obj, "Bytes per second per client", "client_bytes");
+               readLimit(obj, "Updates per second per project", "project_msgs");
+               readLimit(obj, "Bytes per second per project", "project_bytes");
+               readLimit(obj, "Burst size in milliseconds", "burst_ms");
+               printf("Reject excess updates rather than delay them? ");
+               json_object_object_add_ex(obj, "action", json_object_new_string(askyn() ? "reject" : "delay"), JSON_NEW_CONST_KEY);
+               sm->setLimits(obj);
+            }
+            break;
+         }
+         case 12: {
             sm->terminate();
             return;
          }
-         case 11: {
+         case 13: {
             printf("Use of server startup/shutdown scripts (ie. /etc/init.d) is recommended.\n");
             printf("Are you sure you want to shutdown the server? ");
             if (askyn()) {
@@ -60,6 +60,7 @@ private:
    string import_owner;
    json_object *import_json;
    int mode;
+   bool partitioned;   //updates is partitioned by project
 
    sem_t waiter;
 
@@ -75,6 +76,8 @@ private:
    static void mng_import_reply(json_object *obj, ServerManager *sm);
    static void mng_project_list(json_object *obj, ServerManager *sm);
    static void mng_export_updates(json_object *obj, ServerManager *sm);
+   static void mng_compact_reply(json_object *obj, ServerManager *sm);
+   static void mng_limits(json_object *obj, ServerManager *sm);
    static void msg_error(json_object *obj, ServerManager *sm);
 
 public:
@@ -138,6 +141,28 @@ private:
 
    void dumpStats();
 
+   /**
+    * migrate converts a database whose updates table predates partitioning.
+    * Rows are copied in chunks while the server keeps running and the old
+    * table is swapped out in one short transaction at the end
+    * @return 0 on success
+    */
+   int migrate();
+
+   /**
+    * compact asks the server to compact the update log of a project
+    * this requires ServerHelper to be running
+    * @param pid the project to compact or 0 for every project that is due
+    */
+   void compact(uint32_t pid);
+
+   /**
+    * setLimits changes the server's rate limits and prints the result
+    * this requires ServerHelper to be running
+    * @param obj the limits to change, empty to just show the current limits
+    */
+   void setLimits(json_object *obj);
+
    /**
     * shutdownServer sends a request to the server to shutdown the server nicely
     * this requires ServerHelper to be running
@@ -0,0 +1,518 @@
+/*
+   collabREate update_log.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#include "update_log.h"
+#include "utils.h"
+
+//one sparse index entry is kept for every INDEX_INTERVAL records in a segment
+#define INDEX_INTERVAL 64
+
+//read size used when scanning a sealed segment
+#define READ_CHUNK (1024 * 1024)
+
+/*
+ * Each record on disk is a RecordHeader followed by len bytes of update.
+ * crc covers the updateid, cmd and the update.  Fields are in host byte
+ * order, logs are not expected to move between machines.
+ */
+struct RecordHeader {
+   uint32_t len;
+   uint32_t crc;
+   uint64_t updateid;
+   uint32_t cmd;
+   uint32_t reserved;
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init() {
+   for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) {
+         c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+      }
+      crc_table[i] = c;
+   }
+}
+
+static uint32_t crc_update(uint32_t crc, const void *data, size_t len) {
+   const uint8_t *p = (const uint8_t*)data;
+   crc = ~crc;
+   while (len--) {
+      crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+   }
+   return ~crc;
+}
+
+static uint32_t record_crc(uint64_t updateid, uint32_t cmd, const char *data, size_t len) {
+   uint32_t crc = crc_update(0, &updateid, sizeof(updateid));
+   crc = crc_update(crc, &cmd, sizeof(cmd));
+   return crc_update(crc, data, len);
+}
+
+static bool write_all(int fd, const char *data, size_t len) {
+   while (len) {
+      ssize_t n = ::write(fd, data, len);
+      if (n < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return false;
+      }
+      data += n;
+      len -= n;
+   }
+   return true;
+}
+
+static bool sync_dir(const string &dir) {
+   int dfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+   if (dfd == -1) {
+      return false;
+   }
+   bool ok = fsync(dfd) == 0;
+   ::close(dfd);
+   return ok;
+}
+
+UpdateLog::UpdateLog(const string &dir, size_t segment_size, SyncPolicy policy) {
+   pthread_once(&crc_once, crc_init);
+   this->dir = dir;
+   this->segment_size = segment_size;
+   this->policy = policy;
+   fd = -1;
+   dirty = false;
+   last_id = 0;
+   appends = syncs = 0;
+   active.first = active.last = 0;
+   active.size = 0;
+   active.records = 0;
+   sem_init(&lock, 0, 1);
+}
+
+UpdateLog::~UpdateLog() {
+   if (fd != -1) {
+      if (dirty) {
+         fdatasync(fd);
+      }
+      ::close(fd);
+   }
+   sem_destroy(&lock);
+}
+
+UpdateLog::SyncPolicy UpdateLog::parsePolicy(const string &name) {
+   if (name == "always") {
+      return SYNC_ALWAYS;
+   }
+   if (name == "never") {
+      return SYNC_NEVER;
+   }
+   return SYNC_PERIODIC;
+}
+
+string UpdateLog::segmentPath(uint64_t first) {
+   char name[32];
+   snprintf(name, sizeof(name), "/%020llu.log", (unsigned long long)first);
+   return dir + name;
+}
+
+void UpdateLog::noteRecord(Segment &seg, uint64_t updateid, off_t offset) {
+   if ((seg.records++ % INDEX_INTERVAL) == 0) {
+      IndexEntry e;
+      e.updateid = updateid;
+      e.offset = offset;
+      seg.index.push_back(e);
+   }
+   if (seg.first == 0) {
+      seg.first = updateid;
+   }
+   seg.last = updateid;
+}
+
+/**
+ * open creates the log directory if need be, recovers any existing segments
+ * and opens the active segment for appending
+ */
+bool UpdateLog::open() {
+   if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST) {
+      log(LERROR, "UpdateLog: unable to create %s: %s\n", dir.c_str(), strerror(errno));
+      return false;
+   }
+   DIR *d = opendir(dir.c_str());
+   if (d == NULL) {
+      log(LERROR, "UpdateLog: unable to read %s: %s\n", dir.c_str(), strerror(errno));
+      return false;
+   }
+   vector<uint64_t> firsts;
+   dirent *de;
+   while ((de = readdir(d)) != NULL) {
+      char *end;
+      uint64_t first = strtoull(de->d_name, &end, 10);
+      if (end != de->d_name && strcmp(end, ".log") == 0) {
+         firsts.push_back(first);
+      }
+   }
+   closedir(d);
+   sort(firsts.begin(), firsts.end());
+
+   for (size_t i = 0; i < firsts.size(); i++) {
+      Segment seg;
+      seg.path = segmentPath(firsts[i]);
+      seg.first = seg.last = 0;
+      seg.size = 0;
+      seg.records = 0;
+      if (i + 1 < firsts.size()) {
+         if (!recoverSealed(seg)) {
+            return false;
+         }
+         if (seg.records) {
+            last_id = seg.last;
+         }
+         sealed.push_back(seg);
+      }
+      else {
+         if (!recoverActive(seg)) {
+            return false;
+         }
+         if (seg.records == 0) {
+            //nothing survived, the next append starts a fresh segment
+            unlink(seg.path.c_str());
+            continue;
+         }
+         last_id = seg.last;
+         fd = ::open(seg.path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+         if (fd == -1) {
+            log(LERROR, "UpdateLog: unable to open %s: %s\n", seg.path.c_str(), strerror(errno));
+            return false;
+         }
+         active = seg;
+      }
+   }
+   return true;
+}
+
+/**
+ * recoverSealed rebuilds the index of a segment that was synced when it was
+ * rolled, so only the record headers are read
+ */
+bool UpdateLog::recoverSealed(Segment &seg) {
+   int sfd = ::open(seg.path.c_str(), O_RDONLY | O_CLOEXEC);
+   if (sfd == -1) {
+      log(LERROR, "UpdateLog: unable to open %s: %s\n", seg.path.c_str(), strerror(errno));
+      return false;
+   }
+   struct stat st;
+   fstat(sfd, &st);
+   off_t offset = 0;
+   RecordHeader hdr;
+   while (offset + (off_t)sizeof(hdr) <= st.st_size) {
+      if (pread(sfd, &hdr, sizeof(hdr), offset) != sizeof(hdr)) {
+         break;
+      }
+      if (offset + (off_t)sizeof(hdr) + hdr.len > st.st_size || hdr.updateid <= last_id) {
+         break;
+      }
+      noteRecord(seg, hdr.updateid, offset);
+      last_id = hdr.updateid;
+      offset += sizeof(hdr) + hdr.len;
+   }
+   if (offset != st.st_size) {
+      log(LERROR, "UpdateLog: %s is damaged after offset %lld, ignoring the remainder\n",
+          seg.path.c_str(), (long long)offset);
+   }
+   seg.size = offset;
+   ::close(sfd);
+   return true;
+}
+
+/**
+ * recoverActive loads the last segment into memory, verifying every record,
+ * and cuts the file back to the end of the last intact record
+ */
+bool UpdateLog::recoverActive(Segment &seg) {
+   int sfd = ::open(seg.path.c_str(), O_RDWR | O_CLOEXEC);
+   if (sfd == -1) {
+      log(LERROR, "UpdateLog: unable to open %s: %s\n", seg.path.c_str(), strerror(errno));
+      return false;
+   }
+   struct stat st;
+   fstat(sfd, &st);
+   hot.resize(st.st_size);
+   off_t got = 0;
+   while (got < st.st_size) {
+      ssize_t n = pread(sfd, &hot[got], st.st_size - got, got);
+      if (n <= 0) {
+         break;
+      }
+      got += n;
+   }
+   off_t offset = 0;
+   RecordHeader hdr;
+   while (offset + (off_t)sizeof(hdr) <= got) {
+      memcpy(&hdr, hot.data() + offset, sizeof(hdr));
+      const char *data = hot.data() + offset + sizeof(hdr);
+      if (offset + (off_t)sizeof(hdr) + hdr.len > got || hdr.updateid <= last_id ||
+          hdr.crc != record_crc(hdr.updateid, hdr.cmd, data, hdr.len)) {
+         break;
+      }
+      noteRecord(seg, hdr.updateid, offset);
+      last_id = hdr.updateid;
+      offset += sizeof(hdr) + hdr.len;
+   }
+   if (offset != st.st_size) {
+      log(LERROR, "UpdateLog: truncating %s from %lld to %lld bytes\n", seg.path.c_str(),
+          (long long)st.st_size, (long long)offset);
+      if (ftruncate(sfd, offset) == -1 || fdatasync(sfd) == -1) {
+         log(LERROR, "UpdateLog: unable to truncate %s: %s\n", seg.path.c_str(), strerror(errno));
+         ::close(sfd);
+         return false;
+      }
+   }
+   hot.resize(offset);
+   seg.size = offset;
+   ::close(sfd);
+   return true;
+}
+
+/**
+ * roll seals the active segment, if any, and starts a new one beginning
+ * with updateid.  Called with lock held.
+ */
+bool UpdateLog::roll(uint64_t updateid) {
+   if (fd != -1) {
+      if (fdatasync(fd) == 0) {
+         syncs++;
+      }
+      ::close(fd);
+      fd = -1;
+      dirty = false;
+      sealed.push_back(active);
+   }
+   active.path = segmentPath(updateid);
+   active.first = active.last = 0;
+   active.size = 0;
+   active.records = 0;
+   active.index.clear();
+   hot.clear();
+   fd = ::open(active.path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+   if (fd == -1) {
+      log(LERROR, "UpdateLog: unable to create %s: %s\n", active.path.c_str(), strerror(errno));
+      return false;
+   }
+   //make sure the new segment's directory entry survives a crash
+   sync_dir(dir);
+   return true;
+}
+
+/**
+ * append adds an update to the end of the log.  updateids must increase
+ */
+bool UpdateLog::append(uint64_t updateid, uint32_t cmd, const char *data, size_t len, bool sync) {
+   RecordHeader hdr;
+   hdr.len = (uint32_t)len;
+   hdr.crc = record_crc(updateid, cmd, data, len);
+   hdr.updateid = updateid;
+   hdr.cmd = cmd;
+   hdr.reserved = 0;
+   bool ok = false;
+   sem_wait(&lock);
+   if (updateid <= last_id) {
+      log(LERROR, "UpdateLog: update %llu out of order, last was %llu\n",
+          (unsigned long long)updateid, (unsigned long long)last_id);
+   }
+   else if ((fd == -1 || (size_t)active.size >= segment_size) && !roll(updateid)) {
+      //roll has already complained
+   }
+   else {
+      size_t start = hot.size();
+      hot.append((const char*)&hdr, sizeof(hdr));
+      hot.append(data, len);
+      if (write_all(fd, hot.data() + start, hot.size() - start)) {
+         noteRecord(active, updateid, active.size);
+         active.size += sizeof(hdr) + len;
+         last_id = updateid;
+         appends++;
+         dirty = true;
+         if (policy == SYNC_ALWAYS && sync && fdatasync(fd) == 0) {
+            syncs++;
+            dirty = false;
+         }
+         ok = true;
+      }
+      else {
+         log(LERROR, "UpdateLog: write to %s failed: %s\n", active.path.c_str(), strerror(errno));
+         //don't leave a partial record behind for the next append to follow
+         hot.resize(start);
+         if (ftruncate(fd, active.size) == -1) {
+            log(LERROR, "UpdateLog: unable to truncate %s: %s\n", active.path.c_str(), strerror(errno));
+         }
+      }
+   }
+   sem_post(&lock);
+   return ok;
+}
+
+void UpdateLog::sync() {
+   sem_wait(&lock);
+   if (dirty && fd != -1) {
+      if (fdatasync(fd) == 0) {
+         syncs++;
+      }
+      dirty = false;
+   }
+   sem_post(&lock);
+}
+
+/**
+ * seek finds the offset in seg of an indexed record at or before the first
+ * record following after
+ */
+off_t UpdateLog::seek(const Segment &seg, uint64_t after) {
+   size_t lo = 0;
+   size_t hi = seg.index.size();
+   //find the first index entry with updateid > after, the one before it is where to start
+   while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (seg.index[mid].updateid <= after) {
+         lo = mid + 1;
+      }
+      else {
+         hi = mid;
+      }
+   }
+   return lo == 0 ? 0 : seg.index[lo - 1].offset;
+}
+
+/**
+ * scanSegment visits the records of a sealed segment that follow after,
+ * reading the file in large chunks
+ * @param stopped set to true if the visitor stopped the scan
+ * @return false if the segment could not be read
+ */
+bool UpdateLog::scanSegment(const Segment &seg, uint64_t after, Visitor visit, void *user, bool *stopped) {
+   *stopped = false;
+   int sfd = ::open(seg.path.c_str(), O_RDONLY | O_CLOEXEC);
+   if (sfd == -1) {
+      log(LERROR, "UpdateLog: unable to open %s: %s\n", seg.path.c_str(), strerror(errno));
+      return false;
+   }
+   bool ok = true;
+   off_t offset = seek(seg, after);
+   string buf;
+   while (offset < seg.size) {
+      RecordHeader hdr;
+      size_t want = READ_CHUNK;
+      if ((off_t)want > seg.size - offset) {
+         want = seg.size - offset;
+      }
+      buf.resize(want);
+      ssize_t n = pread(sfd, &buf[0], want, offset);
+      if (n < (ssize_t)sizeof(hdr)) {
+         ok = false;
+         break;
+      }
+      size_t pos = 0;
+      while (pos + sizeof(hdr) <= (size_t)n) {
+         memcpy(&hdr, buf.data() + pos, sizeof(hdr));
+         if (pos + sizeof(hdr) + hdr.len > (size_t)n) {
+            break;
+         }
+         if (hdr.updateid > after && !visit(hdr.updateid, hdr.cmd, buf.data() + pos + sizeof(hdr), hdr.len, user)) {
+            *stopped = true;
+            ::close(sfd);
+            return true;
+         }
+         pos += sizeof(hdr) + hdr.len;
+      }
+      if (pos == 0) {
+         //a single record larger than READ_CHUNK
+         memcpy(&hdr, buf.data(), sizeof(hdr));
+         buf.resize(hdr.len);
+         if (pread(sfd, &buf[0], hdr.len, offset + sizeof(hdr)) != (ssize_t)hdr.len) {
+            ok = false;
+            break;
+         }
+         if (hdr.updateid > after && !visit(hdr.updateid, hdr.cmd, buf.data(), hdr.len, user)) {
+            *stopped = true;
+            break;
+         }
+         pos = sizeof(hdr) + hdr.len;
+      }
+      offset += pos;
+   }
+   if (!ok) {
+      log(LERROR, "UpdateLog: short read from %s\n", seg.path.c_str());
+   }
+   ::close(sfd);
+   return ok;
+}
+
+/**
+ * scan visits, in order, every update with an updateid greater than after.
+ * Segment details and the needed part of the active segment are copied while
+ * holding the lock so that appends are never held up by a slow visitor.
+ */
+bool UpdateLog::scan(uint64_t after, Visitor visit, void *user) {
+   vector<Segment> todo;
+   string tail;
+   sem_wait(&lock);
+   for (vector<Segment>::iterator i = sealed.begin(); i != sealed.end(); i++) {
+      if ((*i).records && (*i).last > after) {
+         todo.push_back(*i);
+      }
+   }
+   if (active.records && active.last > after) {
+      tail = hot.substr(seek(active, after));
+   }
+   sem_post(&lock);
+
+   for (vector<Segment>::iterator i = todo.begin(); i != todo.end(); i++) {
+      bool stopped;
+      if (!scanSegment(*i, after, visit, user, &stopped)) {
+         return false;
+      }
+      if (stopped) {
+         //skipping ahead would leave a gap in what the visitor has seen
+         return true;
+      }
+   }
+   size_t pos = 0;
+   RecordHeader hdr;
+   while (pos + sizeof(hdr) <= tail.size()) {
+      memcpy(&hdr, tail.data() + pos, sizeof(hdr));
+      if (hdr.updateid > after && !visit(hdr.updateid, hdr.cmd, tail.data() + pos + sizeof(hdr), hdr.len, user)) {
+         break;
+      }
+      pos += sizeof(hdr) + hdr.len;
+   }
+   return true;
+}
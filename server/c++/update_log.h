@@ -0,0 +1,151 @@
+/*
+   collabREate update_log.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __UPDATE_LOG_H
+#define __UPDATE_LOG_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+#include <semaphore.h>
+
+using namespace std;
+
+/**
+ * UpdateLog
+ * Durable storage for the updates of a single basic mode project.  Updates
+ * are appended to a directory of segment files, each named for the first
+ * updateid it holds and rolled over once it reaches a configured size.  A
+ * record is a fixed header (payload length, checksum, updateid, command)
+ * followed by the update exactly as it was sent to clients, so it can be
+ * sent again without being parsed.
+ *
+ * Only the active segment is kept in memory.  Sealed segments are synced
+ * when they are rolled and afterwards only read from disk, with a sparse
+ * index of updateid to file offset so that a catch-up can seek straight to
+ * the first update a client is missing.  On open, the active segment is
+ * checked record by record and anything after the last intact record, such
+ * as a write torn by a crash, is cut off.
+ */
+class UpdateLog {
+public:
+   enum SyncPolicy {
+      SYNC_ALWAYS,     //fdatasync after every append
+      SYNC_PERIODIC,   //fdatasync when sync() is called, by the owner's timer
+      SYNC_NEVER       //leave it to the kernel, segments are still synced when sealed
+   };
+
+   /**
+    * Visitor is handed each update by scan
+    * @return false to stop the scan
+    */
+   typedef bool (*Visitor)(uint64_t updateid, uint32_t cmd, const char *data, size_t len, void *user);
+
+   /**
+    * @param dir directory holding this log's segments
+    * @param segment_size segments are rolled once they reach this many bytes
+    * @param policy when appends are forced to disk
+    */
+   UpdateLog(const string &dir, size_t segment_size, SyncPolicy policy);
+   ~UpdateLog();
+
+   /**
+    * open creates the log directory if need be, recovers any existing segments
+    * and opens the active segment for appending
+    * @return false if the log can't be used
+    */
+   bool open();
+
+   /**
+    * append adds an update to the end of the log.  updateids must increase
+    * @param sync false to leave an SYNC_ALWAYS sync to the next append, so
+    * that a run of updates is synced once, after its last update
+    * @return false if the update could not be written
+    */
+   bool append(uint64_t updateid, uint32_t cmd, const char *data, size_t len, bool sync = true);
+
+   /**
+    * scan visits, in order, every update with an updateid greater than after.
+    * Nothing further is visited once the visitor returns false
+    * @return false if a segment could not be read
+    */
+   bool scan(uint64_t after, Visitor visit, void *user);
+
+   /**
+    * sync forces any appends made since the last sync to disk
+    */
+   void sync();
+
+   uint64_t lastId() {
+      return last_id;
+   }
+
+   uint64_t getAppends() {
+      return appends;
+   }
+
+   uint64_t getSyncs() {
+      return syncs;
+   }
+
+   static SyncPolicy parsePolicy(const string &name);
+
+private:
+   struct IndexEntry {
+      uint64_t updateid;
+      off_t offset;
+   };
+
+   struct Segment {
+      string path;
+      uint64_t first;     //first and last updateids in the segment, 0 if empty
+      uint64_t last;
+      off_t size;
+      uint32_t records;
+      vector<IndexEntry> index;   //every INDEX_INTERVAL'th record, for seeking
+   };
+
+   bool recoverSealed(Segment &seg);
+   bool recoverActive(Segment &seg);
+   bool roll(uint64_t updateid);
+   void noteRecord(Segment &seg, uint64_t updateid, off_t offset);
+   static bool scanSegment(const Segment &seg, uint64_t after, Visitor visit, void *user, bool *stopped);
+   static off_t seek(const Segment &seg, uint64_t after);
+   string segmentPath(uint64_t first);
+
+   string dir;
+   size_t segment_size;
+   SyncPolicy policy;
+
+   vector<Segment> sealed;
+   Segment active;
+   string hot;          //the active segment's contents, exactly as on disk
+   int fd;
+   bool dirty;
+   uint64_t last_id;
+
+   uint64_t appends;
+   uint64_t syncs;
+
+   sem_t lock;
+};
+
+#endif
@@ -23,6 +23,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
+#include <ctype.h>
 #include <time.h>
 #include <sys/select.h>
 #include <sys/socket.h>
@@ -34,6 +35,8 @@
 #include <errno.h>
 #include <err.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <string>
 #include <openssl/md5.h>
 #include <json-c/json.h>
@@ -68,9 +71,41 @@ union uLongLong {
 };
 
 static FILE *logger = stderr;
-static int log_level = 0;
+int log_level = 0;
 time_t ping_timeout = 300;
 
+//bytes of formatted messages each thread can have waiting to be written
+#define LOG_RING_SIZE (256 * 1024)
+
+//messages up to this length are formatted on the stack
+#define LOG_LINE_MAX 1024
+
+//longer messages are cut to this length
+#define LOG_MESSAGE_MAX (LOG_RING_SIZE / 4)
+
+/*
+ * LogRing is a single producer, single consumer queue of messages.  Only
+ * the owning thread advances head and only the flusher advances tail, so
+ * neither side ever takes a lock.  Each message is a uint32_t length
+ * followed by the text, wrapping around the end of buf as needed.  A ring
+ * given up by an exiting thread is reused by the next thread to log.
+ */
+struct LogRing {
+   char buf[LOG_RING_SIZE];
+   uint64_t head;
+   uint64_t tail;
+   uint64_t dropped;    //messages discarded because the ring was full
+   uint32_t owned;
+   LogRing *next;
+};
+
+static LogRing *log_rings;
+static pthread_key_t log_ring_key;
+static bool log_async = false;
+static uint32_t log_flush_ms;
+static sem_t log_wake;
+static sem_t log_flush_lock;
+
 uint64_t htonll(uint64_t val) {
    uLongLong ull;
    ull.ll = val;
@@ -80,6 +115,12 @@ uint64_t htonll(uint64_t val) {
    return ull.ll;
 }
 
+uint64_t monotonic_us() {
+   timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
 /**
  * toByteArray - generate a byte array representation of the specified
  *               string
@@ -178,21 +219,174 @@ string getMD5(const string &s) {
    return getMD5(s.c_str(), s.length());
 }
 
-void vlog(const char *format, va_list va) {
-   vfprintf(logger, format, va);
+static void release_ring(void *ring) {
+   __atomic_store_n(&((LogRing*)ring)->owned, 0, __ATOMIC_RELEASE);
 }
 
-void vlog(int verbosity, const char *format, va_list va) {
-   if (verbosity <= log_level) {
-      vlog(format, va);
+static LogRing *get_ring() {
+   LogRing *r = (LogRing*)pthread_getspecific(log_ring_key);
+   if (r != NULL) {
+      return r;
    }
+   for (r = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+      uint32_t unowned = 0;
+      if (__atomic_compare_exchange_n(&r->owned, &unowned, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+         break;
+      }
+   }
+   if (r == NULL) {
+      r = (LogRing*)calloc(1, sizeof(LogRing));
+      r->owned = 1;
+      r->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+      while (!__atomic_compare_exchange_n(&log_rings, &r->next, r, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      }
+   }
+   pthread_setspecific(log_ring_key, r);
+   return r;
 }
 
-void log(const char *format, ...) {
-   va_list va;
-   va_start(va, format);
-   vlog(format, va);
-   va_end(va);
+static void ring_copy_in(LogRing *r, uint64_t pos, const void *data, size_t len) {
+   size_t off = pos % LOG_RING_SIZE;
+   size_t first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+   memcpy(r->buf + off, data, first);
+   memcpy(r->buf, (const char*)data + first, len - first);
+}
+
+static void ring_copy_out(LogRing *r, uint64_t pos, void *data, size_t len) {
+   size_t off = pos % LOG_RING_SIZE;
+   size_t first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+   memcpy(data, r->buf + off, first);
+   memcpy((char*)data + first, r->buf, len - first);
+}
+
+/*
+ * ring_put never waits.  If the flusher has fallen so far behind that the
+ * message won't fit, it is counted and dropped.
+ */
+static void ring_put(LogRing *r, const char *msg, uint32_t len) {
+   uint64_t head = r->head;
+   uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+   uint64_t need = sizeof(len) + len;
+   if (need > LOG_RING_SIZE - (head - tail)) {
+      __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+      sem_post(&log_wake);
+      return;
+   }
+   ring_copy_in(r, head, &len, sizeof(len));
+   ring_copy_in(r, head + sizeof(len), msg, len);
+   __atomic_store_n(&r->head, head + need, __ATOMIC_RELEASE);
+   if ((head - tail) < LOG_RING_SIZE / 2 && (head + need - tail) >= LOG_RING_SIZE / 2) {
+      //don't wait for the timer once a ring is half full
+      sem_post(&log_wake);
+   }
+}
+
+/*
+ * flush_rings collects everything waiting in every ring and writes it with
+ * a single call
+ */
+static void flush_rings() {
+   string batch;
+   for (LogRing *r = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+      uint64_t tail = r->tail;
+      uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+      while (tail < head) {
+         uint32_t len;
+         ring_copy_out(r, tail, &len, sizeof(len));
+         size_t at = batch.length();
+         batch.resize(at + len);
+         ring_copy_out(r, tail + sizeof(len), &batch[at], len);
+         tail += sizeof(len) + len;
+      }
+      __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+      uint64_t dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+      if (dropped) {
+         char note[64];
+         snprintf(note, sizeof(note), "Log overflow: %llu messages dropped\n", (unsigned long long)dropped);
+         batch += note;
+      }
+   }
+   if (batch.length()) {
+      fwrite(batch.data(), 1, batch.length(), logger);
+      fflush(logger);
+   }
+}
+
+static void *log_flusher(void *arg) {
+   while (true) {
+      timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += log_flush_ms / 1000;
+      deadline.tv_nsec += (log_flush_ms % 1000) * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+         deadline.tv_sec++;
+         deadline.tv_nsec -= 1000000000L;
+      }
+      sem_timedwait(&log_wake, &deadline);
+      sem_wait(&log_flush_lock);
+      flush_rings();
+      sem_post(&log_flush_lock);
+   }
+   return NULL;
+}
+
+//write out whatever is still queued when the process exits
+static void log_at_exit() {
+   timespec deadline;
+   clock_gettime(CLOCK_REALTIME, &deadline);
+   deadline.tv_sec++;
+   //exit may be called from the flusher's own thread via a signal, so don't wait forever
+   bool locked = sem_timedwait(&log_flush_lock, &deadline) == 0;
+   flush_rings();
+   if (locked) {
+      sem_post(&log_flush_lock);
+   }
+}
+
+void startAsyncLog(json_object *conf) {
+   if (log_async) {
+      return;
+   }
+   log_flush_ms = getIntOption(conf, "LOG_FLUSH_MS", 100);
+   if (log_flush_ms == 0) {
+      log_flush_ms = 1;
+   }
+   sem_init(&log_wake, 0, 0);
+   sem_init(&log_flush_lock, 0, 1);
+   pthread_key_create(&log_ring_key, release_ring);
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   pthread_t tid;
+   if (pthread_create(&tid, &attr, log_flusher, NULL) == 0) {
+      atexit(log_at_exit);
+      log_async = true;
+   }
+   pthread_attr_destroy(&attr);
+}
+
+void vlog(int verbosity, const char *format, va_list va) {
+   if (verbosity > log_level) {
+      return;
+   }
+   if (!log_async) {
+      vfprintf(logger, format, va);
+      return;
+   }
+   char line[LOG_LINE_MAX];
+   va_list again;
+   va_copy(again, va);
+   int len = vsnprintf(line, sizeof(line), format, va);
+   if (len >= (int)sizeof(line)) {
+      char *big = (char*)malloc(len + 1);
+      vsnprintf(big, len + 1, format, again);
+      ring_put(get_ring(), big, len < LOG_MESSAGE_MAX ? len : LOG_MESSAGE_MAX);
+      free(big);
+   }
+   else if (len > 0) {
+      ring_put(get_ring(), line, len);
+   }
+   va_end(again);
 }
 
 void log(int verbosity, const char *format, ...) {
@@ -202,38 +396,46 @@ void log(int verbosity, const char *format, ...) {
    va_end(va);
 }
 
+//returns true: the buffer was well formed, check *obj
+//       false: the buffer does not contain valid json
+bool parseJson(string &json_buffer, json_object **obj) {
+   json_tokener *tok = json_tokener_new();
+   enum json_tokener_error jerr;
+   bool result = true;
+   *obj = json_tokener_parse_ex(tok, json_buffer.c_str(), json_buffer.length());
+   jerr = json_tokener_get_error(tok);
+   if (jerr == json_tokener_continue) {
+      //json object is syntactically correct, but incomplete
+      log(LDEBUG, "json_tokener_continue for %s\n", json_buffer.c_str());
+   }
+   else if (jerr != json_tokener_success) {
+      result = false;
+   }
+   else if (*obj != NULL) {
+      //we extracted a json object from the front of the string
+      //queue it and trim the string
+      log(LDEBUG, "jerr == json_tokener_success for %s\n", json_buffer.c_str());
+      json_buffer.erase(0, tok->char_offset);
+   }
+   json_tokener_free(tok);
+   return result;
+}
+
 //returns true: a read was performed, check *obj
 //       false: a timeout occurred
 bool readJson(int sock, string &json_buffer, json_object **obj, time_t timeout) {
    char buf[2048];
-   json_tokener *tok = json_tokener_new();
-   enum json_tokener_error jerr;
-   bool result = true;
    *obj = NULL;
    while (1) {
       //start by seeing if we have a complete json object already buffered
-      json_tokener_reset(tok);
-      *obj = json_tokener_parse_ex(tok, json_buffer.c_str(), json_buffer.length());
-      jerr = json_tokener_get_error(tok);
-      if (jerr == json_tokener_continue) {
-         //json object is syntactically correct, but incomplete
-         log(LDEBUG, "json_tokener_continue for %s\n", json_buffer.c_str());
-      }
-      else if (jerr != json_tokener_success) {
+      if (!parseJson(json_buffer, obj)) {
          //need to reconnect socket and in the meantime start caching event locally
          log(LERROR, "jerr != json_tokener_success for %s\n", json_buffer.c_str());
          break;
       }
       else if (*obj != NULL) {
-         //we extracted a json object from the front of the string
-         //queue it and trim the string
-         log(LDEBUG, "jerr == json_tokener_success for %s\n", json_buffer.c_str());
-         json_buffer.erase(0, tok->char_offset);
          break;
       }
-      else {
-         //can we ever get here?
-      }
 
       //couldn't buid a json object so we need to read more data
       fd_set rset;
@@ -242,8 +444,8 @@ bool readJson(int sock, string &json_buffer, json_object **obj, time_t timeout)
       FD_SET(sock, &rset);
       int nfds = select(sock + 1, &rset, NULL, NULL, timeout ? &timeo : NULL);
       if (nfds == 0) {
-         result = false;
-         break;
+         log(LDEBUG, "current json_buffer: %s\n", json_buffer.c_str());
+         return false;
       }
       ssize_t len = recv(sock, buf, sizeof(buf), 0);
       if (len <= 0) {
@@ -252,9 +454,8 @@ bool readJson(int sock, string &json_buffer, json_object **obj, time_t timeout)
       }
       json_buffer.append(buf, len);   //append new data into json buffer
    }
-   json_tokener_free(tok);
    log(LDEBUG, "current json_buffer: %s\n", json_buffer.c_str());
-   return result;
+   return true;
 }
 
 ssize_t sendAll(int fd, const void *buf, ssize_t size) {
@@ -475,6 +676,279 @@ void append_json_uint64_val(json_object *obj, const char *key, uint64_t value) {
    json_object_object_add_ex(obj, key, json_object_new_int64(value), JSON_NEW_CONST_KEY);
 }
 
+bool splice_updateid(string &out, const char *json, size_t len, uint64_t updateid) {
+   size_t start = 0;
+   while (start < len && isspace(json[start])) {
+      start++;
+   }
+   size_t end = len;
+   while (end > start && isspace(json[end - 1])) {
+      end--;
+   }
+   if (end - start < 2 || json[start] != '{' || json[end - 1] != '}') {
+      return false;
+   }
+   if (memmem(json + start, end - start, "\"updateid\"", 10) != NULL) {
+      return false;
+   }
+   bool empty = true;
+   for (size_t i = start + 1; i < end - 1; i++) {
+      if (!isspace(json[i])) {
+         empty = false;
+         break;
+      }
+   }
+   char member[40];
+   //formatted as json-c formats int64 values
+   int mlen = snprintf(member, sizeof(member), "%s\"updateid\":%lld}", empty ? "" : ",", (long long)updateid);
+   out.append(json + start, end - start - 1);
+   out.append(member, mlen);
+   return true;
+}
+
+//deepest nesting scan_update will follow
+#define SCAN_MAX_DEPTH 64
+
+struct JsonScan {
+   const char *p;
+   const char *end;
+   int depth;
+};
+
+static void scan_ws(JsonScan &s) {
+   while (s.p < s.end && (*s.p == ' ' || *s.p == '\t' || *s.p == '\n' || *s.p == '\r')) {
+      s.p++;
+   }
+}
+
+static bool scan_string(JsonScan &s, bool *escaped) {
+   *escaped = false;
+   s.p++;   //opening quote
+   while (s.p < s.end) {
+      unsigned char ch = *s.p++;
+      if (ch == '"') {
+         return true;
+      }
+      if (ch < 0x20) {
+         return false;
+      }
+      if (ch == '\\') {
+         if (s.p == s.end) {
+            return false;
+         }
+         *escaped = true;
+         ch = *s.p++;
+         if (ch == 'u') {
+            for (int i = 0; i < 4; i++) {
+               if (s.p == s.end || !isxdigit(*s.p++)) {
+                  return false;
+               }
+            }
+         }
+         else if (ch == 0 || strchr("\"\\/bfnrt", ch) == NULL) {
+            return false;
+         }
+      }
+   }
+   return false;
+}
+
+static bool scan_digits(JsonScan &s) {
+   if (s.p == s.end || !isdigit(*s.p)) {
+      return false;
+   }
+   while (s.p < s.end && isdigit(*s.p)) {
+      s.p++;
+   }
+   return true;
+}
+
+static bool scan_number(JsonScan &s) {
+   if (*s.p == '-') {
+      s.p++;
+   }
+   if (s.p < s.end && *s.p == '0') {
+      s.p++;
+   }
+   else if (!scan_digits(s)) {
+      return false;
+   }
+   if (s.p < s.end && *s.p == '.') {
+      s.p++;
+      if (!scan_digits(s)) {
+         return false;
+      }
+   }
+   if (s.p < s.end && (*s.p == 'e' || *s.p == 'E')) {
+      s.p++;
+      if (s.p < s.end && (*s.p == '+' || *s.p == '-')) {
+         s.p++;
+      }
+      if (!scan_digits(s)) {
+         return false;
+      }
+   }
+   return true;
+}
+
+static bool scan_literal(JsonScan &s, const char *lit, size_t len) {
+   if ((size_t)(s.end - s.p) < len || memcmp(s.p, lit, len) != 0) {
+      return false;
+   }
+   s.p += len;
+   return true;
+}
+
+static bool scan_object(JsonScan &s, const char **type, size_t *type_len, bool *has_updateid);
+
+static bool scan_value(JsonScan &s) {
+   if (s.p == s.end) {
+      return false;
+   }
+   bool escaped;
+   switch (*s.p) {
+      case '{':
+         return scan_object(s, NULL, NULL, NULL);
+      case '[':
+         if (++s.depth > SCAN_MAX_DEPTH) {
+            return false;
+         }
+         s.p++;
+         scan_ws(s);
+         if (s.p < s.end && *s.p == ']') {
+            s.p++;
+            s.depth--;
+            return true;
+         }
+         while (true) {
+            scan_ws(s);
+            if (!scan_value(s)) {
+               return false;
+            }
+            scan_ws(s);
+            if (s.p == s.end) {
+               return false;
+            }
+            if (*s.p == ']') {
+               s.p++;
+               s.depth--;
+               return true;
+            }
+            if (*s.p++ != ',') {
+               return false;
+            }
+         }
+      case '"':
+         return scan_string(s, &escaped);
+      case 't':
+         return scan_literal(s, "true", 4);
+      case 'f':
+         return scan_literal(s, "false", 5);
+      case 'n':
+         return scan_literal(s, "null", 4);
+      default:
+         return scan_number(s);
+   }
+}
+
+/*
+ * scan_object walks an object starting at its opening brace.  Members of
+ * the top level object are checked for type and updateid when type is not NULL.
+ * Top level keys containing escapes and repeated types fail the scan so that
+ * the message is checked against what json-c will actually decode.
+ */
+static bool scan_object(JsonScan &s, const char **type, size_t *type_len, bool *has_updateid) {
+   bool seen_type = false;
+   if (++s.depth > SCAN_MAX_DEPTH) {
+      return false;
+   }
+   s.p++;
+   scan_ws(s);
+   if (s.p < s.end && *s.p == '}') {
+      s.p++;
+      s.depth--;
+      return true;
+   }
+   while (true) {
+      scan_ws(s);
+      if (s.p == s.end || *s.p != '"') {
+         return false;
+      }
+      const char *key = s.p + 1;
+      bool key_escaped;
+      if (!scan_string(s, &key_escaped)) {
+         return false;
+      }
+      size_t key_len = s.p - 1 - key;
+      scan_ws(s);
+      if (s.p == s.end || *s.p++ != ':') {
+         return false;
+      }
+      scan_ws(s);
+      const char *val = s.p;
+      bool val_escaped = false;
+      if (s.p < s.end && *s.p == '"') {
+         if (!scan_string(s, &val_escaped)) {
+            return false;
+         }
+      }
+      else if (!scan_value(s)) {
+         return false;
+      }
+      if (type != NULL) {
+         if (key_escaped) {
+            //an escaped key may spell type or updateid, leave it to json-c
+            return false;
+         }
+         if (key_len == 4 && memcmp(key, "type", 4) == 0) {
+            if (seen_type) {
+               //json-c keeps the last duplicate, don't guess which one wins
+               return false;
+            }
+            seen_type = true;
+            if (*val == '"' && !val_escaped) {
+               *type = val + 1;
+               *type_len = s.p - val - 2;
+            }
+            else {
+               *type = NULL;
+            }
+         }
+         else if (key_len == 8 && memcmp(key, "updateid", 8) == 0) {
+            *has_updateid = true;
+         }
+      }
+      scan_ws(s);
+      if (s.p == s.end) {
+         return false;
+      }
+      if (*s.p == '}') {
+         s.p++;
+         s.depth--;
+         return true;
+      }
+      if (*s.p++ != ',') {
+         return false;
+      }
+   }
+}
+
+bool scan_update(const char *json, size_t len, const char **type, size_t *type_len, bool *has_updateid) {
+   JsonScan s;
+   s.p = json;
+   s.end = json + len;
+   s.depth = 0;
+   *type = NULL;
+   *type_len = 0;
+   *has_updateid = false;
+   scan_ws(s);
+   if (s.p == s.end || *s.p != '{' || !scan_object(s, type, type_len, has_updateid)) {
+      return false;
+   }
+   scan_ws(s);
+   return s.p == s.end;
+}
+
 void append_json_uint32_val(json_object *obj, const char *key, uint32_t value) {
    append_json_uint64_val(obj, key, value);
 }
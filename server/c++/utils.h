@@ -143,6 +143,8 @@ using namespace std;
 #define MSG_GET_PROJ_PERMS_REPLY     "get_proj_perms_reply"
 #define MSG_SET_PROJ_PERMS           "set_proj_perms"
 #define MSG_SET_PROJ_PERMS_REPLY     "set_proj_perms_reply"
+#define MSG_UPDATE_BATCH             "update_batch"
+#define MSG_ACK_UPDATEID_RANGE       "ack_updateid_range"
 
 #define MSG_ERROR                    "collab_error"
 #define MSG_FATAL                    "collab_fatal"
@@ -154,6 +156,10 @@ using namespace std;
 
 #define PROTOCOL_VERSION             4
 
+//optional protocol features, offered by the plugin in its auth_request
+//and confirmed by the server in its auth_reply
+#define FEATURE_UPDATE_BATCH         0x1
+
 //the above commands are grouped in order to provide
 //permissions based on these masks
 
@@ -190,6 +196,10 @@ using namespace std;
 #define MNG_PROJECT_IMPORT_REPLY     "mng_project_import_reply"
 #define MNG_IMPORT_UPDATE            "mng_import_update"
 #define MNG_EXPORT_UPDATES           "mng_export_updates"
+#define MNG_COMPACT                  "mng_compact"
+#define MNG_COMPACT_REPLY            "mng_compact_reply"
+#define MNG_SET_LIMITS               "mng_set_limits"
+#define MNG_LIMITS                   "mng_limits"
 #define MNG_MIGRATE_REPLY_SUCCESS    1
 #define MNG_MIGRATE_REPLY_FAIL       0
 
@@ -237,6 +247,9 @@ extern time_t ping_timeout;
 uint64_t htonll(uint64_t val);
 #define ntohll(x) htonll(x)
 
+//microseconds on the monotonic clock, for measuring intervals
+uint64_t monotonic_us();
+
 uint8_t *toByteArray(string hexString, uint32_t *rlen);
 bool isNumeric(string s);
 bool isHex(string s);
@@ -245,13 +258,31 @@ string toHexString(const uint8_t *buf, int len);
 string getMD5(const void *tohash, int len);
 string getMD5(const string &s);
 
-void log(const char *format, ...);
+extern int log_level;
+
 void vlog(int verbosity, const char *format, va_list va);
 void log(int verbosity, const char *format, ...);
 
+/*
+ * LOG tests the verbosity before any of its arguments are evaluated, for
+ * messages whose arguments are expensive to produce.  A message that would
+ * be discarded costs a single comparison
+ */
+#define LOG(verbosity, ...) ((verbosity) <= log_level ? log((verbosity), __VA_ARGS__) : (void)0)
+
+/**
+ * startAsyncLog moves log output off the calling threads.  Each thread
+ * formats its messages into a ring buffer of its own and a background
+ * thread writes them out in batches every LOG_FLUSH_MS milliseconds, or
+ * sooner if a ring is filling up.  Until this is called, and in programs
+ * that never call it, messages are written as they are logged.
+ */
+void startAsyncLog(json_object *conf);
+
 extern const char *permStrings[];
 extern size_t permStringsLength;
 
+bool parseJson(string &json_buffer, json_object **obj);
 bool readJson(int sock, string &json_buffer, json_object **obj, time_t timeout = 0);
 ssize_t sendAll(int fd, const void *buf, ssize_t size);
 bool writeJson(int fd, json_object *obj);
@@ -286,6 +317,32 @@ void append_json_uint64_val(json_object *obj, const char *key, uint64_t value);
 void append_json_uint32_val(json_object *obj, const char *key, uint32_t value);
 void append_json_int32_val(json_object *obj, const char *key, int32_t value);
 
+/**
+ * splice_updateid appends a serialized json object to out with an updateid
+ * member added, without parsing it.  Objects that already carry an updateid
+ * can't be spliced and are left to the caller.
+ * @param out receives the amended object
+ * @param json the serialized object
+ * @param len length of json
+ * @param updateid the value to add
+ * @return false if json was not spliced, in which case out is unchanged
+ */
+bool splice_updateid(string &out, const char *json, size_t len, uint64_t updateid);
+
+/**
+ * scan_update checks that a serialized message is a well formed json object
+ * and finds its top level "type" without building any json objects
+ * @param json the serialized message
+ * @param len length of json
+ * @param type receives the start of the type string, or NULL if there is no
+ * type or it contains escapes
+ * @param type_len receives the length of the type string
+ * @param has_updateid set true if the object has a top level updateid
+ * @return false if json is not a single well formed object, or if it has
+ * escaped top level keys or more than one type, which must be fully parsed
+ */
+bool scan_update(const char *json, size_t len, const char **type, size_t *type_len, bool *has_updateid);
+
 uint8_t *hex_from_json(json_object *json, const char *key, uint32_t *len); //qfree this result
 const char *string_from_json(json_object *json, const char *key);
 bool bool_from_json(json_object *json, const char *key, bool *val);
@@ -0,0 +1,148 @@
+/*
+   collabREate writer.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "writer.h"
+#include "io.h"
+#include "utils.h"
+
+//maximum number of events to collect in a single epoll_wait
+#define MAX_EVENTS 64
+
+Writer::Writer(size_t limit) {
+   this->limit = limit;
+   done = false;
+   started = false;
+   sem_init(&lock, 0, 1);
+   epfd = epoll_create1(EPOLL_CLOEXEC);
+   if (epfd == -1) {
+      log(LERROR, "Writer: epoll_create1 failed: %s\n", strerror(errno));
+   }
+   wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+   epoll_event ev;
+   memset(&ev, 0, sizeof(ev));
+   ev.events = EPOLLIN;
+   ev.data.ptr = NULL;   //never a watched connection
+   if (wakefd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev) == -1) {
+      log(LERROR, "Writer: failed to create wakeup eventfd: %s\n", strerror(errno));
+   }
+}
+
+Writer::~Writer() {
+   terminate();
+   if (wakefd != -1) {
+      ::close(wakefd);
+   }
+   ::close(epfd);
+   sem_destroy(&lock);
+}
+
+void Writer::start() {
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   //left joinable so that terminate can wait for it
+   started = pthread_create(&tid, &attr, run, (void*)this) == 0;
+   pthread_attr_destroy(&attr);
+}
+
+void Writer::terminate() {
+   __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+   uint64_t one = 1;
+   if (wakefd != -1 && write(wakefd, &one, sizeof(one)) != sizeof(one)) {
+      log(LERROR, "Writer: failed to wake writer: %s\n", strerror(errno));
+   }
+   if (started) {
+      pthread_join(tid, NULL);
+      started = false;
+   }
+}
+
+void Writer::watch(NetworkIO *nio) {
+   epoll_event ev;
+   memset(&ev, 0, sizeof(ev));
+   ev.events = EPOLLOUT | EPOLLONESHOT;
+   ev.data.ptr = nio;
+   sem_wait(&lock);
+   if (watched.find(nio) != watched.end()) {
+      //already registered, just re-arm it
+      epoll_ctl(epfd, EPOLL_CTL_MOD, nio->getFd(), &ev);
+   }
+   else if (epoll_ctl(epfd, EPOLL_CTL_ADD, nio->getFd(), &ev) == 0) {
+      watched.insert(nio);
+   }
+   sem_post(&lock);
+}
+
+void Writer::forget(NetworkIO *nio) {
+   sem_wait(&lock);
+   if (watched.erase(nio)) {
+      epoll_ctl(epfd, EPOLL_CTL_DEL, nio->getFd(), NULL);
+   }
+   sem_post(&lock);
+}
+
+/**
+ * run waits for watched sockets to become writable and flushes as much of
+ * their queued output as they will take.  Connections are checked against
+ * the watched set before being touched since they may have been closed
+ * after epoll_wait returned.
+ */
+void *Writer::run(void *arg) {
+   Writer *w = (Writer*)arg;
+   epoll_event events[MAX_EVENTS];
+   while (!__atomic_load_n(&w->done, __ATOMIC_ACQUIRE)) {
+      int n = epoll_wait(w->epfd, events, MAX_EVENTS, -1);
+      if (n == -1) {
+         if (errno == EINTR) {
+            continue;
+         }
+         log(LERROR, "Writer: epoll_wait failed: %s\n", strerror(errno));
+         break;
+      }
+      sem_wait(&w->lock);
+      for (int i = 0; i < n; i++) {
+         NetworkIO *nio = (NetworkIO*)events[i].data.ptr;
+         //the wakeup eventfd (NULL) is never in watched
+         if (w->watched.find(nio) == w->watched.end()) {
+            continue;
+         }
+         if (nio->flush()) {
+            //still more to send
+            epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLOUT | EPOLLONESHOT;
+            ev.data.ptr = nio;
+            epoll_ctl(w->epfd, EPOLL_CTL_MOD, nio->getFd(), &ev);
+         }
+         else {
+            w->watched.erase(nio);
+            epoll_ctl(w->epfd, EPOLL_CTL_DEL, nio->getFd(), NULL);
+         }
+      }
+      sem_post(&w->lock);
+   }
+   return NULL;
+}
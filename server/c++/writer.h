@@ -0,0 +1,88 @@
+/*
+   collabREate writer.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __WRITER_H
+#define __WRITER_H
+
+#include <set>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+using namespace std;
+
+class NetworkIO;
+
+/**
+ * Writer
+ * A single thread that drains the outbound queues of client connections
+ * whose sockets could not accept everything written to them.  Writes to a
+ * client never block the caller; anything the socket won't take right away
+ * is queued on the client's NetworkIO and handed to the Writer, which
+ * finishes the job whenever the socket becomes writable again.
+ */
+class Writer {
+public:
+   /**
+    * @param limit the maximum number of bytes that may be queued for a single
+    * client before that client is disconnected for not keeping up
+    */
+   Writer(size_t limit);
+   ~Writer();
+
+   void start();
+
+   /**
+    * terminate wakes the writer thread and waits for it to exit
+    */
+   void terminate();
+
+   /**
+    * watch asks the writer to flush nio once its socket becomes writable
+    * @param nio the connection with queued output
+    */
+   void watch(NetworkIO *nio);
+
+   /**
+    * forget stops watching a connection that is about to be closed
+    * @param nio the connection being closed
+    */
+   void forget(NetworkIO *nio);
+
+   size_t getLimit() {
+      return limit;
+   }
+
+private:
+   static void *run(void *arg);
+
+   int epfd;
+   int wakefd;     //eventfd registered with epfd to break out of epoll_wait
+   pthread_t tid;
+   bool started;
+   size_t limit;
+   bool done;
+
+   //connections currently registered with epfd
+   set<NetworkIO*> watched;
+   sem_t lock;
+};
+
+#endif